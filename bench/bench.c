@@ -0,0 +1,608 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define OUT_MAX (64 * 1024)
+#define POLL_US 1000
+/* the shell echoes it back once every command before it is done */
+#define SYNC_CMD "echo bench-sync\n"
+#define SYNC_MARK "bench-sync"
+/* the phase the stats show once the initial copy is over */
+#define WATCH_MARK ", watching\n"
+#define STATS_POLL_MS 20
+
+typedef struct BenchOpts
+{
+    const char *binary;
+    const char *workdir;
+    const char *add_flags;
+    long mutations;
+    double rate;
+    long timeout_ms;
+    gen_opts gen;
+} bench_opts;
+
+/* running sop-backup with its shell on a pipe */
+typedef struct Backup
+{
+    pid_t pid;
+    int in;
+    int out;
+    int err;
+    char out_buf[OUT_MAX];
+    size_t out_len;
+    char err_buf[OUT_MAX];
+    size_t err_len;
+    char reply[OUT_MAX]; /* stdout up to the last mark seen */
+} backup;
+
+/* what the replica has to show before a mutation counts as applied */
+typedef struct Pending
+{
+    char dst[PATH_MAX];
+    char gone[PATH_MAX]; /* old name of a rename, must disappear too */
+    int exists;
+    off_t size;
+    struct timespec mtime;
+    double start_ms;
+    long file;
+} pending;
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-b binary] [-w workdir] [-a \"add flags\"] [-n files] [-D depth] [-F fanout]\n"
+            "       [-z min:max bytes] [-l symlink %%] [-p sparse %%] [-m mutations] [-r mutations/s]\n"
+            "       [-t timeout ms] [-S seed]\n",
+            name);
+    exit(EXIT_FAILURE);
+}
+
+static void parse_opts(int argc, char **argv, bench_opts *opts)
+{
+    int c;
+
+    opts->binary = "./sop-backup";
+    opts->workdir = "/tmp/sop-bench";
+    opts->add_flags = "";
+    opts->mutations = 200;
+    opts->rate = 50;
+    opts->timeout_ms = 10000;
+    opts->gen = (gen_opts){2000, 3, 4, 512, 1 << 20, 5, 2, 1};
+
+    while ((c = getopt(argc, argv, "b:w:a:n:D:F:z:l:p:m:r:t:S:")) != -1)
+    {
+        switch (c)
+        {
+            case 'b':
+                opts->binary = optarg;
+                break;
+            case 'w':
+                opts->workdir = optarg;
+                break;
+            case 'a':
+                opts->add_flags = optarg;
+                break;
+            case 'n':
+                opts->gen.files = atol(optarg);
+                break;
+            case 'D':
+                opts->gen.depth = atoi(optarg);
+                break;
+            case 'F':
+                opts->gen.fanout = atoi(optarg);
+                break;
+            case 'z':
+            {
+                long long min, max;
+                if (sscanf(optarg, "%lld:%lld", &min, &max) != 2 || min < 0 || max < min)
+                    usage(argv[0]);
+                opts->gen.size_min = min;
+                opts->gen.size_max = max;
+                break;
+            }
+            case 'l':
+                opts->gen.symlink_pct = atoi(optarg);
+                break;
+            case 'p':
+                opts->gen.sparse_pct = atoi(optarg);
+                break;
+            case 'm':
+                opts->mutations = atol(optarg);
+                break;
+            case 'r':
+                opts->rate = atof(optarg);
+                break;
+            case 't':
+                opts->timeout_ms = atol(optarg);
+                break;
+            case 'S':
+                opts->gen.seed = strtoull(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (opts->gen.files < 1 || opts->gen.depth < 0 || opts->gen.fanout < 1 || opts->rate <= 0)
+        usage(argv[0]);
+}
+
+/* start the backup shell in its own session, its exit signals the whole group
+ * stdout goes to a pseudo terminal so the shell answers line by line instead of
+ * holding its replies in a full stdio buffer
+ */
+static void backup_start(backup *b, const char *binary)
+{
+    int in[2], err[2];
+    int out = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if (out < 0 || grantpt(out) || unlockpt(out) || pipe(in) || pipe(err))
+    {
+        perror("pty");
+        exit(EXIT_FAILURE);
+    }
+
+    b->pid = fork();
+    if (b->pid < 0)
+    {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (b->pid == 0)
+    {
+        struct termios tio;
+        int tty;
+
+        setsid();
+        tty = open(ptsname(out), O_RDWR | O_NOCTTY);
+        if (tty < 0 || tcgetattr(tty, &tio) != 0)
+            _exit(127);
+        cfmakeraw(&tio);
+        tcsetattr(tty, TCSANOW, &tio);
+        dup2(in[0], STDIN_FILENO);
+        dup2(tty, STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        close(tty);
+        close(in[1]);
+        close(out);
+        close(err[0]);
+        unsetenv("SOP_BACKUP_TRACE");
+        execl(binary, binary, (char *)NULL);
+        perror("execl");
+        _exit(127);
+    }
+
+    close(in[0]);
+    close(err[1]);
+    b->in = in[1];
+    b->out = out;
+    b->err = err[0];
+    b->out_len = b->err_len = 0;
+    fcntl(b->out, F_SETFL, O_NONBLOCK);
+    fcntl(b->err, F_SETFL, O_NONBLOCK);
+}
+
+static void backup_send(backup *b, const char *line)
+{
+    size_t len = strlen(line);
+    if (write(b->in, line, len) != (ssize_t)len)
+        perror("write");
+}
+
+/* append what one pipe has to its buffer, the oldest half goes when it fills up */
+static void drain(int fd, char *buf, size_t *len)
+{
+    for (;;)
+    {
+        if (*len + 1 >= OUT_MAX)
+        {
+            memmove(buf, buf + OUT_MAX / 2, *len - OUT_MAX / 2);
+            *len -= OUT_MAX / 2;
+        }
+        ssize_t c = read(fd, buf + *len, OUT_MAX - 1 - *len);
+        if (c <= 0)
+            break;
+        *len += c;
+        buf[*len] = '\0';
+    }
+}
+
+/* wait until mark shows up on stdout or stderr, consuming it and keeping what came before in reply
+ * returns: 0 once seen, -1 on timeout
+ */
+static int backup_wait(backup *b, const char *mark, int on_stderr, long timeout_ms)
+{
+    double deadline = now_ms() + timeout_ms;
+    char *buf = on_stderr ? b->err_buf : b->out_buf;
+    size_t *len = on_stderr ? &b->err_len : &b->out_len;
+
+    for (;;)
+    {
+        drain(b->out, b->out_buf, &b->out_len);
+        drain(b->err, b->err_buf, &b->err_len);
+
+        char *found = *len ? strstr(buf, mark) : NULL;
+        if (found)
+        {
+            size_t used = found - buf + strlen(mark);
+            memcpy(b->reply, buf, found - buf);
+            b->reply[found - buf] = '\0';
+            memmove(buf, buf + used, *len - used + 1);
+            *len -= used;
+            return 0;
+        }
+
+        double left = deadline - now_ms();
+        if (left <= 0)
+            return -1;
+        struct pollfd fds[2] = {{b->out, POLLIN, 0}, {b->err, POLLIN, 0}};
+        poll(fds, 2, left > 100 ? 100 : (int)left + 1);
+    }
+}
+
+/* poll the stats until the initial copy is over, independent of any tracing
+ * returns: 0 once watching, -1 on timeout
+ */
+static int backup_wait_copied(backup *b, long timeout_ms)
+{
+    double deadline = now_ms() + timeout_ms;
+
+    while (now_ms() < deadline)
+    {
+        backup_send(b, "stats\n" SYNC_CMD);
+        if (backup_wait(b, SYNC_MARK, 0, deadline - now_ms()) != 0)
+            return -1;
+        if (strstr(b->reply, WATCH_MARK) != NULL)
+            return 0;
+        usleep(STATS_POLL_MS * 1000);
+    }
+    return -1;
+}
+
+static void backup_stop(backup *b)
+{
+    backup_send(b, "exit\n");
+    close(b->in);
+
+    for (int i = 0; i < 100; i++)
+    {
+        if (waitpid(b->pid, NULL, WNOHANG) == b->pid)
+            break;
+        drain(b->out, b->out_buf, &b->out_len);
+        drain(b->err, b->err_buf, &b->err_len);
+        usleep(50 * 1000);
+        if (i == 99)
+        {
+            kill(-b->pid, SIGKILL);
+            waitpid(b->pid, NULL, 0);
+        }
+    }
+    close(b->out);
+    close(b->err);
+}
+
+static long tree_files;
+static unsigned long long tree_bytes;
+
+static int count_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    if (flag == FTW_F && S_ISREG(st->st_mode))
+    {
+        tree_files++;
+        tree_bytes += st->st_size;
+    }
+    return 0;
+}
+
+/* regular files and their bytes below path */
+static void count_tree(const char *path, long *files, unsigned long long *bytes)
+{
+    tree_files = 0;
+    tree_bytes = 0;
+    nftw(path, count_entry, 64, FTW_PHYS);
+    *files = tree_files;
+    *bytes = tree_bytes;
+}
+
+static int pending_done(const pending *p, int check_size)
+{
+    struct stat st;
+
+    if (p->gone[0] && lstat(p->gone, &st) == 0)
+        return 0;
+    if (!p->exists)
+        return lstat(p->dst, &st) == -1 && errno == ENOENT;
+
+    /* the copy sets the mtime last, so a matching mtime means the data is complete */
+    return lstat(p->dst, &st) == 0 && st.st_mtim.tv_sec == p->mtime.tv_sec && st.st_mtim.tv_nsec == p->mtime.tv_nsec &&
+           (!check_size || st.st_size == p->size);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, long cnt, double q)
+{
+    if (cnt == 0)
+        return 0;
+    long i = (long)(q * cnt + 0.999999) - 1;
+    return sorted[i < 0 ? 0 : i >= cnt ? cnt - 1 : i];
+}
+
+/* path of rel inside the source or replica of the workdir
+ * returns: 0 on success, -1 if it does not fit
+ */
+static int tree_path(char *buf, const bench_opts *opts, const char *side, const char *rel)
+{
+    if (snprintf(buf, PATH_MAX, "%s/%s/%s", opts->workdir, side, rel) >= PATH_MAX)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+/* a file without a mutation in flight, -1 if none was found quickly */
+static long pick_file(gen_tree *tree, uint64_t *state)
+{
+    for (int i = 0; i < 16; i++)
+    {
+        long f = rng_next(state) % tree->cnt;
+        if (tree->files[f].rel != NULL && !tree->files[f].busy)
+            return f;
+    }
+    return -1;
+}
+
+/* apply one random change to the source and describe what the replica must show */
+static int mutate(const bench_opts *opts, gen_tree *tree, uint64_t *state, long seq, pending *p)
+{
+    char src[PATH_MAX], old_src[PATH_MAX], rel[PATH_MAX];
+    struct stat st;
+    int kind = rng_next(state) % 100;
+    long f = pick_file(tree, state);
+
+    memset(p, 0, sizeof(*p));
+    p->file = -1;
+    if (f < 0 || kind < 25)
+    {
+        /* create */
+        snprintf(rel, sizeof(rel), "%s/m%ld", tree->dirs[rng_next(state) % tree->dir_cnt], seq);
+        f = gen_tree_add(tree, rel, rng_size(state, opts->gen.size_min, opts->gen.size_max));
+        if (tree_path(src, opts, "src", rel) != 0 || write_random_file(src, tree->files[f].size, state) != 0)
+            return -1;
+    }
+    else if (kind < 60)
+    {
+        /* rewrite */
+        tree->files[f].size = rng_size(state, opts->gen.size_min, opts->gen.size_max);
+        if (tree_path(src, opts, "src", tree->files[f].rel) != 0 ||
+            write_random_file(src, tree->files[f].size, state) != 0)
+            return -1;
+    }
+    else if (kind < 75)
+    {
+        /* append */
+        if (tree_path(src, opts, "src", tree->files[f].rel) != 0)
+            return -1;
+        int fd = open(src, O_WRONLY | O_APPEND);
+        char tail[4096];
+        memset(tail, (int)seq, sizeof(tail));
+        if (fd < 0 || write(fd, tail, sizeof(tail)) != (ssize_t)sizeof(tail) || close(fd) != 0)
+            return -1;
+    }
+    else if (kind < 90)
+    {
+        /* delete */
+        if (tree_path(src, opts, "src", tree->files[f].rel) != 0 ||
+            tree_path(p->dst, opts, "dst", tree->files[f].rel) != 0 || unlink(src) != 0)
+            return -1;
+        free(tree->files[f].rel);
+        tree->files[f].rel = NULL;
+        p->start_ms = now_ms();
+        return 0;
+    }
+    else
+    {
+        /* rename inside the same directory */
+        snprintf(rel, sizeof(rel), "%s.r%ld", tree->files[f].rel, seq);
+        if (tree_path(old_src, opts, "src", tree->files[f].rel) != 0 ||
+            tree_path(p->gone, opts, "dst", tree->files[f].rel) != 0 || tree_path(src, opts, "src", rel) != 0 ||
+            rename(old_src, src) != 0)
+            return -1;
+        free(tree->files[f].rel);
+        tree->files[f].rel = strdup(rel);
+    }
+
+    p->start_ms = now_ms();
+    if (lstat(src, &st) != 0 || tree_path(p->dst, opts, "dst", tree->files[f].rel) != 0)
+        return -1;
+    p->exists = 1;
+    p->size = st.st_size;
+    p->mtime = st.st_mtim;
+    p->file = f;
+    tree->files[f].busy = 1;
+    return 0;
+}
+
+/* wait until the backup watches the source, a probe in the root is only
+ * handled once every directory has its watch
+ */
+static int wait_watching(const bench_opts *opts)
+{
+    char src[PATH_MAX], dst[PATH_MAX];
+    struct stat st;
+
+    for (int attempt = 0; attempt < 20; attempt++)
+    {
+        snprintf(src, sizeof(src), "%s/src/.bench-probe-%d", opts->workdir, attempt);
+        snprintf(dst, sizeof(dst), "%s/dst/.bench-probe-%d", opts->workdir, attempt);
+        int fd = open(src, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd >= 0)
+            close(fd);
+
+        for (double deadline = now_ms() + 500; now_ms() < deadline; usleep(POLL_US))
+        {
+            if (lstat(dst, &st) == 0)
+                return 0;
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    bench_opts opts;
+    gen_tree tree;
+    backup *b;
+    char src[PATH_MAX], dst[PATH_MAX], rst[PATH_MAX], line[PATH_MAX * 4];
+
+    parse_opts(argc, argv, &opts);
+    snprintf(src, sizeof(src), "%s/src", opts.workdir);
+    snprintf(dst, sizeof(dst), "%s/dst", opts.workdir);
+    snprintf(rst, sizeof(rst), "%s/restore", opts.workdir);
+
+    if (remove_tree(opts.workdir) != 0 || mkdir(opts.workdir, 0777) != 0 || mkdir(src, 0777) != 0)
+    {
+        perror(opts.workdir);
+        return EXIT_FAILURE;
+    }
+
+    if (gen_tree_create(src, &opts.gen, &tree) != 0)
+    {
+        perror("generate");
+        return EXIT_FAILURE;
+    }
+    sync();
+
+    /* dedup targets hold recipes, so only mtimes tell when a copy is done */
+    int check_size = strstr(opts.add_flags, "-D") == NULL;
+
+    b = malloc(sizeof(backup));
+    if (b == NULL)
+        return EXIT_FAILURE;
+    backup_start(b, opts.binary);
+
+    /* initial copy */
+    snprintf(line, sizeof(line), "add %s %s %s\n", opts.add_flags, src, dst);
+    double t0 = now_ms();
+    backup_send(b, line);
+    int copy_done = backup_wait_copied(b, opts.timeout_ms * 100) == 0;
+    double copy_ms = now_ms() - t0;
+
+    long copied_files;
+    unsigned long long copied_bytes;
+    count_tree(dst, &copied_files, &copied_bytes);
+
+    /* mutations paced at opts.rate, each timed until the replica shows it */
+    uint64_t state = opts.gen.seed ^ 0x5bd1e995;
+    pending *pend = calloc(opts.mutations > 0 ? opts.mutations : 1, sizeof(pending));
+    double *lat = calloc(opts.mutations > 0 ? opts.mutations : 1, sizeof(double));
+    long issued = 0, applied = 0, failed = 0, open_cnt = 0;
+    int watching = copy_done && wait_watching(&opts) == 0;
+
+    double start = now_ms();
+    while (watching && (issued < opts.mutations || open_cnt > 0))
+    {
+        double now = now_ms();
+        if (issued < opts.mutations && now >= start + issued * 1000.0 / opts.rate)
+        {
+            if (mutate(&opts, &tree, &state, issued, &pend[issued]) == 0)
+                open_cnt++;
+            else
+                pend[issued].start_ms = -1, failed++;
+            issued++;
+            continue;
+        }
+
+        for (long i = 0; i < issued; i++)
+        {
+            if (pend[i].start_ms < 0)
+                continue;
+            if (pending_done(&pend[i], check_size))
+            {
+                lat[applied++] = now - pend[i].start_ms;
+            }
+            else if (now - pend[i].start_ms < opts.timeout_ms)
+            {
+                continue;
+            }
+            if (pend[i].file >= 0)
+                tree.files[pend[i].file].busy = 0;
+            pend[i].start_ms = -1;
+            open_cnt--;
+        }
+        usleep(POLL_US);
+    }
+    long lost = issued - applied - failed;
+    qsort(lat, applied, sizeof(double), cmp_double);
+    double lat_sum = 0;
+    for (long i = 0; i < applied; i++)
+        lat_sum += lat[i];
+
+    /* restore of the whole replica, the shell echoes the marker once it is done */
+    snprintf(line, sizeof(line), "restore %s %s\n" SYNC_CMD, rst, dst);
+    t0 = now_ms();
+    backup_send(b, line);
+    int restore_done = backup_wait(b, SYNC_MARK, 0, opts.timeout_ms * 100) == 0;
+    double restore_ms = now_ms() - t0;
+    long restored_files;
+    unsigned long long restored_bytes;
+    count_tree(rst, &restored_files, &restored_bytes);
+
+    backup_stop(b);
+
+    printf("{\n");
+    printf("  \"binary\": \"%s\",\n  \"add_flags\": \"%s\",\n  \"seed\": %llu,\n", opts.binary, opts.add_flags,
+           (unsigned long long)opts.gen.seed);
+    printf("  \"tree\": {\"files\": %ld, \"dirs\": %ld, \"symlinks\": %ld, \"sparse\": %ld, \"bytes\": %llu},\n",
+           opts.gen.files - tree.symlinks, tree.dir_cnt, tree.symlinks, tree.sparse, tree.bytes);
+    printf("  \"initial_copy\": {\"complete\": %s, \"seconds\": %.3f, \"files\": %ld, \"bytes\": %llu, "
+           "\"files_per_sec\": %.1f, \"mib_per_sec\": %.2f},\n",
+           copy_done ? "true" : "false", copy_ms / 1000, copied_files, copied_bytes,
+           copied_files / (copy_ms / 1000), tree.bytes / (copy_ms / 1000) / (1 << 20));
+    printf("  \"sync\": {\"watching\": %s, \"mutations\": %ld, \"applied\": %ld, \"lost\": %ld, \"failed\": %ld, "
+           "\"rate\": %.1f,\n",
+           watching ? "true" : "false", issued, applied, lost, failed, opts.rate);
+    printf("           \"latency_ms\": {\"mean\": %.2f, \"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"max\": %.2f}},\n",
+           applied ? lat_sum / applied : 0, percentile(lat, applied, 0.5), percentile(lat, applied, 0.9),
+           percentile(lat, applied, 0.99), percentile(lat, applied, 1.0));
+    printf("  \"restore\": {\"complete\": %s, \"seconds\": %.3f, \"files\": %ld, \"bytes\": %llu, "
+           "\"files_per_sec\": %.1f}\n",
+           restore_done ? "true" : "false", restore_ms / 1000, restored_files, restored_bytes,
+           restored_files / (restore_ms / 1000));
+    printf("}\n");
+
+    free(pend);
+    free(lat);
+    free(b);
+    gen_tree_free(&tree);
+    return copy_done && restore_done ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,54 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* shape of a generated source tree, equal options and seed give an identical tree */
+typedef struct GenOpts
+{
+    long files;
+    int depth;
+    int fanout;
+    off_t size_min;
+    off_t size_max;
+    int symlink_pct;
+    int sparse_pct;
+    uint64_t seed;
+} gen_opts;
+
+typedef struct GenFile
+{
+    char *rel;
+    off_t size;
+    int busy; /* a mutation of this file is still waiting for the replica */
+} gen_file;
+
+typedef struct GenTree
+{
+    gen_file *files;
+    long cnt;
+    long capacity;
+    char **dirs;
+    long dir_cnt;
+    long symlinks;
+    long sparse;
+    unsigned long long bytes;
+} gen_tree;
+
+uint64_t rng_next(uint64_t *);
+
+off_t rng_size(uint64_t *, off_t, off_t);
+
+int write_random_file(const char *, off_t, uint64_t *);
+
+int gen_tree_create(const char *, const gen_opts *, gen_tree *);
+
+long gen_tree_add(gen_tree *, const char *, off_t);
+
+void gen_tree_free(gen_tree *);
+
+int remove_tree(const char *);
+
+#endif
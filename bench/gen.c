@@ -0,0 +1,237 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define GEN_BUF (1 << 20)
+/* data islands written into a sparse file, the rest stays holes */
+#define SPARSE_ISLANDS 4
+#define SPARSE_SCALE 16
+
+/* xorshift64*, deterministic across platforms so trees can be regenerated */
+uint64_t rng_next(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+/* log-uniform size in [min, max], most files small and a few large like real trees */
+off_t rng_size(uint64_t *state, off_t min, off_t max)
+{
+    double lo = log((double)(min > 0 ? min : 1));
+    double hi = log((double)(max > min ? max : min + 1));
+    double u = (rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+    off_t size = (off_t)exp(lo + u * (hi - lo));
+    return min == 0 && rng_next(state) % 50 == 0 ? 0 : size;
+}
+
+static void fill_random(char *buf, size_t len, uint64_t *state)
+{
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t v = rng_next(state);
+        memcpy(buf + i, &v, 8);
+    }
+    for (; i < len; i++)
+        buf[i] = rng_next(state);
+}
+
+/* returns: 0 on success, -1 on error */
+int write_random_file(const char *path, off_t size, uint64_t *state)
+{
+    static char buf[GEN_BUF];
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return -1;
+
+    for (off_t left = size; left > 0;)
+    {
+        size_t chunk = left > GEN_BUF ? GEN_BUF : (size_t)left;
+        fill_random(buf, chunk, state);
+        if (write(fd, buf, chunk) != (ssize_t)chunk)
+        {
+            close(fd);
+            return -1;
+        }
+        left -= chunk;
+    }
+    return close(fd);
+}
+
+/* a file of logical size size with a few random data islands between holes */
+static int write_sparse_file(const char *path, off_t size, uint64_t *state)
+{
+    char buf[4096];
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, size) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    for (int i = 0; i < SPARSE_ISLANDS && size > (off_t)sizeof(buf); i++)
+    {
+        off_t offset = rng_next(state) % (size - sizeof(buf));
+        fill_random(buf, sizeof(buf), state);
+        if (pwrite(fd, buf, sizeof(buf), offset) != (ssize_t)sizeof(buf))
+        {
+            close(fd);
+            return -1;
+        }
+    }
+    return close(fd);
+}
+
+long gen_tree_add(gen_tree *tree, const char *rel, off_t size)
+{
+    if (tree->cnt == tree->capacity)
+    {
+        tree->capacity = tree->capacity ? tree->capacity * 2 : 1024;
+        tree->files = realloc(tree->files, tree->capacity * sizeof(gen_file));
+        if (tree->files == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    gen_file *file = &tree->files[tree->cnt];
+    file->rel = strdup(rel);
+    file->size = size;
+    file->busy = 0;
+    if (file->rel == NULL)
+    {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    return tree->cnt++;
+}
+
+static int add_dir(gen_tree *tree, const char *root, const char *rel)
+{
+    char path[PATH_MAX];
+
+    tree->dirs = realloc(tree->dirs, (tree->dir_cnt + 1) * sizeof(char *));
+    if (tree->dirs == NULL || (tree->dirs[tree->dir_cnt] = strdup(rel)) == NULL)
+        return -1;
+    tree->dir_cnt++;
+
+    snprintf(path, sizeof(path), "%s/%s", root, rel);
+    return mkdir(path, 0777) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+/* build depth levels of fanout directories below root, then spread the files,
+ * symlinks and sparse files over all of them at random
+ * returns: 0 on success, -1 on error
+ */
+int gen_tree_create(const char *root, const gen_opts *opts, gen_tree *tree)
+{
+    char rel[PATH_MAX];
+    char path[PATH_MAX];
+    uint64_t state = opts->seed ? opts->seed : 1;
+
+    memset(tree, 0, sizeof(*tree));
+    if (add_dir(tree, root, ".") != 0)
+        return -1;
+
+    long level_start = 0;
+    for (int d = 0; d < opts->depth; d++)
+    {
+        long level_end = tree->dir_cnt;
+        for (long p = level_start; p < level_end; p++)
+        {
+            for (int c = 0; c < opts->fanout; c++)
+            {
+                snprintf(rel, sizeof(rel), "%s/d%d", tree->dirs[p], c);
+                if (add_dir(tree, root, rel) != 0)
+                    return -1;
+            }
+        }
+        level_start = level_end;
+    }
+
+    for (long i = 0; i < opts->files; i++)
+    {
+        const char *dir = tree->dirs[rng_next(&state) % tree->dir_cnt];
+        int kind = rng_next(&state) % 100;
+
+        if (snprintf(rel, sizeof(rel), "%s/f%ld", dir, i) >= (int)sizeof(rel) ||
+            snprintf(path, sizeof(path), "%s/%s", root, rel) >= (int)sizeof(path))
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+
+        /* links name a random earlier file, which may live elsewhere and leave the link dangling as in real trees */
+        if (kind < opts->symlink_pct && i > 0)
+        {
+            snprintf(path, sizeof(path), "%s/%s/l%ld", root, dir, i);
+            snprintf(rel, sizeof(rel), "f%ld", (long)(rng_next(&state) % i));
+            if (symlink(rel, path) != 0)
+                return -1;
+            tree->symlinks++;
+            continue;
+        }
+
+        off_t size = rng_size(&state, opts->size_min, opts->size_max);
+        if (kind < opts->symlink_pct + opts->sparse_pct)
+        {
+            size = size * SPARSE_SCALE + (1 << 20);
+            if (write_sparse_file(path, size, &state) != 0)
+                return -1;
+            tree->sparse++;
+        }
+        else if (write_random_file(path, size, &state) != 0)
+        {
+            return -1;
+        }
+
+        gen_tree_add(tree, rel, size);
+        tree->bytes += size;
+    }
+    return 0;
+}
+
+void gen_tree_free(gen_tree *tree)
+{
+    for (long i = 0; i < tree->cnt; i++)
+        free(tree->files[i].rel);
+    for (long i = 0; i < tree->dir_cnt; i++)
+        free(tree->dirs[i]);
+    free(tree->files);
+    free(tree->dirs);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove(path) == 0 || errno == ENOENT ? 0 : -1;
+}
+
+/* returns: 0 if path is gone afterwards */
+int remove_tree(const char *path)
+{
+    struct stat st;
+
+    if (lstat(path, &st) == -1)
+        return errno == ENOENT ? 0 : -1;
+    return nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
@@ -0,0 +1,350 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "coalesce.h"
+#include "hash.h"
+#include "stats.h"
+#include "utils.h"
+
+#define COALESCE_BUCKETS 1024
+/* a path that never goes quiet is still applied after this many windows */
+#define COALESCE_MAX_WINDOWS 10
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void heap_swap(coalescer *co, size_t a, size_t b)
+{
+    pending_change *tmp = co->heap[a];
+    co->heap[a] = co->heap[b];
+    co->heap[b] = tmp;
+    co->heap[a]->heap_idx = a;
+    co->heap[b]->heap_idx = b;
+}
+
+static void heap_fix(coalescer *co, size_t idx)
+{
+    while (idx > 0 && co->heap[(idx - 1) / 2]->deadline_ms > co->heap[idx]->deadline_ms)
+    {
+        heap_swap(co, idx, (idx - 1) / 2);
+        idx = (idx - 1) / 2;
+    }
+
+    for (;;)
+    {
+        size_t smallest = idx, l = 2 * idx + 1, r = 2 * idx + 2;
+        if (l < co->cnt && co->heap[l]->deadline_ms < co->heap[smallest]->deadline_ms)
+            smallest = l;
+        if (r < co->cnt && co->heap[r]->deadline_ms < co->heap[smallest]->deadline_ms)
+            smallest = r;
+        if (smallest == idx)
+            break;
+        heap_swap(co, idx, smallest);
+        idx = smallest;
+    }
+}
+
+static size_t bucket_of(coalescer *co, const char *rel_path)
+{
+    return hash64(rel_path, strlen(rel_path), HASH64_SEED) & (co->bucket_cnt - 1);
+}
+
+/* window_ms == 0 applies every change as soon as it arrives */
+coalescer *coalescer_create(fanout *fo, long window_ms)
+{
+    coalescer *co = calloc(1, sizeof(coalescer));
+    if (co == NULL)
+        ERR("calloc");
+
+    co->fo = fo;
+    co->window_ms = window_ms;
+    co->bucket_cnt = COALESCE_BUCKETS;
+    co->buckets = calloc(co->bucket_cnt, sizeof(pending_change *));
+    if (co->buckets == NULL)
+        ERR("calloc");
+    return co;
+}
+
+/* due changes go to fn instead of straight to the targets */
+void coalesce_set_apply(coalescer *co, apply_fn fn, void *arg)
+{
+    co->apply = fn;
+    co->apply_arg = arg;
+}
+
+static void apply(coalescer *co, sync_action action, const char *src_path, const char *rel_path,
+                  const char *from_rel)
+{
+    if (co->apply)
+        co->apply(co->apply_arg, action, src_path, rel_path, from_rel);
+    else
+        apply_change(co->fo, action, src_path, rel_path, from_rel);
+}
+
+static void free_change(pending_change *pc)
+{
+    free(pc->rel_path);
+    free(pc->src_path);
+    free(pc);
+}
+
+/* take pc off the heap and out of its hash chain */
+static void unlink_change(coalescer *co, pending_change *pc)
+{
+    size_t idx = pc->heap_idx;
+
+    co->cnt--;
+    if (idx < co->cnt)
+    {
+        co->heap[idx] = co->heap[co->cnt];
+        co->heap[idx]->heap_idx = idx;
+        heap_fix(co, idx);
+    }
+
+    pending_change **link = &co->buckets[bucket_of(co, pc->rel_path)];
+    while (*link != pc)
+        link = &(*link)->next;
+    *link = pc->next;
+}
+
+/* hand an unlinked change to the targets and free it */
+static void apply_pending(coalescer *co, pending_change *pc)
+{
+    /* a directory or file that was replaced must not keep the old contents */
+    if (pc->remove_first)
+        apply(co, SYNC_REMOVE, pc->src_path, pc->rel_path, NULL);
+    apply(co, pc->action, pc->src_path, pc->rel_path, NULL);
+    co->applied++;
+    stats_add(STAT_APPLIED, 1);
+    free_change(pc);
+}
+
+void coalescer_destroy(coalescer *co)
+{
+    if (co->rescan)
+        rescan_destroy(co->rescan);
+    coalesce_flush(co, 1);
+    free(co->heap);
+    free(co->buckets);
+    free(co);
+}
+
+/* the change due next is the oldest one, give or take the cap on postponing a busy path */
+static void publish_queue(coalescer *co)
+{
+    stats_queue(QUEUE_COALESCE, (long)co->cnt, co->cnt ? co->heap[0]->first_ms : 0);
+}
+
+/* record a change, folding it into whatever is still pending for the same path */
+void coalesce_change(coalescer *co, sync_action action, const char *src_path, const char *rel_path)
+{
+    co->events++;
+    stats_add(STAT_RECEIVED, 1);
+    journal_note(co->fo->journal, rel_path);
+    if (co->window_ms <= 0)
+    {
+        stats_queue(QUEUE_COALESCE, 1, now_ms());
+        apply(co, action, src_path, rel_path, NULL);
+        co->applied++;
+        stats_add(STAT_APPLIED, 1);
+        stats_queue(QUEUE_COALESCE, 0, 0);
+        return;
+    }
+
+    long long now = now_ms();
+    size_t b = bucket_of(co, rel_path);
+    pending_change *pc = co->buckets[b];
+    while (pc && strcmp(pc->rel_path, rel_path) != 0)
+        pc = pc->next;
+
+    if (pc)
+    {
+        /* an overtaken copy is a copy we never have to issue */
+        if (pc->action == SYNC_COPY)
+            co->saved++;
+        pc->remove_first = action != SYNC_REMOVE && (pc->action == SYNC_REMOVE || pc->remove_first);
+        pc->action = action;
+        stats_add(STAT_MERGED, 1);
+
+        long long cap = pc->first_ms + co->window_ms * COALESCE_MAX_WINDOWS;
+        pc->deadline_ms = now + co->window_ms < cap ? now + co->window_ms : cap;
+        heap_fix(co, pc->heap_idx);
+        return;
+    }
+
+    pc = calloc(1, sizeof(pending_change));
+    if (pc == NULL || (pc->rel_path = strdup(rel_path)) == NULL || (pc->src_path = strdup(src_path)) == NULL)
+        ERR("calloc");
+    pc->action = action;
+    pc->first_ms = now;
+    pc->deadline_ms = now + co->window_ms;
+    pc->next = co->buckets[b];
+    co->buckets[b] = pc;
+
+    if (co->cnt == co->capacity)
+    {
+        co->capacity = co->capacity ? co->capacity * 2 : 64;
+        pending_change **heap = realloc(co->heap, co->capacity * sizeof(pending_change *));
+        if (heap == NULL)
+            ERR("realloc");
+        co->heap = heap;
+    }
+    pc->heap_idx = co->cnt;
+    co->heap[co->cnt++] = pc;
+    heap_fix(co, pc->heap_idx);
+    publish_queue(co);
+}
+
+/* returns: 1 if pc changes path, something below it or one of its parents */
+static int change_touches(const pending_change *pc, const char *path)
+{
+    return rel_within(pc->rel_path, path, strlen(path)) || rel_within(path, pc->rel_path, strlen(pc->rel_path));
+}
+
+static int by_deadline(const void *a, const void *b)
+{
+    long long da = (*(pending_change *const *)a)->deadline_ms, db = (*(pending_change *const *)b)->deadline_ms;
+    return da < db ? -1 : da > db;
+}
+
+/* apply what is pending at, below or above either end of a rename, the rest keeps its window */
+static void flush_rename(coalescer *co, const char *from_rel, const char *rel_path)
+{
+    size_t cnt = 0;
+
+    if (co->cnt == 0)
+        return;
+    pending_change **due = malloc(co->cnt * sizeof(pending_change *));
+    if (due == NULL)
+        ERR("malloc");
+
+    for (size_t i = 0; i < co->cnt; i++)
+    {
+        if (change_touches(co->heap[i], from_rel) || change_touches(co->heap[i], rel_path))
+            due[cnt++] = co->heap[i];
+    }
+    qsort(due, cnt, sizeof(pending_change *), by_deadline);
+
+    for (size_t i = 0; i < cnt; i++)
+    {
+        unlink_change(co, due[i]);
+        apply_pending(co, due[i]);
+    }
+    free(due);
+    publish_queue(co);
+}
+
+/* record that the entry at from_rel is now at rel_path, changes still pending around either
+ * path are applied first so the targets move what the source had before the rename
+ */
+void coalesce_rename(coalescer *co, const char *from_rel, const char *src_path, const char *rel_path)
+{
+    co->events++;
+    stats_add(STAT_RECEIVED, 1);
+    journal_note(co->fo->journal, from_rel);
+    journal_note(co->fo->journal, rel_path);
+
+    flush_rename(co, from_rel, rel_path);
+    apply(co, SYNC_RENAME, src_path, rel_path, from_rel);
+    co->applied++;
+    stats_add(STAT_APPLIED, 1);
+}
+
+/* events changed at or after mark never arrived, the source is rescanned for them */
+void coalesce_lost(coalescer *co, time_t mark)
+{
+    if (co->rescan == NULL)
+        co->rescan = rescan_create(co->fo);
+    rescan_request(co->rescan, mark);
+}
+
+/* take what the rescan found so far like any other change, a removal only while the source still lacks the path */
+void coalesce_rescan(coalescer *co)
+{
+    char src_path[PATH_MAX];
+    struct stat st;
+
+    if (co->rescan == NULL)
+        return;
+
+    rescan_item *item = rescan_take(co->rescan);
+    while (item)
+    {
+        rescan_item *next = item->next;
+        snprintf(src_path, sizeof(src_path), "%s/%s", co->fo->src_base, item->rel);
+        if (item->action != SYNC_REMOVE || (lstat(src_path, &st) == -1 && errno == ENOENT))
+            coalesce_change(co, item->action, src_path, item->rel);
+        free(item->rel);
+        free(item);
+        item = next;
+    }
+}
+
+/* returns: 1 if no change waits here or in a rescan */
+int coalesce_idle(coalescer *co)
+{
+    return co->cnt == 0 && (co->rescan == NULL || !rescan_busy(co->rescan));
+}
+
+/* returns: ms until the next pending change or journal write is due, -1 if nothing is pending */
+int coalesce_timeout(coalescer *co)
+{
+    int ms = journal_timeout(co->fo->journal);
+
+    if (co->cnt > 0)
+    {
+        long long left = co->heap[0]->deadline_ms - now_ms();
+        int due = left < 0 ? 0 : (int)left;
+        ms = ms >= 0 && ms < due ? ms : due;
+    }
+    if (co->rescan && rescan_busy(co->rescan) && (ms < 0 || ms > RESCAN_POLL_MS))
+        ms = RESCAN_POLL_MS;
+    return ms;
+}
+
+/* apply every change whose window closed, or all of them when all is set */
+void coalesce_flush(coalescer *co, int all)
+{
+    long long now = now_ms();
+    int drained = 0;
+
+    while (co->cnt > 0 && (all || co->heap[0]->deadline_ms <= now))
+    {
+        pending_change *pc = co->heap[0];
+        unlink_change(co, pc);
+        apply_pending(co, pc);
+        drained = co->cnt == 0;
+        publish_queue(co);
+    }
+
+    if (drained && getenv("SOP_BACKUP_TRACE"))
+        fprintf(stderr, "coalesce: %lu events, %lu applied, %lu copies saved\n", co->events, co->applied,
+                co->saved);
+}
+
+/* wait for fd to become readable, applying changes whose window closes or a rescan
+ * finds meanwhile and journaling what was applied
+ * returns: 1 when fd is readable, otherwise 0
+ */
+int coalesce_wait(coalescer *co, int fd)
+{
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+
+    int ready = poll(&pfd, 1, coalesce_timeout(co));
+    coalesce_rescan(co);
+    coalesce_flush(co, 0);
+    journal_tick(co->fo->journal, coalesce_idle(co) && fanout_idle(co->fo));
+    return ready > 0;
+}
@@ -0,0 +1,64 @@
+#ifndef CO_H
+#define CO_H
+
+#include <time.h>
+
+#include "fanout.h"
+#include "rescan.h"
+#include "synchro.h"
+
+/* net effect of all events seen for one path inside the quiet window */
+typedef struct PendingChange
+{
+    char *rel_path;
+    char *src_path;
+    sync_action action;
+    int remove_first; /* a removal was folded into a later mkdir/copy */
+    long long first_ms;
+    long long deadline_ms;
+    size_t heap_idx;
+    struct PendingChange *next; /* hash chain */
+} pending_change;
+
+typedef void (*apply_fn)(void *, sync_action, const char *, const char *, const char *);
+
+typedef struct Coalescer
+{
+    fanout *fo;
+    apply_fn apply; /* hands a due change elsewhere instead of applying it to fo, NULL applies */
+    void *apply_arg;
+    long window_ms;
+    pending_change **buckets;
+    size_t bucket_cnt;
+    pending_change **heap; /* ordered by deadline */
+    size_t cnt;
+    size_t capacity;
+    rescan *rescan; /* reconciles the targets after events were lost, NULL until they first are */
+    unsigned long events;
+    unsigned long applied;
+    unsigned long saved;
+} coalescer;
+
+coalescer *coalescer_create(fanout *, long);
+
+void coalescer_destroy(coalescer *);
+
+void coalesce_set_apply(coalescer *, apply_fn, void *);
+
+void coalesce_change(coalescer *, sync_action, const char *, const char *);
+
+void coalesce_rename(coalescer *, const char *, const char *, const char *);
+
+void coalesce_lost(coalescer *, time_t);
+
+void coalesce_rescan(coalescer *);
+
+int coalesce_idle(coalescer *);
+
+int coalesce_timeout(coalescer *);
+
+void coalesce_flush(coalescer *, int);
+
+int coalesce_wait(coalescer *, int);
+
+#endif
@@ -0,0 +1,490 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "copyeng.h"
+#include "fileproc.h"
+#include "iopolicy.h"
+#include "utils.h"
+
+/* samples taken across a file to guess whether it compresses */
+#define SAMPLE_CNT 8
+#define SAMPLE_LEN 4096
+/* bits per byte above which data is taken to be compressed or encrypted already */
+#define ENTROPY_MAX 7.5
+
+/* lz77 in the lz4 block layout: a match is at least 4 bytes, at most 64 KiB back,
+ * and the last LZ_LAST bytes of a block are always literals
+ */
+#define LZ_MIN_MATCH 4
+#define LZ_LAST 5
+#define LZ_MATCH_END 12
+#define LZ_HASH_BITS 13
+#define LZ_MAX_OFFSET 65535
+/* a kept-raw block has this bit set in its stored length */
+#define BLOCK_RAW 0x80000000u
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* write a length that didn't fit into its 4 bit token field as a run of 255s and a remainder */
+static size_t put_len(unsigned char *out, size_t len)
+{
+    size_t n = 0;
+    for (; len >= 255; len -= 255)
+        out[n++] = 255;
+    out[n++] = (unsigned char)len;
+    return n;
+}
+
+/* returns: compressed length, 0 if the result would not be smaller than cap */
+static size_t lz_compress(const unsigned char *src, size_t len, unsigned char *dst, size_t cap)
+{
+    uint32_t table[1 << LZ_HASH_BITS] = {0};
+    size_t anchor = 0, i = 0, out = 0;
+
+    while (len >= LZ_MATCH_END && i + LZ_MATCH_END <= len)
+    {
+        uint32_t seq = read32(src + i);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t ref = table[h];
+        table[h] = (uint32_t)i;
+
+        if (ref >= i || i - ref > LZ_MAX_OFFSET || read32(src + ref) != seq)
+        {
+            /* skip faster through data that keeps not matching */
+            i += 1 + ((i - anchor) >> 6);
+            continue;
+        }
+
+        size_t match = LZ_MIN_MATCH;
+        while (i + match < len - LZ_LAST && src[ref + match] == src[i + match])
+            match++;
+        while (i > anchor && ref > 0 && src[i - 1] == src[ref - 1])
+        {
+            i--;
+            ref--;
+            match++;
+        }
+
+        size_t lit = i - anchor;
+        if (out + 1 + lit / 255 + 1 + lit + 2 + match / 255 + 1 > cap)
+            return 0;
+
+        unsigned char *token = &dst[out++];
+        *token = (unsigned char)((lit < 15 ? lit : 15) << 4);
+        if (lit >= 15)
+            out += put_len(dst + out, lit - 15);
+        memcpy(dst + out, src + anchor, lit);
+        out += lit;
+
+        dst[out++] = (unsigned char)(i - ref);
+        dst[out++] = (unsigned char)((i - ref) >> 8);
+
+        size_t extra = match - LZ_MIN_MATCH;
+        *token |= (unsigned char)(extra < 15 ? extra : 15);
+        if (extra >= 15)
+            out += put_len(dst + out, extra - 15);
+
+        i += match;
+        anchor = i;
+    }
+
+    size_t lit = len - anchor;
+    if (out + 1 + lit / 255 + 1 + lit >= cap)
+        return 0;
+    dst[out++] = (unsigned char)((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15)
+        out += put_len(dst + out, lit - 15);
+    memcpy(dst + out, src + anchor, lit);
+    return out + lit;
+}
+
+/* read a length continued past its token field
+ * returns: 0 on success, -1 if src ends first
+ */
+static int get_len(const unsigned char *src, size_t len, size_t *in, size_t *value)
+{
+    unsigned char b;
+    do
+    {
+        if (*in >= len)
+            return -1;
+        b = src[(*in)++];
+        *value += b;
+    } while (b == 255);
+    return 0;
+}
+
+/* returns: decompressed length, -1 if src is damaged or doesn't fit into cap */
+static ssize_t lz_decompress(const unsigned char *src, size_t len, unsigned char *dst, size_t cap)
+{
+    size_t in = 0, out = 0;
+
+    while (in < len)
+    {
+        unsigned char token = src[in++];
+
+        size_t lit = token >> 4;
+        if (lit == 15 && get_len(src, len, &in, &lit) < 0)
+            return -1;
+        if (lit > len - in || lit > cap - out)
+            return -1;
+        memcpy(dst + out, src + in, lit);
+        in += lit;
+        out += lit;
+
+        /* the last sequence has no match */
+        if (in == len)
+            break;
+
+        if (len - in < 2)
+            return -1;
+        size_t offset = src[in] | (size_t)src[in + 1] << 8;
+        in += 2;
+
+        size_t match = token & 15;
+        if (match == 15 && get_len(src, len, &in, &match) < 0)
+            return -1;
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out || match > cap - out)
+            return -1;
+
+        /* the match may overlap what it produces */
+        if (offset >= match)
+        {
+            memcpy(dst + out, dst + out - offset, match);
+        }
+        else
+        {
+            for (size_t k = 0; k < match; k++)
+                dst[out + k] = dst[out - offset + k];
+        }
+        out += match;
+    }
+    return (ssize_t)out;
+}
+
+/* guess from a few samples spread over the file whether compressing pays off,
+ * already compressed media and archives look like noise and are copied as they are
+ * returns: 1 if path should be compressed
+ */
+int compress_worthwhile(const char *path, const struct stat *st)
+{
+    unsigned long counts[256] = {0};
+    unsigned char sample[SAMPLE_LEN];
+    size_t total = 0;
+
+    if (!S_ISREG(st->st_mode) || st->st_size < COMPRESS_MIN)
+        return 0;
+
+    int fd = TEMP_FAILURE_RETRY(open(path, O_RDONLY));
+    if (fd < 0)
+        return 0;
+
+    off_t span = st->st_size > SAMPLE_LEN ? st->st_size - SAMPLE_LEN : 0;
+    for (int s = 0; s < SAMPLE_CNT; s++)
+    {
+        ssize_t c = pread(fd, sample, SAMPLE_LEN, span * s / (SAMPLE_CNT - 1));
+        for (ssize_t k = 0; k < c; k++)
+            counts[sample[k]]++;
+        if (c > 0)
+            total += c;
+        if (span == 0)
+            break;
+    }
+    TEMP_FAILURE_RETRY(close(fd));
+
+    if (total == 0)
+        return 0;
+
+    double entropy = 0;
+    for (int b = 0; b < 256; b++)
+    {
+        if (counts[b] == 0)
+            continue;
+        double p = (double)counts[b] / total;
+        entropy -= p * log2(p);
+    }
+    return entropy < ENTROPY_MAX;
+}
+
+/* returns: length of the file header describing a source of size bytes written to buf */
+size_t compress_header(char *buf, off_t size)
+{
+    size_t magic_len = sizeof(COMPRESS_MAGIC) - 1;
+
+    memcpy(buf, COMPRESS_MAGIC, magic_len);
+    for (int i = 0; i < 8; i++)
+        buf[magic_len + i] = (char)((uint64_t)size >> (8 * i));
+    return COMPRESS_HDR;
+}
+
+/* compress len bytes of src, at most COMPRESS_BLOCK, into one framed block
+ * returns: length of the block written to dst, which must hold COMPRESS_BOUND
+ */
+size_t compress_block(const char *src, size_t len, char *dst)
+{
+    unsigned char *out = (unsigned char *)dst;
+    size_t stored = lz_compress((const unsigned char *)src, len, out + COMPRESS_BLOCK_HDR, len);
+
+    if (stored == 0)
+    {
+        memcpy(out + COMPRESS_BLOCK_HDR, src, len);
+        put_le32(out, (uint32_t)len | BLOCK_RAW);
+    }
+    else
+    {
+        put_le32(out, (uint32_t)stored);
+    }
+    put_le32(out + 4, (uint32_t)len);
+    return COMPRESS_BLOCK_HDR + (stored ? stored : len);
+}
+
+/* compress what is left of src_fd into blocks appended to dst_fd,
+ * written grows by the number of bytes that reached the target
+ * returns: 0 on success, -1 on a read or write error
+ */
+int compress_stream(int src_fd, int dst_fd, off_t *written)
+{
+    char *raw = malloc(COMPRESS_BLOCK);
+    char *block = malloc(COMPRESS_BOUND);
+    int result = 0;
+
+    if (raw == NULL || block == NULL)
+        ERR("malloc");
+
+    for (;;)
+    {
+        ssize_t len = bulk_read(src_fd, raw, COMPRESS_BLOCK);
+        if (len <= 0)
+        {
+            result = len < 0 ? -1 : 0;
+            break;
+        }
+
+        size_t block_len = compress_block(raw, len, block);
+        if (bulk_write(dst_fd, block, block_len) != (ssize_t)block_len)
+        {
+            result = -1;
+            break;
+        }
+        *written += block_len;
+        if (len < COMPRESS_BLOCK)
+            break;
+    }
+
+    free(raw);
+    free(block);
+    return result;
+}
+
+/* end the block list, a copy cut short before this is seen as damaged on restore
+ * returns: 0 on success, -1 on a write error
+ */
+int compress_finish(int dst_fd)
+{
+    char end[COMPRESS_BLOCK_HDR] = {0};
+    return bulk_write(dst_fd, end, sizeof(end)) == (ssize_t)sizeof(end) ? 0 : -1;
+}
+
+/* write the compressed form of src to dest, stamped with the times of src,
+ * written receives the size of the compressed copy
+ * returns: 0 on success, -1 if src can't be read or dest written
+ */
+int compress_file(const char *src, const char *dest, off_t *written)
+{
+    char header[COMPRESS_HDR];
+    struct stat st;
+
+    int src_fd = TEMP_FAILURE_RETRY(open(src, O_RDONLY));
+    if (src_fd < 0)
+        return -1;
+    if (fstat(src_fd, &st) < 0)
+    {
+        TEMP_FAILURE_RETRY(close(src_fd));
+        return -1;
+    }
+
+    clear_target_entry(dest, 0);
+    int dst_fd = TEMP_FAILURE_RETRY(open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0777));
+    if (dst_fd < 0)
+    {
+        TEMP_FAILURE_RETRY(close(src_fd));
+        return -1;
+    }
+    io_prepare(src_fd, -1, &st);
+
+    size_t header_len = compress_header(header, st.st_size);
+    *written = header_len;
+    int result = bulk_write(dst_fd, header, header_len) == (ssize_t)header_len ? 0 : -1;
+    if (result == 0)
+        result = compress_stream(src_fd, dst_fd, written);
+    if (result == 0)
+        result = compress_finish(dst_fd);
+    if (result == 0)
+    {
+        *written += COMPRESS_BLOCK_HDR;
+        copy_times(dst_fd, &st);
+    }
+
+    io_release(src_fd, dst_fd, *written);
+    TEMP_FAILURE_RETRY(close(src_fd));
+    TEMP_FAILURE_RETRY(close(dst_fd));
+    return result;
+}
+
+/* read the header of a compressed copy
+ * returns: 0 and the source size, -1 if fd holds no compressed copy
+ */
+static int read_header(int fd, long long *size)
+{
+    unsigned char header[COMPRESS_HDR];
+    size_t magic_len = sizeof(COMPRESS_MAGIC) - 1;
+
+    if (bulk_read(fd, (char *)header, sizeof(header)) != (ssize_t)sizeof(header) ||
+        memcmp(header, COMPRESS_MAGIC, magic_len) != 0)
+        return -1;
+
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--)
+        value = value << 8 | header[magic_len + i];
+    *size = (long long)value;
+    return 0;
+}
+
+/* returns: 1 if dst is a compressed copy of a file with the size and mtime of st */
+int compress_current(const char *dst, const struct stat *st)
+{
+    struct stat dst_st;
+    long long size;
+
+    if (lstat(dst, &dst_st) == -1 || !S_ISREG(dst_st.st_mode) || dst_st.st_mtim.tv_sec != st->st_mtim.tv_sec ||
+        dst_st.st_mtim.tv_nsec != st->st_mtim.tv_nsec)
+        return 0;
+
+    int fd = TEMP_FAILURE_RETRY(open(dst, O_RDONLY));
+    if (fd < 0)
+        return 0;
+    int result = read_header(fd, &size) == 0 && size == st->st_size;
+    TEMP_FAILURE_RETRY(close(fd));
+    return result;
+}
+
+/* decode the block list of fd into out_fd, all-zero blocks become holes
+ * returns: number of bytes restored, -1 if a block is damaged or the list is cut short
+ */
+static long long restore_blocks(int fd, int out_fd, unsigned char *stored, unsigned char *raw)
+{
+    unsigned char header[COMPRESS_BLOCK_HDR];
+    long long restored = 0;
+
+    for (;;)
+    {
+        if (bulk_read(fd, (char *)header, sizeof(header)) != (ssize_t)sizeof(header))
+            return -1;
+
+        uint32_t stored_len = get_le32(header) & ~BLOCK_RAW;
+        uint32_t raw_len = get_le32(header + 4);
+        int is_raw = (get_le32(header) & BLOCK_RAW) != 0;
+        if (stored_len == 0 && raw_len == 0)
+            return restored;
+        if (raw_len == 0 || raw_len > COMPRESS_BLOCK || stored_len > COMPRESS_BLOCK ||
+            (is_raw && stored_len != raw_len))
+            return -1;
+
+        if (bulk_read(fd, (char *)stored, stored_len) != (ssize_t)stored_len)
+            return -1;
+        if (is_raw)
+            memcpy(raw, stored, raw_len);
+        else if (lz_decompress(stored, stored_len, raw, COMPRESS_BLOCK) != (ssize_t)raw_len)
+            return -1;
+
+        if (raw[0] == 0 && memcmp(raw, raw + 1, raw_len - 1) == 0)
+        {
+            if (lseek(out_fd, raw_len, SEEK_CUR) < 0)
+                return -1;
+        }
+        else if (bulk_write(out_fd, (char *)raw, raw_len) != (ssize_t)raw_len)
+        {
+            return -1;
+        }
+        restored += raw_len;
+    }
+}
+
+/* rebuild the file whose compressed copy is at path into dst
+ * returns: 1 if dst was rebuilt, 0 if path is not a compressed copy, -1 on error
+ */
+int compress_restore_file(const char *path, const char *dst)
+{
+    struct stat st;
+    long long size;
+
+    int fd = TEMP_FAILURE_RETRY(open(path, O_RDONLY));
+    if (fd < 0)
+        return 0;
+    if (read_header(fd, &size) != 0 || fstat(fd, &st) < 0)
+    {
+        TEMP_FAILURE_RETRY(close(fd));
+        return 0;
+    }
+
+    unsigned char *stored = malloc(COMPRESS_BLOCK);
+    unsigned char *raw = malloc(COMPRESS_BLOCK);
+    if (stored == NULL || raw == NULL)
+        ERR("malloc");
+
+    int result = 1;
+    clear_target_entry(dst, 0);
+    int out_fd = TEMP_FAILURE_RETRY(open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666));
+    if (out_fd < 0)
+        result = -1;
+
+    /* the source may have changed while it was copied, the blocks are what counts */
+    long long restored = result == 1 ? restore_blocks(fd, out_fd, stored, raw) : -1;
+    if (result == 1 && restored < 0)
+    {
+        fprintf(stderr, "restore %s: compressed copy is damaged or truncated\n", dst);
+        errno = EIO;
+        result = -1;
+    }
+    if (result == 1 && ftruncate(out_fd, restored) < 0)
+        result = -1;
+
+    if (out_fd >= 0)
+    {
+        if (result == 1)
+            copy_times(out_fd, &st);
+        TEMP_FAILURE_RETRY(close(out_fd));
+    }
+
+    free(stored);
+    free(raw);
+    TEMP_FAILURE_RETRY(close(fd));
+    return result;
+}
@@ -0,0 +1,36 @@
+#ifndef CZ_H
+#define CZ_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* raw bytes per compressed block, blocks are independent so any of them can be produced on its own */
+#define COMPRESS_BLOCK (1 << 20)
+/* block header: stored length (top bit set when kept raw) and raw length */
+#define COMPRESS_BLOCK_HDR 8
+/* most a block can take in the target, data that doesn't shrink is stored raw */
+#define COMPRESS_BOUND (COMPRESS_BLOCK_HDR + COMPRESS_BLOCK)
+#define COMPRESS_MAGIC "#sop-backup lz 1\n"
+/* magic and the source size as 8 little endian bytes */
+#define COMPRESS_HDR (sizeof(COMPRESS_MAGIC) - 1 + 8)
+/* smaller files gain less than the header costs */
+#define COMPRESS_MIN 512
+
+int compress_worthwhile(const char *, const struct stat *);
+
+size_t compress_header(char *, off_t);
+
+size_t compress_block(const char *, size_t, char *);
+
+int compress_stream(int, int, off_t *);
+
+int compress_finish(int);
+
+int compress_file(const char *, const char *, off_t *);
+
+int compress_current(const char *, const struct stat *);
+
+int compress_restore_file(const char *, const char *);
+
+#endif
@@ -0,0 +1,390 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+#include "copyeng.h"
+#include "iopolicy.h"
+#include "stats.h"
+
+#define CHUNK_MAX (1 << 30)
+
+static const char *method_names[COPY_METHOD_CNT] = {"none",       "reflink",        "copy_file_range", "sendfile",
+                                                    "read/write", "fan-out stream", "io_uring batch",
+                                                    "block delta", "dedup store",    "sparse",
+                                                    "direct I/O",  "compressed",     "pack append"};
+
+static atomic_ulong files_by_method[COPY_METHOD_CNT];
+static atomic_ullong bytes_by_method[COPY_METHOD_CNT];
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static int trace;
+
+ssize_t bulk_read(int fd, char *buf, size_t count)
+{
+    ssize_t c;
+    ssize_t len = 0;
+    do
+    {
+        c = TEMP_FAILURE_RETRY(read(fd, buf, count));
+        if (c < 0)
+            return c;
+        if (c == 0)
+            return len;  // EOF
+        buf += c;
+        len += c;
+        count -= c;
+    } while (count > 0);
+    return len;
+}
+
+ssize_t bulk_write(int fd, char *buf, size_t count)
+{
+    ssize_t c;
+    ssize_t len = 0;
+    do
+    {
+        c = TEMP_FAILURE_RETRY(write(fd, buf, count));
+        if (c < 0)
+            return c;
+        buf += c;
+        len += c;
+        count -= c;
+    } while (count > 0);
+    return len;
+}
+
+/* errors meaning "this tier can't do it here", not "the copy failed" */
+static int tier_unsupported(int err)
+{
+    return err == EXDEV || err == ENOSYS || err == EOPNOTSUPP || err == ENOTTY || err == EINVAL || err == EBADF ||
+           err == EPERM;
+}
+
+/* whole-file CoW clone, only possible inside one btrfs/xfs/... filesystem */
+int copy_reflink(int src_fd, int dst_fd)
+{
+    return ioctl(dst_fd, FICLONE, src_fd) == 0 ? 0 : -1;
+}
+
+/* copy_file_range/sendfile advance both file offsets, so a later tier
+ * continues exactly where an earlier one gave up
+ * returns: bytes left, -1 on hard error
+ */
+static off_t try_copy_range(int src_fd, int dst_fd, off_t left)
+{
+    while (left > 0)
+    {
+        size_t chunk = left > CHUNK_MAX ? CHUNK_MAX : (size_t)left;
+        ssize_t c = TEMP_FAILURE_RETRY(copy_file_range(src_fd, NULL, dst_fd, NULL, chunk, 0));
+        if (c < 0)
+            return tier_unsupported(errno) ? left : -1;
+        if (c == 0)
+            return 0;  // file shrank
+        left -= c;
+    }
+    return 0;
+}
+
+static off_t try_sendfile(int src_fd, int dst_fd, off_t left)
+{
+    while (left > 0)
+    {
+        size_t chunk = left > CHUNK_MAX ? CHUNK_MAX : (size_t)left;
+        ssize_t c = TEMP_FAILURE_RETRY(sendfile(dst_fd, src_fd, NULL, chunk));
+        if (c < 0)
+            return tier_unsupported(errno) ? left : -1;
+        if (c == 0)
+            return 0;
+        left -= c;
+    }
+    return 0;
+}
+
+/* last resort: move every byte through user space, size only picks the buffer */
+static int copy_rw(int src_fd, int dst_fd, off_t size)
+{
+    size_t buf_size = io_buffer_size(dst_fd, size);
+    ssize_t bytes_read, bytes_written;
+
+    char *buffer = malloc(buf_size);
+    if (buffer == NULL)
+        return -1;
+
+    while ((bytes_read = bulk_read(src_fd, buffer, buf_size)) > 0)
+    {
+        bytes_written = bulk_write(dst_fd, buffer, bytes_read);
+        if (bytes_written != bytes_read)
+        {
+            free(buffer);
+            return -1;
+        }
+    }
+
+    free(buffer);
+    return bytes_read < 0 ? -1 : 0;
+}
+
+static void set_direct(int fd, int flags, int on) { fcntl(fd, F_SETFL, on ? flags | O_DIRECT : flags & ~O_DIRECT); }
+
+/* copy through aligned buffers with O_DIRECT on both descriptors so neither file
+ * passes through the page cache, the unaligned tail is copied normally
+ * returns: 0 on success, 1 if the filesystems refuse O_DIRECT (when it is set or on the first
+ * transfer, both offsets are back where they were), -1 on failure
+ */
+static int copy_direct(int src_fd, int dst_fd, off_t size)
+{
+    int src_flags = fcntl(src_fd, F_GETFL);
+    int dst_flags = fcntl(dst_fd, F_GETFL);
+    void *buf;
+
+    if (src_flags < 0 || dst_flags < 0 || fcntl(src_fd, F_SETFL, src_flags | O_DIRECT) < 0)
+        return 1;
+    if (fcntl(dst_fd, F_SETFL, dst_flags | O_DIRECT) < 0)
+    {
+        set_direct(src_fd, src_flags, 0);
+        return 1;
+    }
+
+    size_t buf_size = io_buffer_size(dst_fd, size);
+    if (posix_memalign(&buf, IO_ALIGN, buf_size) != 0)
+    {
+        set_direct(src_fd, src_flags, 0);
+        set_direct(dst_fd, dst_flags, 0);
+        return 1;
+    }
+
+    off_t src_start = lseek(src_fd, 0, SEEK_CUR);
+    off_t dst_start = lseek(dst_fd, 0, SEEK_CUR);
+    off_t left = size;
+    int result = 0;
+    while (left >= IO_ALIGN)
+    {
+        size_t want = (size_t)left < buf_size ? (size_t)left / IO_ALIGN * IO_ALIGN : buf_size;
+        ssize_t c = bulk_read(src_fd, buf, want);
+        if (c < 0)
+        {
+            result = -1;
+            break;
+        }
+
+        /* the source shrank, an unaligned remainder can only go out buffered */
+        if ((size_t)c != want)
+            set_direct(dst_fd, dst_flags, 0);
+        if (bulk_write(dst_fd, buf, c) != c)
+        {
+            result = -1;
+            break;
+        }
+        left -= c;
+        if ((size_t)c != want)
+            break;
+    }
+
+    /* some filesystems accept the flag and only refuse the first aligned transfer */
+    if (result < 0 && left == size && tier_unsupported(errno) && lseek(src_fd, src_start, SEEK_SET) == src_start &&
+        lseek(dst_fd, dst_start, SEEK_SET) == dst_start)
+        result = 1;
+
+    set_direct(src_fd, src_flags, 0);
+    set_direct(dst_fd, dst_flags, 0);
+    free(buf);
+
+    /* reads to EOF, so data appended meanwhile still arrives */
+    if (result == 0)
+        result = copy_rw(src_fd, dst_fd, left);
+    return result;
+}
+
+/* copy size bytes from the current offset of src_fd to dst_fd using the cheapest
+ * mechanism the filesystems allow, method receives the tier that finished the copy
+ * returns: 0 on success, -1 on failure
+ */
+int copy_data(int src_fd, int dst_fd, off_t size, copy_method *method)
+{
+    off_t left;
+
+    *method = COPY_NONE;
+    if (size == 0)
+        return 0;
+
+    /* a clone replaces the whole file, so only when starting from scratch */
+    struct stat st;
+    int from_start = lseek(src_fd, 0, SEEK_CUR) == 0 && lseek(dst_fd, 0, SEEK_CUR) == 0;
+    *method = COPY_REFLINK;
+    if (from_start && copy_reflink(src_fd, dst_fd) == 0)
+        return 0;
+
+    if (from_start && fstat(src_fd, &st) == 0)
+    {
+        /* holes stay holes, the final size is set without writing the trailing one */
+        if (is_sparse(&st))
+        {
+            if (copy_sparse_range(src_fd, dst_fd, 0, size, method) < 0 || ftruncate(dst_fd, size) < 0)
+                return -1;
+            *method = COPY_SPARSE;
+            return 0;
+        }
+
+        io_prepare(src_fd, dst_fd, &st);
+
+        int direct;
+        if (io_use_direct(&st) && (direct = copy_direct(src_fd, dst_fd, size)) <= 0)
+        {
+            *method = COPY_DIRECT;
+            return direct;
+        }
+    }
+
+    *method = COPY_RANGE;
+    if ((left = try_copy_range(src_fd, dst_fd, size)) <= 0)
+        return left;
+
+    *method = COPY_SENDFILE;
+    if ((left = try_sendfile(src_fd, dst_fd, left)) <= 0)
+        return left;
+
+    /* data may still grow past the stat size, the rw loop reads until EOF */
+    *method = COPY_RW;
+    return copy_rw(src_fd, dst_fd, left);
+}
+
+/* copy len bytes at offset off between the same positions of both files,
+ * file offsets are left alone so several threads can share the descriptors
+ * returns: 0 on success, -1 on failure
+ */
+int copy_range(int src_fd, int dst_fd, off_t off, off_t len, copy_method *method)
+{
+    off_t src_off = off, dst_off = off;
+
+    *method = COPY_RANGE;
+    while (len > 0)
+    {
+        size_t chunk = len > CHUNK_MAX ? CHUNK_MAX : (size_t)len;
+        ssize_t c = TEMP_FAILURE_RETRY(copy_file_range(src_fd, &src_off, dst_fd, &dst_off, chunk, 0));
+        if (c < 0 && tier_unsupported(errno))
+            break;
+        if (c < 0)
+            return -1;
+        if (c == 0)
+            return 0;
+        len -= c;
+    }
+
+    if (len == 0)
+        return 0;
+
+    *method = COPY_RW;
+    size_t buf_size = io_buffer_size(dst_fd, len);
+    char *buffer = malloc(buf_size);
+    if (buffer == NULL)
+        return -1;
+
+    int result = 0;
+    while (len > 0 && result == 0)
+    {
+        size_t chunk = (size_t)len > buf_size ? buf_size : (size_t)len;
+        ssize_t c = TEMP_FAILURE_RETRY(pread(src_fd, buffer, chunk, src_off));
+        if (c <= 0)
+        {
+            result = c;
+            break;
+        }
+        for (ssize_t done = 0; done < c;)
+        {
+            ssize_t w = TEMP_FAILURE_RETRY(pwrite(dst_fd, buffer + done, c - done, dst_off + done));
+            if (w < 0)
+            {
+                result = -1;
+                break;
+            }
+            done += w;
+        }
+        src_off += c;
+        dst_off += c;
+        len -= c;
+    }
+
+    free(buffer);
+    return result;
+}
+
+/* returns: 1 if fewer blocks are allocated than the size needs, so st has holes */
+int is_sparse(const struct stat *st)
+{
+    return S_ISREG(st->st_mode) && (off_t)st->st_blocks * 512 < st->st_size;
+}
+
+/* like copy_range but only the data segments of src are copied, the target
+ * has to be sized by the caller so the skipped holes read back as zeros
+ * returns: 0 on success, -1 on failure
+ */
+int copy_sparse_range(int src_fd, int dst_fd, off_t off, off_t len, copy_method *method)
+{
+    off_t end = off + len;
+    copy_method seg_method;
+
+    *method = COPY_NONE;
+    while (off < end)
+    {
+        /* only the returned offsets are used, so sharing src_fd between threads is fine */
+        off_t data = lseek(src_fd, off, SEEK_DATA);
+        if (data < 0 && errno == ENXIO)
+            return 0;
+        if (data < 0)
+            return copy_range(src_fd, dst_fd, off, end - off, method);
+        if (data >= end)
+            return 0;
+
+        off_t hole = lseek(src_fd, data, SEEK_HOLE);
+        if (hole < 0 || hole > end)
+            hole = end;
+
+        if (copy_range(src_fd, dst_fd, data, hole - data, &seg_method) < 0)
+            return -1;
+        if (seg_method > *method)
+            *method = seg_method;
+        off = hole;
+    }
+    return 0;
+}
+
+const char *copy_method_name(copy_method method)
+{
+    if (method < 0 || method >= COPY_METHOD_CNT)
+        return "unknown";
+    return method_names[method];
+}
+
+static void read_trace(void) { trace = getenv("SOP_BACKUP_TRACE") != NULL; }
+
+/* count the file under its method, trace it when SOP_BACKUP_TRACE is set */
+void copy_stats_record(const char *path, copy_method method, off_t size)
+{
+    atomic_fetch_add(&files_by_method[method], 1);
+    atomic_fetch_add(&bytes_by_method[method], (unsigned long long)size);
+    stats_copied(size);
+
+    pthread_once(&trace_once, read_trace);
+    if (trace)
+        fprintf(stderr, "copy: %s (%lld bytes) via %s\n", path, (long long)size, copy_method_name(method));
+}
+
+unsigned long copy_stats_files(copy_method method) { return atomic_load(&files_by_method[method]); }
+
+unsigned long long copy_stats_bytes(copy_method method) { return atomic_load(&bytes_by_method[method]); }
+
+void copy_stats_print(FILE *out)
+{
+    for (int m = COPY_REFLINK; m < COPY_METHOD_CNT; m++)
+    {
+        fprintf(out, "%-16s %8lu files %14llu bytes\n", copy_method_name(m), copy_stats_files(m), copy_stats_bytes(m));
+    }
+}
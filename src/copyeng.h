@@ -0,0 +1,52 @@
+#ifndef CE_H
+#define CE_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* ways data of a regular file can reach the target, cheapest first */
+typedef enum CopyMethod
+{
+    COPY_NONE = 0,
+    COPY_REFLINK,
+    COPY_RANGE,
+    COPY_SENDFILE,
+    COPY_RW,
+    COPY_FANOUT,
+    COPY_URING,
+    COPY_DELTA,
+    COPY_DEDUP,
+    COPY_SPARSE,
+    COPY_DIRECT,
+    COPY_COMPRESS,
+    COPY_PACK,
+    COPY_METHOD_CNT
+} copy_method;
+
+ssize_t bulk_read(int, char *, size_t);
+
+ssize_t bulk_write(int, char *, size_t);
+
+int copy_reflink(int, int);
+
+int copy_data(int, int, off_t, copy_method *);
+
+int copy_range(int, int, off_t, off_t, copy_method *);
+
+int is_sparse(const struct stat *);
+
+int copy_sparse_range(int, int, off_t, off_t, copy_method *);
+
+const char *copy_method_name(copy_method);
+
+void copy_stats_record(const char *, copy_method, off_t);
+
+unsigned long copy_stats_files(copy_method);
+
+unsigned long long copy_stats_bytes(copy_method);
+
+void copy_stats_print(FILE *);
+
+#endif
@@ -0,0 +1,640 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "copyeng.h"
+#include "dedup.h"
+#include "fileproc.h"
+#include "hash.h"
+#include "utils.h"
+#include "walk.h"
+
+/* top bits of the gear hash, zero on average every 64 KiB */
+#define CDC_MASK 0xffff000000000000ULL
+#define CDC_BUF (4 * CDC_MAX)
+#define RECIPE_MAGIC "#sop-backup recipe 1\n"
+/* digest, a space, the length and a newline */
+#define RECIPE_LINE (2 * SHA256_LEN + 24)
+/* every target that ever wrote recipes into the store, one absolute path per line */
+#define STORE_TARGETS "targets"
+/* chunks this fresh may belong to a file whose recipe is still on its way to the target */
+#define GC_GRACE_SEC 3600
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+/* the table must never change, chunk boundaries of old backups depend on it */
+static void init_gear(void)
+{
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+
+    for (int i = 0; i < 256; i++)
+    {
+        /* splitmix64 */
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+/* returns: length of the chunk starting at data, at most len */
+static size_t cdc_cut(const unsigned char *data, size_t len)
+{
+    uint64_t h = 0;
+
+    if (len <= CDC_MIN)
+        return len;
+    if (len > CDC_MAX)
+        len = CDC_MAX;
+
+    for (size_t i = CDC_MIN; i < len; i++)
+    {
+        h = (h << 1) + gear[data[i]];
+        if ((h & CDC_MASK) == 0)
+            return i + 1;
+    }
+    return len;
+}
+
+static void chunk_path(dedup_store *store, char *buf, size_t size, const char *hex)
+{
+    snprintf(buf, size, "%s/chunks/%.2s/%s", store->root, hex, hex);
+}
+
+/* create the store directory with one subdirectory per leading digest byte */
+dedup_store *dedup_open(const char *path)
+{
+    char dir[PATH_MAX];
+
+    if (create_directories(path) != 0)
+        return NULL;
+
+    dedup_store *store = calloc(1, sizeof(dedup_store));
+    if (store == NULL)
+        ERR("calloc");
+
+    /* recipes name the store absolutely so restore works from anywhere */
+    store->root = realpath(path, NULL);
+    if (store->root == NULL)
+    {
+        free(store);
+        return NULL;
+    }
+
+    for (int i = 0; i < 256; i++)
+    {
+        snprintf(dir, sizeof(dir), "%s/chunks/%02x", store->root, i);
+        if (create_directories(dir) != 0)
+        {
+            dedup_close(store);
+            return NULL;
+        }
+    }
+    return store;
+}
+
+void dedup_close(dedup_store *store)
+{
+    free(store->root);
+    free(store);
+}
+
+/* write a chunk unless the store already has it, a temporary name and rename
+ * keep concurrent writers of the same chunk from seeing partial data
+ * returns: 1 if the chunk was new, 0 if it was already stored, -1 on error
+ */
+static int store_chunk(dedup_store *store, const unsigned char *data, size_t len, char *hex)
+{
+    unsigned char digest[SHA256_LEN];
+    char path[PATH_MAX];
+    char tmp[PATH_MAX + 32];
+
+    sha256(data, len, digest);
+    sha256_hex(digest, hex);
+    chunk_path(store, path, sizeof(path), hex);
+
+    /* a reused chunk is touched, so a collection running meanwhile keeps it */
+    if (utimensat(AT_FDCWD, path, NULL, 0) == 0 || (errno != ENOENT && access(path, F_OK) == 0))
+    {
+        atomic_fetch_add(&store->chunks_dup, 1);
+        atomic_fetch_add(&store->bytes_dup, len);
+        return 0;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.%d.%lu", path, getpid(), atomic_fetch_add(&store->tmp_seq, 1));
+    int fd = TEMP_FAILURE_RETRY(open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0444));
+    if (fd < 0)
+        return -1;
+
+    if (bulk_write(fd, (char *)data, len) != (ssize_t)len)
+    {
+        TEMP_FAILURE_RETRY(close(fd));
+        unlink(tmp);
+        return -1;
+    }
+    TEMP_FAILURE_RETRY(close(fd));
+
+    if (rename(tmp, path) != 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+
+    atomic_fetch_add(&store->chunks_new, 1);
+    atomic_fetch_add(&store->bytes_new, len);
+    return 1;
+}
+
+static void recipe_append(char **recipe, size_t *len, size_t *cap, const char *text)
+{
+    size_t add = strlen(text);
+
+    if (*len + add + 1 > *cap)
+    {
+        *cap = (*cap + add + 1) * 2;
+        *recipe = realloc(*recipe, *cap);
+        if (*recipe == NULL)
+            ERR("realloc");
+    }
+    memcpy(*recipe + *len, text, add + 1);
+    *len += add;
+}
+
+/* split src into chunks, store the new ones and describe the file as a recipe
+ * the caller frees, stored receives the number of bytes that were not in the store yet
+ * returns: 0 on success, -1 if src can't be read or the store can't be written
+ */
+int dedup_chunk_file(dedup_store *store, const char *src, char **recipe, size_t *len, off_t *stored)
+{
+    char line[RECIPE_LINE + PATH_MAX];
+    char hex[2 * SHA256_LEN + 1];
+    struct stat st;
+    size_t cap = 0;
+    int result = 0;
+
+    pthread_once(&gear_once, init_gear);
+
+    int fd = TEMP_FAILURE_RETRY(open(src, O_RDONLY));
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0)
+    {
+        TEMP_FAILURE_RETRY(close(fd));
+        return -1;
+    }
+
+    unsigned char *buf = malloc(CDC_BUF);
+    if (buf == NULL)
+        ERR("malloc");
+
+    *recipe = NULL;
+    *len = 0;
+    *stored = 0;
+    snprintf(line, sizeof(line), RECIPE_MAGIC "store %s\nsize %lld\n", store->root, (long long)st.st_size);
+    recipe_append(recipe, len, &cap, line);
+
+    size_t start = 0, end = 0;
+    int eof = 0;
+    while (!eof || start < end)
+    {
+        /* keep at least one maximal chunk buffered so cuts don't depend on read sizes */
+        if (!eof && end - start < CDC_MAX)
+        {
+            memmove(buf, buf + start, end - start);
+            end -= start;
+            start = 0;
+
+            ssize_t c = bulk_read(fd, (char *)buf + end, CDC_BUF - end);
+            if (c < 0)
+            {
+                result = -1;
+                break;
+            }
+            if (c == 0)
+                eof = 1;
+            end += c;
+            continue;
+        }
+
+        size_t cut = cdc_cut(buf + start, end - start);
+        int added = store_chunk(store, buf + start, cut, hex);
+        if (added < 0)
+        {
+            result = -1;
+            break;
+        }
+        if (added)
+            *stored += cut;
+
+        snprintf(line, sizeof(line), "%s %zu\n", hex, cut);
+        recipe_append(recipe, len, &cap, line);
+        start += cut;
+    }
+
+    free(buf);
+    TEMP_FAILURE_RETRY(close(fd));
+    if (result < 0)
+    {
+        free(*recipe);
+        *recipe = NULL;
+    }
+    return result;
+}
+
+/* replace whatever is at dst by the recipe, stamped with the times of the source */
+int dedup_write_recipe(const char *dst, const char *recipe, size_t len, const struct stat *st)
+{
+    clear_target_entry(dst, 0);
+
+    int fd = TEMP_FAILURE_RETRY(open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666));
+    if (fd < 0)
+        return -1;
+
+    int result = bulk_write(fd, (char *)recipe, len) == (ssize_t)len ? 0 : -1;
+    if (result == 0)
+        copy_times(fd, st);
+    TEMP_FAILURE_RETRY(close(fd));
+    return result;
+}
+
+/* read the header of a recipe, store and size may be NULL
+ * returns: the open stream positioned at the first chunk line, NULL if path is no recipe
+ */
+static FILE *open_recipe(const char *path, char **store, long long *size)
+{
+    char *line = NULL;
+    size_t cap = 0;
+    long long file_size = -1;
+
+    FILE *f = fopen(path, "re");
+    if (f == NULL)
+        return NULL;
+
+    if (getline(&line, &cap, f) < 0 || strcmp(line, RECIPE_MAGIC) != 0 || getline(&line, &cap, f) < 0 ||
+        strncmp(line, "store ", 6) != 0)
+        goto bad;
+
+    line[strcspn(line, "\n")] = '\0';
+    if (store && (*store = strdup(line + 6)) == NULL)
+        ERR("strdup");
+
+    if (getline(&line, &cap, f) < 0 || sscanf(line, "size %lld", &file_size) != 1)
+    {
+        if (store)
+            free(*store);
+        goto bad;
+    }
+
+    if (size)
+        *size = file_size;
+    free(line);
+    return f;
+
+bad:
+    free(line);
+    fclose(f);
+    return NULL;
+}
+
+/* returns: 1 if dst is a recipe of a file with the size and mtime of st */
+int dedup_recipe_current(const char *dst, const struct stat *st)
+{
+    struct stat dst_st;
+    long long size;
+
+    if (lstat(dst, &dst_st) == -1 || !S_ISREG(dst_st.st_mode) || dst_st.st_mtim.tv_sec != st->st_mtim.tv_sec ||
+        dst_st.st_mtim.tv_nsec != st->st_mtim.tv_nsec)
+        return 0;
+
+    FILE *f = open_recipe(dst, NULL, &size);
+    if (f == NULL)
+        return 0;
+    fclose(f);
+    return size == st->st_size;
+}
+
+/* append one stored chunk to fd, checking it still has the digest it is filed under */
+static int restore_chunk(const char *root, const char *hex, size_t len, int fd, unsigned char *buf)
+{
+    unsigned char digest[SHA256_LEN];
+    char path[PATH_MAX];
+    char got[2 * SHA256_LEN + 1];
+
+    snprintf(path, sizeof(path), "%s/chunks/%.2s/%s", root, hex, hex);
+    int chunk_fd = TEMP_FAILURE_RETRY(open(path, O_RDONLY));
+    if (chunk_fd < 0)
+        return -1;
+
+    ssize_t c = bulk_read(chunk_fd, (char *)buf, len);
+    TEMP_FAILURE_RETRY(close(chunk_fd));
+    if (c != (ssize_t)len)
+        return -1;
+
+    sha256(buf, len, digest);
+    sha256_hex(digest, got);
+    if (strcmp(got, hex) != 0)
+    {
+        errno = EIO;
+        return -1;
+    }
+
+    /* zeros become a hole, the caller sets the final size */
+    if (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0)
+        return lseek(fd, len, SEEK_CUR) < 0 ? -1 : 0;
+
+    return bulk_write(fd, (char *)buf, len) == (ssize_t)len ? 0 : -1;
+}
+
+/* rebuild the file described by the recipe at path into dst
+ * returns: 1 if dst was rebuilt, 0 if path is not a recipe, -1 on error
+ */
+int dedup_restore_file(const char *path, const char *dst)
+{
+    struct stat st;
+    char *root;
+    char *line = NULL;
+    size_t cap = 0;
+    long long size;
+    int result = 1;
+
+    FILE *f = open_recipe(path, &root, &size);
+    if (f == NULL)
+        return 0;
+
+    unsigned char *buf = malloc(CDC_MAX);
+    if (buf == NULL)
+        ERR("malloc");
+
+    clear_target_entry(dst, 0);
+    int fd = TEMP_FAILURE_RETRY(open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666));
+    if (fd < 0)
+        result = -1;
+
+    long long restored = 0;
+    while (result == 1 && getline(&line, &cap, f) > 0)
+    {
+        char hex[2 * SHA256_LEN + 1] = "";
+        size_t len;
+
+        if (sscanf(line, "%64s %zu", hex, &len) != 2 || strlen(hex) != 2 * SHA256_LEN || len == 0 || len > CDC_MAX ||
+            restore_chunk(root, hex, len, fd, buf) < 0)
+        {
+            fprintf(stderr, "restore %s: bad or missing chunk %s\n", dst, hex);
+            result = -1;
+            break;
+        }
+        restored += len;
+    }
+
+    if (result == 1 && restored != size)
+    {
+        fprintf(stderr, "restore %s: recipe is truncated\n", dst);
+        result = -1;
+    }
+    if (result == 1 && ftruncate(fd, size) < 0)
+        result = -1;
+
+    if (fd >= 0)
+    {
+        if (result == 1 && fstat(fileno(f), &st) == 0)
+            copy_times(fd, &st);
+        TEMP_FAILURE_RETRY(close(fd));
+    }
+
+    free(line);
+    free(buf);
+    free(root);
+    fclose(f);
+    return result;
+}
+
+/* note target in the store so dedup_gc looks for live recipes in it
+ * returns: 0 on success, -1 on error
+ */
+int dedup_add_target(dedup_store *store, const char *target)
+{
+    char path[PATH_MAX];
+    char *line = NULL;
+    size_t cap = 0;
+    int found = 0;
+
+    char *real = realpath(target, NULL);
+    if (real == NULL)
+        return -1;
+
+    snprintf(path, sizeof(path), "%s/" STORE_TARGETS, store->root);
+    FILE *f = fopen(path, "a+e");
+    if (f == NULL)
+    {
+        free(real);
+        return -1;
+    }
+    while (!found && getline(&line, &cap, f) > 0)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        found = strcmp(line, real) == 0;
+    }
+
+    /* a line is appended in one write, two backups adding the same target only leave it twice */
+    int result = found || fprintf(f, "%s\n", real) > 0 ? 0 : -1;
+    if (fclose(f) != 0)
+        result = -1;
+    free(line);
+    free(real);
+    return result;
+}
+
+/* digests of the chunks live recipes use, open addressing on the hash of the hex digest */
+typedef struct ChunkSet
+{
+    char (*hex)[2 * SHA256_LEN + 1];
+    size_t cap;
+    size_t cnt;
+} chunk_set;
+
+/* returns: slot holding hex, or the empty one it would go to */
+static size_t set_slot(const chunk_set *set, const char *hex)
+{
+    size_t i = hash64(hex, 2 * SHA256_LEN, HASH64_SEED) & (set->cap - 1);
+    while (set->hex[i][0] != '\0' && strcmp(set->hex[i], hex) != 0)
+        i = (i + 1) & (set->cap - 1);
+    return i;
+}
+
+static void set_add(chunk_set *set, const char *hex)
+{
+    if (2 * (set->cnt + 1) > set->cap)
+    {
+        chunk_set grown = {calloc(set->cap ? 2 * set->cap : 1024, sizeof(*set->hex)), set->cap ? 2 * set->cap : 1024,
+                           set->cnt};
+        if (grown.hex == NULL)
+            ERR("calloc");
+        for (size_t i = 0; i < set->cap; i++)
+        {
+            if (set->hex[i][0] != '\0')
+                memcpy(grown.hex[set_slot(&grown, set->hex[i])], set->hex[i], sizeof(*set->hex));
+        }
+        free(set->hex);
+        *set = grown;
+    }
+
+    size_t i = set_slot(set, hex);
+    if (set->hex[i][0] == '\0')
+    {
+        memcpy(set->hex[i], hex, sizeof(*set->hex));
+        set->cnt++;
+    }
+}
+
+static int set_has(const chunk_set *set, const char *hex)
+{
+    return set->cap > 0 && set->hex[set_slot(set, hex)][0] != '\0';
+}
+
+/* walk state of the mark phase */
+typedef struct GcCtx
+{
+    char *root;
+    chunk_set live;
+} gc_ctx;
+
+/* walk callback over a target: every chunk a recipe of this store names is live, generations included */
+static int mark_recipe(const walk_entry *entry, void *arg)
+{
+    gc_ctx *ctx = arg;
+    char hex[2 * SHA256_LEN + 1];
+    char *root;
+    char *line = NULL;
+    size_t cap = 0, len;
+
+    if (entry->type != DT_REG)
+        return WALK_CONTINUE;
+    FILE *f = open_recipe(entry->path, &root, NULL);
+    if (f == NULL)
+        return WALK_CONTINUE;
+
+    while (strcmp(root, ctx->root) == 0 && getline(&line, &cap, f) > 0)
+    {
+        if (sscanf(line, "%64s %zu", hex, &len) == 2 && strlen(hex) == 2 * SHA256_LEN)
+            set_add(&ctx->live, hex);
+    }
+
+    free(line);
+    free(root);
+    fclose(f);
+    return WALK_CONTINUE;
+}
+
+/* unlink a chunk unless a backup stored or reused it after before, it is renamed aside first
+ * so one reusing it meanwhile either touched it already and it goes back, or finds it gone
+ * and stores it again
+ * returns: size of the removed chunk, -1 if it was kept
+ */
+static off_t drop_chunk(int dir_fd, const char *name, const struct timespec *before)
+{
+    char aside[2 * SHA256_LEN + 8];
+    struct stat st;
+
+    snprintf(aside, sizeof(aside), "%s.gc", name);
+    if (renameat(dir_fd, name, dir_fd, aside) != 0)
+        return -1;
+
+    if (fstatat(dir_fd, aside, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+        (st.st_mtim.tv_sec < before->tv_sec ||
+         (st.st_mtim.tv_sec == before->tv_sec && st.st_mtim.tv_nsec < before->tv_nsec)) &&
+        unlinkat(dir_fd, aside, 0) == 0)
+        return st.st_size;
+
+    renameat(dir_fd, aside, dir_fd, name);
+    return -1;
+}
+
+/* remove the chunks of the store at path that no recipe in its targets names, chunks stored
+ * or reused within GC_GRACE_SEC are kept for the backups still writing recipes
+ * returns: 0 on success, -1 if the store or one of its targets can't be read
+ */
+int dedup_gc(const char *path, FILE *out)
+{
+    char file[PATH_MAX];
+    char *line = NULL;
+    size_t cap = 0;
+    struct timespec before;
+    unsigned long removed = 0;
+    unsigned long long bytes = 0;
+    int result = 0;
+
+    gc_ctx ctx = {realpath(path, NULL), {NULL, 0, 0}};
+    if (ctx.root == NULL)
+        return -1;
+    clock_gettime(CLOCK_REALTIME, &before);
+    before.tv_sec -= GC_GRACE_SEC;
+
+    /* a target that can't be walked may hold the only recipe of any chunk */
+    snprintf(file, sizeof(file), "%s/" STORE_TARGETS, ctx.root);
+    FILE *f = fopen(file, "re");
+    if (f == NULL)
+        perror(file);
+    while (f != NULL && result == 0 && getline(&line, &cap, f) > 0)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        if (walk_tree(line, 0, mark_recipe, &ctx) != 0)
+        {
+            fprintf(out, "gc: target %s can't be read, drop it from %s to collect without it\n", line, file);
+            result = -1;
+        }
+    }
+    if (f == NULL || result != 0)
+        goto out;
+
+    for (int i = 0; i < 256; i++)
+    {
+        const char *name;
+        unsigned char type;
+        dir_reader r;
+
+        snprintf(file, sizeof(file), "%s/chunks/%02x", ctx.root, i);
+        if (dir_open(&r, AT_FDCWD, file) != 0)
+            continue;
+        while (dir_next(&r, &name, &type) > 0)
+        {
+            /* temporary names of chunks being written are longer */
+            if (strlen(name) != 2 * SHA256_LEN || set_has(&ctx.live, name))
+                continue;
+            off_t size = drop_chunk(r.fd, name, &before);
+            if (size >= 0)
+            {
+                removed++;
+                bytes += size;
+            }
+        }
+        dir_close(&r);
+    }
+    fprintf(out, "gc: %lu chunks removed (%llu bytes), %zu in use\n", removed, bytes, ctx.live.cnt);
+
+out:
+    if (f != NULL)
+        fclose(f);
+    free(line);
+    free(ctx.live.hex);
+    free(ctx.root);
+    return f == NULL ? -1 : result;
+}
+
+void dedup_stats_print(dedup_store *store, FILE *out)
+{
+    fprintf(out, "dedup: %lu new chunks (%llu bytes), %lu reused chunks (%llu bytes)\n",
+            atomic_load(&store->chunks_new), atomic_load(&store->bytes_new), atomic_load(&store->chunks_dup),
+            atomic_load(&store->bytes_dup));
+}
@@ -0,0 +1,42 @@
+#ifndef DD_H
+#define DD_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+/* content-defined chunk sizes, cuts land on the same data wherever it sits in a file */
+#define CDC_MIN (16 * 1024)
+#define CDC_MAX (256 * 1024)
+
+/* chunks shared by every target and backup pointed at the same directory */
+typedef struct DedupStore
+{
+    char *root;
+    atomic_ulong chunks_new;
+    atomic_ulong chunks_dup;
+    atomic_ullong bytes_new;
+    atomic_ullong bytes_dup;
+    atomic_ulong tmp_seq;
+} dedup_store;
+
+dedup_store *dedup_open(const char *);
+
+void dedup_close(dedup_store *);
+
+int dedup_chunk_file(dedup_store *, const char *, char **, size_t *, off_t *);
+
+int dedup_write_recipe(const char *, const char *, size_t, const struct stat *);
+
+int dedup_recipe_current(const char *, const struct stat *);
+
+int dedup_restore_file(const char *, const char *);
+
+int dedup_add_target(dedup_store *, const char *);
+
+int dedup_gc(const char *, FILE *);
+
+void dedup_stats_print(dedup_store *, FILE *);
+
+#endif
@@ -0,0 +1,268 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "delta.h"
+#include "fileproc.h"
+#include "hash.h"
+#include "utils.h"
+
+#define DELTA_BUCKETS 256
+
+static size_t bucket_of(delta_table *table, const char *path)
+{
+    return hash64(path, strlen(path), HASH64_SEED) % table->bucket_cnt;
+}
+
+static void free_entry(delta_entry *entry)
+{
+    free(entry->path);
+    free(entry->sums);
+    free(entry);
+}
+
+delta_table *delta_table_create(void)
+{
+    delta_table *table = malloc(sizeof(delta_table));
+    if (table == NULL)
+        ERR("malloc");
+
+    pthread_mutex_init(&table->lock, NULL);
+    table->bucket_cnt = DELTA_BUCKETS;
+    table->buckets = calloc(table->bucket_cnt, sizeof(delta_entry *));
+    if (table->buckets == NULL)
+        ERR("calloc");
+    return table;
+}
+
+void delta_table_destroy(delta_table *table)
+{
+    for (size_t i = 0; i < table->bucket_cnt; i++)
+    {
+        delta_entry *entry = table->buckets[i];
+        while (entry)
+        {
+            delta_entry *next = entry->next;
+            free_entry(entry);
+            entry = next;
+        }
+    }
+    pthread_mutex_destroy(&table->lock);
+    free(table->buckets);
+    free(table);
+}
+
+/* unlink the entry for path from the table, the caller owns it afterwards */
+static delta_entry *take_entry(delta_table *table, const char *path)
+{
+    pthread_mutex_lock(&table->lock);
+    delta_entry **link = &table->buckets[bucket_of(table, path)];
+    while (*link && strcmp((*link)->path, path) != 0)
+        link = &(*link)->next;
+
+    delta_entry *entry = *link;
+    if (entry)
+        *link = entry->next;
+    pthread_mutex_unlock(&table->lock);
+    return entry;
+}
+
+static void put_entry(delta_table *table, delta_entry *entry)
+{
+    pthread_mutex_lock(&table->lock);
+    size_t b = bucket_of(table, entry->path);
+    entry->next = table->buckets[b];
+    table->buckets[b] = entry;
+    pthread_mutex_unlock(&table->lock);
+}
+
+/* drop checksums of path and of every file below it */
+void delta_forget(delta_table *table, const char *path)
+{
+    size_t len = strlen(path);
+
+    pthread_mutex_lock(&table->lock);
+    for (size_t i = 0; i < table->bucket_cnt; i++)
+    {
+        delta_entry **link = &table->buckets[i];
+        while (*link)
+        {
+            delta_entry *entry = *link;
+            if (strncmp(entry->path, path, len) == 0 && (entry->path[len] == '\0' || entry->path[len] == '/'))
+            {
+                *link = entry->next;
+                free_entry(entry);
+                continue;
+            }
+            link = &entry->next;
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+}
+
+static ssize_t pread_full(int fd, char *buf, size_t count, off_t offset)
+{
+    size_t done = 0;
+    while (done < count)
+    {
+        ssize_t c = TEMP_FAILURE_RETRY(pread(fd, buf + done, count - done, offset + done));
+        if (c < 0)
+            return -1;
+        if (c == 0)
+            break;
+        done += c;
+    }
+    return done;
+}
+
+static int pwrite_full(int fd, const char *buf, size_t count, off_t offset)
+{
+    size_t done = 0;
+    while (done < count)
+    {
+        ssize_t c = TEMP_FAILURE_RETRY(pwrite(fd, buf + done, count - done, offset + done));
+        if (c < 0)
+            return -1;
+        done += c;
+    }
+    return 0;
+}
+
+static int grow_sums(delta_entry *entry, size_t block_cnt)
+{
+    if (block_cnt <= entry->block_cnt)
+        return 0;
+
+    unsigned char (*sums)[SHA256_LEN] = realloc(entry->sums, block_cnt * SHA256_LEN);
+    if (sums == NULL)
+        return -1;
+    entry->sums = sums;
+    return 0;
+}
+
+/* checksum every block of the replica, done once per file and after outside changes */
+static int scan_replica(delta_entry *entry, int dst_fd, const struct stat *dst_st, char *buf)
+{
+    size_t block_cnt = (dst_st->st_size + DELTA_BLOCK - 1) / DELTA_BLOCK;
+
+    entry->block_cnt = 0;
+    if (grow_sums(entry, block_cnt) < 0)
+        return -1;
+
+    for (size_t i = 0; i < block_cnt; i++)
+    {
+        ssize_t len = pread_full(dst_fd, buf, DELTA_BLOCK, (off_t)i * DELTA_BLOCK);
+        if (len < 0)
+            return -1;
+        sha256(buf, len, entry->sums[i]);
+    }
+
+    entry->block_cnt = block_cnt;
+    entry->size = dst_st->st_size;
+    entry->mtime = dst_st->st_mtim;
+    return 0;
+}
+
+/* rewrite in place only the blocks of dst that differ from src, never truncating
+ * below the new size, written receives the number of bytes written
+ * returns: 0 on success, -1 if dst has to be copied in full instead
+ */
+int delta_copy(delta_table *table, const char *src, const char *dst, off_t *written)
+{
+    struct stat src_st, dst_st;
+    int result = -1;
+
+    *written = 0;
+    int src_fd = TEMP_FAILURE_RETRY(open(src, O_RDONLY));
+    if (src_fd < 0)
+        return -1;
+
+    int dst_fd = TEMP_FAILURE_RETRY(open(dst, O_RDWR | O_NOFOLLOW));
+    if (dst_fd < 0 || fstat(src_fd, &src_st) < 0 || fstat(dst_fd, &dst_st) < 0 || !S_ISREG(dst_st.st_mode))
+        goto out;
+
+    char *buf = malloc(DELTA_BLOCK);
+    if (buf == NULL)
+        goto out;
+
+    /* sums are only trusted while nobody else touched the replica */
+    delta_entry *entry = take_entry(table, dst);
+    if (entry == NULL)
+    {
+        entry = calloc(1, sizeof(delta_entry));
+        if (entry == NULL || (entry->path = strdup(dst)) == NULL)
+            ERR("calloc");
+    }
+    if (entry->block_cnt == 0 || entry->size != dst_st.st_size || entry->mtime.tv_sec != dst_st.st_mtim.tv_sec ||
+        entry->mtime.tv_nsec != dst_st.st_mtim.tv_nsec)
+    {
+        if (scan_replica(entry, dst_fd, &dst_st, buf) < 0)
+        {
+            free_entry(entry);
+            free(buf);
+            goto out;
+        }
+    }
+
+    size_t block_cnt = (src_st.st_size + DELTA_BLOCK - 1) / DELTA_BLOCK;
+    if (grow_sums(entry, block_cnt) < 0)
+    {
+        free_entry(entry);
+        free(buf);
+        goto out;
+    }
+
+    result = 0;
+    for (size_t i = 0; i < block_cnt; i++)
+    {
+        off_t offset = (off_t)i * DELTA_BLOCK;
+        ssize_t len = pread_full(src_fd, buf, DELTA_BLOCK, offset);
+        if (len <= 0)
+        {
+            result = len < 0 ? -1 : 0;
+            block_cnt = i;
+            break;
+        }
+
+        unsigned char sum[SHA256_LEN];
+        sha256(buf, len, sum);
+        if (i < entry->block_cnt && memcmp(entry->sums[i], sum, SHA256_LEN) == 0)
+            continue;
+
+        if (pwrite_full(dst_fd, buf, len, offset) < 0)
+        {
+            result = -1;
+            break;
+        }
+        memcpy(entry->sums[i], sum, SHA256_LEN);
+        *written += len;
+    }
+
+    if (result == 0 && src_st.st_size < dst_st.st_size && ftruncate(dst_fd, src_st.st_size) < 0)
+        result = -1;
+
+    if (result == 0)
+    {
+        copy_times(dst_fd, &src_st);
+        entry->block_cnt = block_cnt;
+        entry->size = src_st.st_size;
+        entry->mtime = src_st.st_mtim;
+        put_entry(table, entry);
+    }
+    else
+    {
+        free_entry(entry);
+    }
+    free(buf);
+
+out:
+    if (dst_fd >= 0)
+        TEMP_FAILURE_RETRY(close(dst_fd));
+    TEMP_FAILURE_RETRY(close(src_fd));
+    return result;
+}
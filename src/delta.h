@@ -0,0 +1,40 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "hash.h"
+
+#define DELTA_BLOCK (1024 * 1024)
+
+/* block checksums of one replica file, valid while its size and mtime match */
+typedef struct DeltaEntry
+{
+    char *path;
+    off_t size;
+    struct timespec mtime;
+    size_t block_cnt;
+    unsigned char (*sums)[SHA256_LEN]; /* a block is only skipped when its sha256 matches */
+    struct DeltaEntry *next;
+} delta_entry;
+
+typedef struct DeltaTable
+{
+    pthread_mutex_t lock;
+    delta_entry **buckets;
+    size_t bucket_cnt;
+} delta_table;
+
+delta_table *delta_table_create(void);
+
+void delta_table_destroy(delta_table *);
+
+void delta_forget(delta_table *, const char *);
+
+int delta_copy(delta_table *, const char *, const char *, off_t *);
+
+#endif
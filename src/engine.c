@@ -0,0 +1,717 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "coalesce.h"
+#include "engine.h"
+#include "fanwatch.h"
+#include "fileproc.h"
+#include "pool.h"
+#include "registry.h"
+#include "stats.h"
+#include "synchro.h"
+#include "utils.h"
+
+#define ENGINE_EVENTS 256
+/* initial copies running side by side, each with the threads of its -j */
+#define ENGINE_COPIERS 2
+/* changes one drain task applies before it lets other backups have the thread */
+#define ENGINE_BATCH 64
+
+typedef enum EngineMsgType
+{
+    ENGINE_ADD,
+    ENGINE_END,
+    ENGINE_GONE
+} engine_msg_type;
+
+/* one datagram between the shell and the engine, ADD carries the source,
+ * the targets and the store as consecutive C strings in paths
+ */
+typedef struct EngineMsg
+{
+    engine_msg_type type;
+    int backup;
+    int slot; /* END: the one target to detach, -1 ends the whole backup */
+    int stats;
+    int cnt;
+    backup_opts opts;
+    char paths[];
+} engine_msg;
+
+#define ENGINE_MSG_MAX (sizeof(engine_msg) + 11 * PATH_MAX)
+
+/* a change waiting for the drain task of its backup */
+typedef struct EngineJob
+{
+    sync_action action;
+    char *src;
+    char *rel;
+    char *from; /* old path of a SYNC_RENAME */
+    long long queued_ms;
+    struct EngineJob *next;
+} engine_job;
+
+struct Engine;
+
+typedef struct EngineBackup
+{
+    struct Engine *engine;
+    int id;
+    int stats_slot;
+    worker_stats *stats;
+    char *src;
+    char *store;
+    backup_opts opts;
+    fanout *fo;
+    coalescer *co;
+    watch_sub *sub; /* NULL when a fanotify mark serves the source */
+    fan_watch *fan;
+    pthread_mutex_t lock; /* guards the job queue and the flags below */
+    engine_job *head;
+    engine_job *tail;
+    long jobs;
+    int gone;    /* the source disappeared during the current dispatch */
+    int running; /* a drain task owns fo */
+    int ready;   /* the initial copy is done, changes may be applied */
+    int closing;
+    struct EngineBackup *next;      /* open or closing list */
+    struct EngineBackup *copy_next; /* queue of initial copies */
+} engine_backup;
+
+/* every backup of the process, only the event loop touches the lists and the coalescers */
+typedef struct Engine
+{
+    int epoll;
+    int channel;
+    int signal;
+    int wake; /* eventfd, a closing backup went idle */
+    watch_registry *registry; /* inotify watches shared by every backup not on fanotify */
+    thread_pool *pool;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    engine_backup *copy_head;
+    engine_backup *copy_tail;
+    engine_backup *open;
+    engine_backup *closing;
+} engine;
+
+/* shell side */
+static pid_t engine_pid;
+static int engine_fd = -1;
+static int next_backup;
+
+static void wake_loop(engine *e)
+{
+    uint64_t one = 1;
+    if (write(e->wake, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        ERR("write");
+}
+
+static void send_gone(engine *e, int id)
+{
+    engine_msg msg = {.type = ENGINE_GONE, .backup = id};
+    send(e->channel, &msg, sizeof(msg), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/* publish the depth of the job queue of b, its lock held */
+static void publish_jobs(engine_backup *b)
+{
+    stats_queue(QUEUE_JOBS, b->jobs, b->head ? b->head->queued_ms : 0);
+}
+
+/* apply queued changes of one backup in order, a batch at a time */
+static void drain_task(void *arg)
+{
+    engine_backup *b = arg;
+    engine *e = b->engine;
+
+    stats_use(b->stats);
+    for (int done = 0;; done++)
+    {
+        pthread_mutex_lock(&b->lock);
+        engine_job *job = b->head;
+        if (job && !b->closing && done == ENGINE_BATCH)
+        {
+            pthread_mutex_unlock(&b->lock);
+            pool_submit(e->pool, drain_task, b);
+            return;
+        }
+        if (job == NULL || b->closing)
+        {
+            /* b may be freed by the loop as soon as running drops */
+            int closing = b->closing;
+            b->running = 0;
+            pthread_mutex_unlock(&b->lock);
+            if (closing)
+                wake_loop(e);
+            return;
+        }
+        b->head = job->next;
+        if (b->head == NULL)
+            b->tail = NULL;
+        b->jobs--;
+        publish_jobs(b);
+        pthread_mutex_unlock(&b->lock);
+
+        apply_change(b->fo, job->action, job->src, job->rel, job->from);
+        free(job->src);
+        free(job->rel);
+        free(job->from);
+        free(job);
+    }
+}
+
+/* coalescer callback: queue a due change, starting a drain task unless one runs */
+static void enqueue_change(void *arg, sync_action action, const char *src_path, const char *rel_path,
+                           const char *from_rel)
+{
+    engine_backup *b = arg;
+
+    engine_job *job = malloc(sizeof(engine_job));
+    if (job == NULL || (job->src = strdup(src_path)) == NULL || (job->rel = strdup(rel_path)) == NULL)
+        ERR("malloc");
+    job->from = NULL;
+    if (from_rel && (job->from = strdup(from_rel)) == NULL)
+        ERR("strdup");
+    job->action = action;
+    job->queued_ms = stats_now_ms();
+    job->next = NULL;
+
+    pthread_mutex_lock(&b->lock);
+    if (b->closing)
+    {
+        pthread_mutex_unlock(&b->lock);
+        free(job->src);
+        free(job->rel);
+        free(job->from);
+        free(job);
+        return;
+    }
+    if (b->tail)
+        b->tail->next = job;
+    else
+        b->head = job;
+    b->tail = job;
+    b->jobs++;
+    publish_jobs(b);
+
+    int start = b->ready && !b->running;
+    if (start)
+        b->running = 1;
+    pthread_mutex_unlock(&b->lock);
+
+    if (start)
+        pool_submit(b->engine->pool, drain_task, b);
+}
+
+/* initial copies run outside the shared pool, they wait for their own copy tasks */
+static void *copier_work(void *arg)
+{
+    engine *e = arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&e->lock);
+        while (e->copy_head == NULL)
+            pthread_cond_wait(&e->cond, &e->lock);
+        engine_backup *b = e->copy_head;
+        e->copy_head = b->copy_next;
+        if (e->copy_head == NULL)
+            e->copy_tail = NULL;
+        pthread_mutex_unlock(&e->lock);
+
+        pthread_mutex_lock(&b->lock);
+        int closing = b->closing;
+        pthread_mutex_unlock(&b->lock);
+
+        if (!closing)
+        {
+            stats_use(b->stats);
+            stats_set_phase(STATS_COPYING);
+            start_copy(b->src, b->fo, &b->opts);
+            stats_set_phase(STATS_WATCHING);
+            stats_use(NULL);
+        }
+
+        /* changes seen during the copy were queued, they are applied on top of it */
+        pthread_mutex_lock(&b->lock);
+        b->ready = 1;
+        closing = b->closing;
+        int start = b->head && !b->running && !closing;
+        if (start)
+            b->running = 1;
+        pthread_mutex_unlock(&b->lock);
+
+        if (start)
+            pool_submit(e->pool, drain_task, b);
+        else if (closing)
+            wake_loop(e);
+    }
+    return NULL;
+}
+
+static void free_backup(engine_backup *b)
+{
+    while (b->head)
+    {
+        engine_job *job = b->head;
+        b->head = job->next;
+        free(job->src);
+        free(job->rel);
+        free(job->from);
+        free(job);
+    }
+
+    if (b->fo)
+    {
+        dedup_store *store = b->fo->store;
+        fanout_destroy(b->fo);
+        if (store)
+            dedup_close(store);
+    }
+    stats_release(b->stats_slot);
+    pthread_mutex_destroy(&b->lock);
+    free(b->src);
+    free(b->store);
+    free(b);
+}
+
+/* stop watching b and drop its pending changes, it is freed once no thread uses it */
+static void close_backup(engine *e, engine_backup *b, int notify)
+{
+    if (b->fan)
+    {
+        epoll_ctl(e->epoll, EPOLL_CTL_DEL, b->fan->fd, NULL);
+        fanotify_close(b->fan);
+    }
+    else
+    {
+        registry_unsubscribe(e->registry, b->sub);
+    }
+
+    pthread_mutex_lock(&b->lock);
+    b->closing = 1;
+    pthread_mutex_unlock(&b->lock);
+    coalescer_destroy(b->co);
+
+    engine_backup **link = &e->open;
+    while (*link != b)
+        link = &(*link)->next;
+    *link = b->next;
+    b->next = e->closing;
+    e->closing = b;
+
+    if (notify)
+        send_gone(e, b->id);
+    wake_loop(e);
+}
+
+/* free closing backups no drain task or copier holds any more */
+static void reap_backups(engine *e)
+{
+    uint64_t cnt;
+    if (read(e->wake, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+        ERR("read");
+
+    engine_backup **link = &e->closing;
+    while (*link)
+    {
+        engine_backup *b = *link;
+        pthread_mutex_lock(&b->lock);
+        int idle = b->ready && !b->running;
+        pthread_mutex_unlock(&b->lock);
+
+        if (!idle)
+        {
+            link = &b->next;
+            continue;
+        }
+        *link = b->next;
+        free_backup(b);
+    }
+}
+
+/* set up watches first so nothing changed during the initial copy is missed */
+static void open_backup(engine *e, engine_msg *msg)
+{
+    engine_backup *b = calloc(1, sizeof(engine_backup));
+    char **dsts = calloc(msg->cnt, sizeof(char *));
+    if (b == NULL || dsts == NULL)
+        ERR("calloc");
+
+    const char *p = msg->paths;
+    b->engine = e;
+    b->id = msg->backup;
+    b->stats_slot = msg->stats;
+    b->stats = stats_slot(msg->stats);
+    b->opts = msg->opts;
+    b->src = strdup(p);
+    p += strlen(p) + 1;
+    for (int i = 0; i < msg->cnt; i++, p += strlen(p) + 1)
+        dsts[i] = (char *)p;
+    if (b->src == NULL || (msg->opts.store && (b->store = strdup(p)) == NULL))
+        ERR("strdup");
+    b->opts.store = b->store;
+    pthread_mutex_init(&b->lock, NULL);
+    stats_use(b->stats);
+
+    b->fo = fanout_create(b->src, dsts, msg->cnt);
+    free(dsts);
+    b->fo->delta_min = (off_t)b->opts.delta_mib << 20;
+    b->fo->compress = b->opts.compress;
+    if (b->store && fanout_use_store(b->fo, b->store) != 0)
+    {
+        perror(b->store);
+        send_gone(e, b->id);
+        free_backup(b);
+        return;
+    }
+    if ((b->opts.pack && fanout_use_packs(b->fo) != 0) || (b->opts.journal && fanout_use_journal(b->fo) != 0))
+    {
+        perror(b->src);
+        send_gone(e, b->id);
+        free_backup(b);
+        return;
+    }
+
+    b->co = coalescer_create(b->fo, b->opts.debounce_ms);
+    coalesce_set_apply(b->co, enqueue_change, b);
+
+    if (b->opts.fanotify && (b->fan = fanotify_open(b->src)) == NULL)
+        fprintf(stderr, "%s: fanotify unavailable, using inotify\n", b->src);
+
+    /* a source some other backup already covers costs no new watch */
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = b};
+    int failed = b->fan ? epoll_ctl(e->epoll, EPOLL_CTL_ADD, b->fan->fd, &ev) < 0
+                        : (b->sub = registry_subscribe(e->registry, b->src, b->co, b)) == NULL;
+    if (failed)
+    {
+        perror(b->src);
+        if (b->fan)
+            fanotify_close(b->fan);
+        coalescer_destroy(b->co);
+        send_gone(e, b->id);
+        free_backup(b);
+        return;
+    }
+    b->next = e->open;
+    e->open = b;
+
+    pthread_mutex_lock(&e->lock);
+    if (e->copy_tail)
+        e->copy_tail->copy_next = b;
+    else
+        e->copy_head = b;
+    e->copy_tail = b;
+    pthread_cond_signal(&e->cond);
+    pthread_mutex_unlock(&e->lock);
+}
+
+static void end_backup(engine *e, engine_msg *msg)
+{
+    engine_backup *b = e->open;
+    while (b && b->id != msg->backup)
+        b = b->next;
+    if (b == NULL)
+        return;
+
+    if (msg->slot >= 0 && msg->slot < b->fo->cnt)
+        b->fo->targets[msg->slot].detached = 1;
+    if (msg->slot < 0 || !fanout_active(b->fo))
+        close_backup(e, b, 0);
+}
+
+/* returns: ms until the first pending change of any backup is due, -1 if none is */
+static int next_timeout(engine *e)
+{
+    int timeout = -1;
+    for (engine_backup *b = e->open; b; b = b->next)
+    {
+        int t = coalesce_timeout(b->co);
+        if (t >= 0 && (timeout < 0 || t < timeout))
+            timeout = t;
+    }
+    return timeout;
+}
+
+/* a shell with many descriptors per backup runs out of the default soft limit early */
+static void raise_fd_limit(void)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static void source_gone(void *owner)
+{
+    engine_backup *b = owner;
+    b->gone = 1;
+}
+
+/* close the backups whose source the last registry dispatch saw disappear */
+static void close_gone(engine *e)
+{
+    engine_backup *b = e->open;
+    while (b)
+    {
+        engine_backup *next = b->next;
+        if (b->gone)
+            close_backup(e, b, 1);
+        b = next;
+    }
+}
+
+static void epoll_watch(engine *e, int fd, void *tag)
+{
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = tag};
+    if (epoll_ctl(e->epoll, EPOLL_CTL_ADD, fd, &ev) < 0)
+        ERR("epoll_ctl");
+}
+
+/* one event loop multiplexing the watches of every backup, changes are applied
+ * by a shared pool and SIGTERM or a closed shell ends the process
+ */
+static void engine_main(int channel)
+{
+    sigset_t mask;
+    struct epoll_event events[ENGINE_EVENTS];
+    pthread_t copiers[ENGINE_COPIERS];
+
+    engine *e = calloc(1, sizeof(engine));
+    char *buf = malloc(ENGINE_MSG_MAX);
+    if (e == NULL || buf == NULL)
+        ERR("calloc");
+
+    /* threads created below inherit the mask, only the signalfd sees SIGTERM */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    raise_fd_limit();
+    e->channel = channel;
+    e->signal = signalfd(-1, &mask, SFD_CLOEXEC);
+    e->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    e->epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (e->signal < 0 || e->wake < 0 || e->epoll < 0)
+        ERR("engine");
+    epoll_watch(e, e->channel, &e->channel);
+    epoll_watch(e, e->signal, &e->signal);
+    epoll_watch(e, e->wake, &e->wake);
+    if ((e->registry = registry_create()) == NULL)
+        ERR("inotify_init");
+    epoll_watch(e, e->registry->fd, &e->registry);
+
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->cond, NULL);
+    e->pool = pool_create(pool_default_threads(), 0);
+    for (int i = 0; i < ENGINE_COPIERS; i++)
+    {
+        if (pthread_create(&copiers[i], NULL, copier_work, e) != 0)
+            ERR("pthread_create");
+    }
+
+    for (;;)
+    {
+        int reap = 0;
+        int cnt = epoll_wait(e->epoll, events, ENGINE_EVENTS, next_timeout(e));
+        if (cnt < 0 && errno != EINTR)
+            ERR("epoll_wait");
+
+        for (int i = 0; i < cnt; i++)
+        {
+            void *tag = events[i].data.ptr;
+            if (tag == &e->signal)
+            {
+                /* like a killed worker process, pending changes are dropped */
+                _exit(EXIT_SUCCESS);
+            }
+            else if (tag == &e->channel)
+            {
+                ssize_t len = recv(e->channel, buf, ENGINE_MSG_MAX, 0);
+                if (len == 0 || (len < 0 && errno != EINTR))
+                    _exit(EXIT_SUCCESS);
+
+                engine_msg *msg = (engine_msg *)buf;
+                if (len < (ssize_t)sizeof(engine_msg))
+                    continue;
+                buf[len - 1] = '\0';
+                if (msg->type == ENGINE_ADD)
+                    open_backup(e, msg);
+                else if (msg->type == ENGINE_END)
+                    end_backup(e, msg);
+            }
+            else if (tag == &e->wake)
+            {
+                reap = 1;
+            }
+            else if (tag == &e->registry)
+            {
+                registry_dispatch(e->registry, source_gone);
+                close_gone(e);
+            }
+            else
+            {
+                /* closed by an earlier event of this batch, it stays allocated until the reap below */
+                engine_backup *b = tag;
+                if (b->closing)
+                    continue;
+                stats_use(b->stats);
+                if (fanotify_dispatch(b->fan, b->src, b->co))
+                    close_backup(e, b, 1);
+            }
+        }
+
+        /* changes whose quiet window closed, or that a rescan found, go to the drain tasks */
+        for (engine_backup *b = e->open; b; b = b->next)
+        {
+            if (coalesce_idle(b->co))
+                continue;
+            stats_use(b->stats);
+            coalesce_rescan(b->co);
+            coalesce_flush(b->co, 0);
+        }
+        stats_use(NULL);
+
+        /* a backup is idle once none of its changes waits in the coalescer, a rescan, the job queue or a writer */
+        for (engine_backup *b = e->open; b; b = b->next)
+        {
+            if (b->fo->journal == NULL)
+                continue;
+            pthread_mutex_lock(&b->lock);
+            int idle = b->ready && !b->running && b->head == NULL;
+            pthread_mutex_unlock(&b->lock);
+            journal_tick(b->fo->journal, idle && coalesce_idle(b->co) && fanout_idle(b->fo));
+        }
+
+        if (reap)
+            reap_backups(e);
+    }
+}
+
+/* fork the engine process the first time a backup asks for it */
+static void engine_start(void)
+{
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+        ERR("socketpair");
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        ERR("fork");
+    }
+    else if (pid == 0)
+    {
+        close(sv[0]);
+        engine_main(sv[1]);
+        exit(EXIT_SUCCESS);
+    }
+
+    close(sv[1]);
+    engine_fd = sv[0];
+    engine_pid = pid;
+}
+
+static int append_path(engine_msg *msg, size_t *len, const char *path)
+{
+    size_t path_len = strlen(path) + 1;
+    if (sizeof(engine_msg) + *len + path_len > ENGINE_MSG_MAX)
+        return -1;
+    memcpy(msg->paths + *len, path, path_len);
+    *len += path_len;
+    return 0;
+}
+
+/* hand a backup of src to cnt targets to the engine process and list its targets */
+void engine_add(char *src, char **dsts, int cnt, const backup_opts *opts, workerList *workers)
+{
+    size_t len = 0;
+    engine_msg *msg = calloc(1, ENGINE_MSG_MAX);
+    if (msg == NULL)
+        ERR("calloc");
+
+    int failed = append_path(msg, &len, src);
+    for (int i = 0; i < cnt; i++)
+        failed |= append_path(msg, &len, dsts[i]);
+    if (opts->store)
+        failed |= append_path(msg, &len, opts->store);
+    if (failed)
+    {
+        printf("invalid arguments.\n");
+        free(msg);
+        return;
+    }
+
+    if (engine_pid == 0)
+        engine_start();
+
+    msg->type = ENGINE_ADD;
+    msg->backup = next_backup++;
+    msg->slot = -1;
+    msg->stats = stats_claim();
+    msg->cnt = cnt;
+    msg->opts = *opts;
+    stats_set_pid(msg->stats, engine_pid);
+
+    if (send(engine_fd, msg, sizeof(engine_msg) + len, MSG_NOSIGNAL) < 0)
+    {
+        perror("engine");
+        stats_release(msg->stats);
+        free(msg);
+        return;
+    }
+
+    for (int i = 0; i < cnt; i++)
+        add_worker(src, dsts[i], engine_pid, i, msg->stats, msg->backup, workers);
+    free(msg);
+}
+
+/* stop one target of a backup in the engine, or the whole backup for slot -1 */
+void engine_end(int backup, int slot)
+{
+    engine_msg msg = {.type = ENGINE_END, .backup = backup, .slot = slot};
+
+    if (engine_fd >= 0)
+        send(engine_fd, &msg, sizeof(msg), MSG_NOSIGNAL);
+}
+
+/* forget backups the engine gave up on, e.g. because their source was deleted */
+void engine_collect(workerList *workers)
+{
+    engine_msg msg;
+
+    while (engine_fd >= 0 && recv(engine_fd, &msg, sizeof(msg), MSG_DONTWAIT) == (ssize_t)sizeof(msg))
+    {
+        if (msg.type == ENGINE_GONE)
+            delete_workers_by_backup(msg.backup, workers);
+    }
+}
+
+/* the next engine backup starts a new engine once the old one was reaped */
+void engine_reaped(pid_t pid)
+{
+    if (engine_pid == 0 || pid != engine_pid)
+        return;
+
+    close(engine_fd);
+    engine_fd = -1;
+    engine_pid = 0;
+}
@@ -0,0 +1,17 @@
+#ifndef EN_H
+#define EN_H
+
+#include <sys/types.h>
+
+#include "opts.h"
+#include "worker.h"
+
+void engine_add(char *, char **, int, const backup_opts *, workerList *);
+
+void engine_end(int, int);
+
+void engine_collect(workerList *);
+
+void engine_reaped(pid_t);
+
+#endif
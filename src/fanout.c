@@ -0,0 +1,1087 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "copyeng.h"
+#include "fanout.h"
+#include "fileproc.h"
+#include "iopolicy.h"
+#include "stats.h"
+#include "utils.h"
+#include "walk.h"
+
+#define FAN_CHUNK (1 << 20)
+/* data queued for one target, chunks and whole files it still has to copy, before it is left to
+ * finish the file from the source itself
+ */
+#define FAN_LAG_MAX ((size_t)64 * FAN_CHUNK)
+/* operations queued for one target before it drops new paths and rescans the source instead */
+#define FAN_QUEUE_MAX 1024
+
+typedef struct FanChunk
+{
+    atomic_int refs;
+    size_t len;
+    char data[];
+} fan_chunk;
+
+/* one source file being streamed into one target */
+typedef struct FanFile
+{
+    int fd;
+    char *src;
+    char *dst;
+    off_t written;
+    int compress; /* chunks arrive as compressed blocks */
+    struct stat st;
+} fan_file;
+
+/* the ops before OP_OPEN each bring one path up to date, a target that falls behind drops them */
+typedef enum FanOpType
+{
+    OP_MKDIR,
+    OP_REMOVE,
+    OP_COPY,
+    OP_DELTA,
+    OP_RECIPE,
+    OP_COMPRESS,
+    OP_PACK,
+    OP_RENAME,
+    OP_OPEN,
+    OP_DATA,
+    OP_CATCHUP,
+    OP_CLOSE,
+    OP_RESCAN,
+    OP_STOP
+} fan_op_type;
+
+typedef struct FanOp
+{
+    fan_op_type type;
+    char *src;
+    char *dst;
+    char *from; /* where OP_RENAME finds the entry on the target */
+    fan_file *file;
+    fan_chunk *chunk;
+    off_t offset;
+    struct stat st;
+    long long queued_ms;
+    struct FanOp *next;
+} fan_op;
+
+static fanout *detach_fanout = NULL;
+
+void target_path(char *buf, size_t size, const char *base, const char *rel)
+{
+    if (rel[0] == '\0')
+        snprintf(buf, size, "%s", base);
+    else
+        snprintf(buf, size, "%s/%s", base, rel);
+}
+
+static void chunk_release(fan_chunk *chunk)
+{
+    if (atomic_fetch_sub(&chunk->refs, 1) == 1)
+        free(chunk);
+}
+
+static fan_op *new_op(fan_op_type type, const char *src, const char *dst)
+{
+    fan_op *op = calloc(1, sizeof(fan_op));
+    if (op == NULL)
+        ERR("calloc");
+
+    op->type = type;
+    if (src && (op->src = strdup(src)) == NULL)
+        ERR("strdup");
+    if (dst && (op->dst = strdup(dst)) == NULL)
+        ERR("strdup");
+    return op;
+}
+
+/* a copy the writer makes from the source counts like the data it will write */
+static fan_op *new_copy_op(fan_op_type type, const char *src, const char *dst, const struct stat *st)
+{
+    fan_op *op = new_op(type, src, dst);
+    op->st = *st;
+    return op;
+}
+
+/* returns: bytes op adds to the lag of its target */
+static size_t op_bytes(const fan_op *op)
+{
+    if (op->chunk)
+        return op->chunk->len;
+    if (op->type == OP_COPY || op->type == OP_DELTA || op->type == OP_COMPRESS)
+        return op->st.st_size;
+    return 0;
+}
+
+static void free_op(fan_op *op)
+{
+    if (op->chunk)
+        chunk_release(op->chunk);
+
+    if (op->type == OP_CLOSE)
+    {
+        if (op->file->fd >= 0)
+            TEMP_FAILURE_RETRY(close(op->file->fd));
+        free(op->file->src);
+        free(op->file->dst);
+        free(op->file);
+    }
+
+    free(op->src);
+    free(op->dst);
+    free(op->from);
+    free(op);
+}
+
+/* finish a stream from offset by reading the rest of the source directly */
+static void catch_up(fan_file *file, off_t offset)
+{
+    copy_method method;
+    struct stat st;
+
+    int src_fd = TEMP_FAILURE_RETRY(open(file->src, O_RDONLY));
+    if (src_fd < 0 || fstat(src_fd, &st) < 0 || lseek(src_fd, offset, SEEK_SET) < 0)
+    {
+        perror("catch up");
+        if (src_fd >= 0)
+            TEMP_FAILURE_RETRY(close(src_fd));
+        return;
+    }
+
+    /* chunks are cut at block boundaries, so the rest compresses into blocks of its own */
+    if (file->compress)
+    {
+        if (compress_stream(src_fd, file->fd, &file->written) < 0)
+            perror("compress_stream");
+    }
+    else
+    {
+        if (copy_data(src_fd, file->fd, st.st_size > offset ? st.st_size - offset : 0, &method) < 0)
+            perror("copy_data");
+        file->written = st.st_size;
+    }
+    TEMP_FAILURE_RETRY(close(src_fd));
+}
+
+/* returns: path of dst relative to the target root, as the packs name it */
+static const char *pack_rel(fanout_target *t, const char *dst)
+{
+    const char *rel = dst + strlen(t->base);
+    return *rel == '/' ? rel + 1 : rel;
+}
+
+/* a packed file is superseded by whatever else op puts at its path */
+static void drop_packed(fanout_target *t, fan_op *op)
+{
+    const char *dst = op->file ? op->file->dst : op->dst;
+
+    if (op->type == OP_PACK || op->type == OP_DATA || op->type == OP_CATCHUP || op->type == OP_CLOSE ||
+        op->type == OP_STOP || dst == NULL)
+        return;
+    pack_drop(t->pack, pack_rel(t, dst), op->type == OP_REMOVE);
+}
+
+/* append a small file to the packs, moving aside whatever sits at its path in the tree */
+static void pack_file(fanout_target *t, fan_op *op)
+{
+    struct stat st;
+
+    if (lstat(op->dst, &st) == 0)
+    {
+        if (S_ISDIR(st.st_mode))
+            pack_drop(t->pack, pack_rel(t, op->dst), 1);
+        remove_target_entry(op->dst);
+    }
+
+    if (pack_put(t->pack, pack_rel(t, op->dst), op->chunk->data, op->chunk->len, &op->st) == 0)
+        copy_stats_record(op->dst, COPY_PACK, op->chunk->len);
+    else
+        perror("pack_put");
+}
+
+/* a renamed tree the target lacks, copied entry by entry */
+typedef struct MissingTree
+{
+    fanout_target *t;
+    const char *dst;
+} missing_tree;
+
+static int copy_missing_entry(const walk_entry *entry, void *arg)
+{
+    missing_tree *mt = arg;
+    char dst[PATH_MAX];
+
+    target_path(dst, sizeof(dst), mt->dst, entry->path + entry->root_len + 1);
+    if (entry->type == DT_DIR)
+        create_directories(dst);
+    else
+        copy_single_file(entry->path, dst, mt->t->owner->src_base, mt->t->base);
+    return WALK_CONTINUE;
+}
+
+/* move the replica of a renamed source entry, one the target never got is copied from the source */
+static void rename_entry(fanout_target *t, fan_op *op)
+{
+    struct stat st;
+
+    delta_forget(t->delta, op->from);
+    delta_forget(t->delta, op->dst);
+    create_parent_directories(op->dst);
+    if (lstat(op->from, &st) == 0)
+    {
+        if (rename(op->from, op->dst) == 0)
+            return;
+        /* whatever the entry replaced in the source goes on the target too */
+        if ((errno == ENOTEMPTY || errno == EEXIST || errno == EISDIR || errno == ENOTDIR) &&
+            remove_target_entry(op->dst) == 0 && rename(op->from, op->dst) == 0)
+            return;
+        perror("rename");
+        return;
+    }
+
+    if (lstat(op->src, &st) != 0)
+        return;
+    if (!S_ISDIR(st.st_mode))
+    {
+        copy_single_file(op->src, op->dst, t->owner->src_base, t->base);
+        return;
+    }
+    missing_tree mt = {t, op->dst};
+    clear_target_entry(op->dst, 1);
+    create_directories(op->dst);
+    walk_tree(op->src, 0, copy_missing_entry, &mt);
+}
+
+static void run_op(fanout_target *t, fan_op *op)
+{
+    fan_file *file = op->file;
+    off_t written;
+
+    if (t->pack)
+        drop_packed(t, op);
+
+    switch (op->type)
+    {
+        case OP_MKDIR:
+            delta_forget(t->delta, op->dst);
+            clear_target_entry(op->dst, 1);
+            create_directories(op->dst);
+            break;
+        case OP_REMOVE:
+            delta_forget(t->delta, op->dst);
+            remove_target_entry(op->dst);
+            break;
+        case OP_COPY:
+            create_parent_directories(op->dst);
+            copy_single_file(op->src, op->dst, t->owner->src_base, t->base);
+            break;
+        case OP_DELTA:
+            if (delta_copy(t->delta, op->src, op->dst, &written) == 0)
+            {
+                copy_stats_record(op->dst, COPY_DELTA, written);
+                break;
+            }
+            /* no usable replica yet, its sums are taken on the next change */
+            create_parent_directories(op->dst);
+            copy_single_file(op->src, op->dst, t->owner->src_base, t->base);
+            break;
+        case OP_RECIPE:
+            create_parent_directories(op->dst);
+            if (dedup_write_recipe(op->dst, op->chunk->data, op->chunk->len, &op->st) != 0)
+                perror("write recipe");
+            break;
+        case OP_COMPRESS:
+            create_parent_directories(op->dst);
+            if (compress_file(op->src, op->dst, &written) == 0)
+                copy_stats_record(op->dst, COPY_COMPRESS, written);
+            else
+                perror("compress_file");
+            break;
+        case OP_PACK:
+            pack_file(t, op);
+            break;
+        case OP_RENAME:
+            rename_entry(t, op);
+            break;
+        case OP_OPEN:
+            delta_forget(t->delta, file->dst);
+            create_parent_directories(file->dst);
+            clear_target_entry(file->dst, 0);
+            file->fd = TEMP_FAILURE_RETRY(open(file->dst, O_WRONLY | O_CREAT | O_TRUNC, 0777));
+            if (file->fd < 0)
+            {
+                perror("open dest");
+            }
+            else if (file->compress)
+            {
+                char header[COMPRESS_HDR];
+                size_t len = compress_header(header, file->st.st_size);
+                if (bulk_write(file->fd, header, len) != (ssize_t)len)
+                    perror("bulk_write");
+                file->written = len;
+            }
+            else
+            {
+                io_prepare(-1, file->fd, &file->st);
+            }
+            break;
+        case OP_DATA:
+            if (file->fd < 0)
+                break;
+            if (bulk_write(file->fd, op->chunk->data, op->chunk->len) != (ssize_t)op->chunk->len)
+            {
+                perror("bulk_write");
+                TEMP_FAILURE_RETRY(close(file->fd));
+                file->fd = -1;
+                break;
+            }
+            file->written += op->chunk->len;
+            break;
+        case OP_CATCHUP:
+            if (file->fd >= 0)
+                catch_up(file, op->offset);
+            break;
+        case OP_CLOSE:
+            if (file->fd >= 0 && file->compress)
+            {
+                if (compress_finish(file->fd) == 0)
+                    file->written += COMPRESS_BLOCK_HDR;
+                else
+                    perror("compress_finish");
+            }
+            if (file->fd >= 0)
+            {
+                copy_stats_record(file->dst, file->compress ? COPY_COMPRESS : COPY_FANOUT, file->written);
+                copy_times(file->fd, &file->st);
+                io_release(-1, file->fd, file->written);
+            }
+            break;
+        case OP_RESCAN:
+        case OP_STOP:
+            break;
+    }
+}
+
+/* returns: 1 if the target entry dst of t already holds src, plain, compressed or packed */
+static int target_current(fanout *fo, fanout_target *t, const char *src, const struct stat *st, const char *dst)
+{
+    if (t->pack && S_ISREG(st->st_mode) && pack_current(t->pack, pack_rel(t, dst), st))
+        return 1;
+    if (entry_unchanged(src, st, dst, fo->src_base, t->base, fo->verify))
+        return 1;
+    return fo->compress && S_ISREG(st->st_mode) && compress_current(dst, st);
+}
+
+/* walk callback over the source for a target that dropped paths, its writer copies what differs itself */
+static int rescan_entry(const walk_entry *entry, void *arg)
+{
+    fanout_target *t = arg;
+    fanout *fo = t->owner;
+    char dst[PATH_MAX];
+    struct stat st;
+    fan_op *op;
+
+    if (t->detached)
+        return -1;
+    if (walk_stat(entry->dir_fd, entry->name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+        return WALK_CONTINUE;
+
+    target_path(dst, sizeof(dst), t->base, entry->path + entry->root_len + 1);
+    if (fo->store != NULL && S_ISREG(st.st_mode))
+    {
+        char *recipe;
+        size_t len;
+        off_t stored;
+
+        if (dedup_recipe_current(dst, &st) || dedup_chunk_file(fo->store, entry->path, &recipe, &len, &stored) != 0)
+            return WALK_CONTINUE;
+        copy_stats_record(entry->path, COPY_DEDUP, stored);
+        create_parent_directories(dst);
+        if (dedup_write_recipe(dst, recipe, len, &st) != 0)
+            perror("write recipe");
+        free(recipe);
+        return WALK_CONTINUE;
+    }
+    if (target_current(fo, t, entry->path, &st, dst))
+        return WALK_CONTINUE;
+
+    if (S_ISDIR(st.st_mode))
+    {
+        op = new_op(OP_MKDIR, NULL, dst);
+    }
+    else if (t->pack && S_ISREG(st.st_mode) && st.st_size <= PACK_FILE_MAX && !is_sparse(&st))
+    {
+        op = new_copy_op(OP_PACK, NULL, dst, &st);
+        if ((op->chunk = malloc(sizeof(fan_chunk) + PACK_FILE_MAX)) == NULL)
+            ERR("malloc");
+        atomic_init(&op->chunk->refs, 1);
+
+        int src_fd = TEMP_FAILURE_RETRY(open(entry->path, O_RDONLY));
+        ssize_t len = src_fd < 0 ? -1 : bulk_read(src_fd, op->chunk->data, PACK_FILE_MAX);
+        if (src_fd >= 0)
+            TEMP_FAILURE_RETRY(close(src_fd));
+        if (len < 0)
+        {
+            free_op(op);
+            return WALK_CONTINUE;
+        }
+        op->chunk->len = len;
+    }
+    else if (fo->compress && compress_worthwhile(entry->path, &st))
+    {
+        op = new_copy_op(OP_COMPRESS, entry->path, dst, &st);
+    }
+    else
+    {
+        int delta = fo->delta_min > 0 && S_ISREG(st.st_mode) && st.st_size >= fo->delta_min;
+        op = new_copy_op(delta ? OP_DELTA : OP_COPY, entry->path, dst, &st);
+    }
+
+    run_op(t, op);
+    free_op(op);
+    return WALK_CONTINUE;
+}
+
+/* bring a target that fell behind up to date with the source, paths dropped
+ * from now on get a rescan of their own
+ */
+static void rescan_target(fanout_target *t)
+{
+    pthread_mutex_lock(&t->lock);
+    t->behind = 0;
+    pthread_mutex_unlock(&t->lock);
+
+    prune_target(t->base, t->owner->src_base);
+    if (t->pack)
+        pack_prune(t->pack, t->owner->src_base);
+    walk_tree(t->owner->src_base, 0, rescan_entry, t);
+}
+
+/* publish the operations queued on or run by every writer, no target lock held */
+static void publish_writes(fanout *fo)
+{
+    long queued = 0;
+    long long oldest = 0;
+
+    pthread_mutex_lock(&fo->stats_lock);
+    for (int i = 0; i < fo->cnt; i++)
+    {
+        fanout_target *t = &fo->targets[i];
+        pthread_mutex_lock(&t->lock);
+        long long first = t->busy ? t->running_ms : t->head ? t->head->queued_ms : 0;
+        queued += t->pending_ops;
+        pthread_mutex_unlock(&t->lock);
+        if (first > 0 && (oldest == 0 || first < oldest))
+            oldest = first;
+    }
+    stats_queue(QUEUE_WRITERS, queued, oldest);
+    pthread_mutex_unlock(&fo->stats_lock);
+}
+
+static void *writer_work(void *arg)
+{
+    fanout_target *t = arg;
+
+    stats_use(t->owner->stats);
+
+    for (;;)
+    {
+        pthread_mutex_lock(&t->lock);
+        while (t->head == NULL)
+            pthread_cond_wait(&t->cond, &t->lock);
+
+        fan_op *op = t->head;
+        t->head = op->next;
+        if (t->head == NULL)
+            t->tail = NULL;
+        t->busy = 1;
+        t->running_ms = op->queued_ms;
+        pthread_mutex_unlock(&t->lock);
+
+        if (op->type == OP_STOP)
+        {
+            free_op(op);
+            break;
+        }
+
+        /* a detached target only releases what is still queued for it */
+        if (!t->detached && op->type == OP_RESCAN)
+            rescan_target(t);
+        else if (!t->detached)
+            run_op(t, op);
+
+        pthread_mutex_lock(&t->lock);
+        t->pending_bytes -= op_bytes(op);
+        t->pending_ops--;
+        t->busy = 0;
+        pthread_cond_broadcast(&t->cond);
+        pthread_mutex_unlock(&t->lock);
+
+        free_op(op);
+        publish_writes(t->owner);
+    }
+
+    return NULL;
+}
+
+static void submit(fanout *fo, fanout_target *t, fan_op *op)
+{
+    if (!fo->threaded)
+    {
+        run_op(t, op);
+        free_op(op);
+        return;
+    }
+
+    pthread_mutex_lock(&t->lock);
+    /* a slow target doesn't hold up the others, the rescan queued with the first path it drops covers them all */
+    if (op->type < OP_OPEN && (t->behind || t->pending_ops >= FAN_QUEUE_MAX))
+    {
+        free_op(op);
+        if (t->behind)
+        {
+            pthread_mutex_unlock(&t->lock);
+            return;
+        }
+        t->behind = 1;
+        op = new_op(OP_RESCAN, NULL, NULL);
+    }
+    fan_op_type type = op->type;
+    op->queued_ms = stats_now_ms();
+    t->pending_bytes += op_bytes(op);
+    t->pending_ops++;
+    if (t->tail)
+        t->tail->next = op;
+    else
+        t->head = op;
+    t->tail = op;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+
+    /* nothing reads the queues once fanout_destroy() stops the writers */
+    if (type != OP_STOP)
+        publish_writes(fo);
+}
+
+/* returns: bytes queued for t, FAN_LAG_MAX once it waits for a rescan that will copy the file anyway */
+static size_t pending_bytes(fanout_target *t)
+{
+    pthread_mutex_lock(&t->lock);
+    size_t pending = t->behind ? FAN_LAG_MAX : t->pending_bytes;
+    pthread_mutex_unlock(&t->lock);
+    return pending;
+}
+
+/* targets get their own writer thread only when there is more than one of them */
+fanout *fanout_create(const char *src, char **dsts, int cnt)
+{
+    fanout *fo = calloc(1, sizeof(fanout));
+    if (fo == NULL)
+        ERR("calloc");
+
+    fo->src_base = strdup(src);
+    fo->cnt = cnt;
+    fo->threaded = cnt > 1;
+    fo->stats = stats_current();
+    pthread_mutex_init(&fo->stats_lock, NULL);
+    fo->targets = calloc(cnt, sizeof(fanout_target));
+    if (fo->src_base == NULL || fo->targets == NULL)
+        ERR("calloc");
+
+    for (int i = 0; i < cnt; i++)
+    {
+        fanout_target *t = &fo->targets[i];
+        t->owner = fo;
+        t->delta = delta_table_create();
+        t->base = strdup(dsts[i]);
+        if (t->base == NULL)
+            ERR("strdup");
+
+        if (fo->threaded)
+        {
+            pthread_mutex_init(&t->lock, NULL);
+            pthread_cond_init(&t->cond, NULL);
+            if (pthread_create(&t->thread, NULL, writer_work, t) != 0)
+                ERR("pthread_create");
+        }
+    }
+
+    return fo;
+}
+
+/* wait until every writer has drained its queue */
+void fanout_flush(fanout *fo)
+{
+    if (!fo->threaded)
+        return;
+
+    for (int i = 0; i < fo->cnt; i++)
+    {
+        fanout_target *t = &fo->targets[i];
+        pthread_mutex_lock(&t->lock);
+        while (t->head != NULL || t->busy)
+            pthread_cond_wait(&t->cond, &t->lock);
+        pthread_mutex_unlock(&t->lock);
+    }
+}
+
+void fanout_destroy(fanout *fo)
+{
+    if (detach_fanout == fo)
+        detach_fanout = NULL;
+
+    /* every writer is gone before any target lock goes, they publish the queues of all of them */
+    for (int i = 0; fo->threaded && i < fo->cnt; i++)
+        submit(fo, &fo->targets[i], new_op(OP_STOP, NULL, NULL));
+    for (int i = 0; fo->threaded && i < fo->cnt; i++)
+        pthread_join(fo->targets[i].thread, NULL);
+
+    for (int i = 0; i < fo->cnt; i++)
+    {
+        fanout_target *t = &fo->targets[i];
+        if (fo->threaded)
+        {
+            pthread_mutex_destroy(&t->lock);
+            pthread_cond_destroy(&t->cond);
+        }
+        delta_table_destroy(t->delta);
+        if (t->pack)
+            pack_close(t->pack);
+        free(t->base);
+    }
+
+    if (fo->journal)
+        journal_close(fo->journal);
+    for (size_t i = 0; i < fo->missed_cnt; i++)
+        free(fo->missed[i]);
+    free(fo->missed);
+    free(fo->targets);
+    free(fo->src_base);
+    pthread_mutex_destroy(&fo->stats_lock);
+    free(fo);
+}
+
+/* keep the small files of every target in packs below it
+ * returns: 0 on success, -1 if the packs of a target can't be opened
+ */
+int fanout_use_packs(fanout *fo)
+{
+    for (int i = 0; i < fo->cnt; i++)
+    {
+        if ((fo->targets[i].pack = pack_open(fo->targets[i].base, 1)) == NULL)
+            return -1;
+    }
+    fo->packed = 1;
+    return 0;
+}
+
+/* write the regular files of fo as recipes of chunks kept in the store at path,
+ * the store notes every target so its collection finds their recipes
+ * returns: 0 on success, -1 if the store can't be opened or written
+ */
+int fanout_use_store(fanout *fo, const char *path)
+{
+    if ((fo->store = dedup_open(path)) == NULL)
+        return -1;
+    for (int i = 0; i < fo->cnt; i++)
+    {
+        if (dedup_add_target(fo->store, fo->targets[i].base) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* journal the changes of fo in every target
+ * returns: 0 on success, -1 if a target can't hold a journal
+ */
+int fanout_use_journal(fanout *fo)
+{
+    char **bases = malloc(fo->cnt * sizeof(char *));
+    if (bases == NULL)
+        ERR("malloc");
+    for (int i = 0; i < fo->cnt; i++)
+        bases[i] = fo->targets[i].base;
+
+    fo->journal = journal_open(fo->src_base, bases, fo->cnt);
+    free(bases);
+    return fo->journal ? 0 : -1;
+}
+
+/* sigqueue(SIGUSR1) from the shell carries the slot of the target to drop */
+static void detach_handler(int sig, siginfo_t *info, void *ctx)
+{
+    fanout *fo = detach_fanout;
+    int slot = info->si_value.sival_int;
+
+    if (fo != NULL && slot >= 0 && slot < fo->cnt)
+        fo->targets[slot].detached = 1;
+}
+
+void fanout_install_detach(fanout *fo)
+{
+    sigset_t mask;
+
+    detach_fanout = fo;
+    setInfoHandler(detach_handler, SIGUSR1);
+
+    /* writer threads keep SIGUSR1 blocked, only the caller takes it */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+}
+
+/* returns: number of targets still attached */
+int fanout_active(fanout *fo)
+{
+    int active = 0;
+    for (int i = 0; i < fo->cnt; i++)
+    {
+        if (!fo->targets[i].detached)
+            active++;
+    }
+    return active;
+}
+
+/* returns: 1 if no writer has an operation queued or running */
+int fanout_idle(fanout *fo)
+{
+    if (!fo->threaded)
+        return 1;
+
+    for (int i = 0; i < fo->cnt; i++)
+    {
+        fanout_target *t = &fo->targets[i];
+        pthread_mutex_lock(&t->lock);
+        int idle = t->head == NULL && !t->busy;
+        pthread_mutex_unlock(&t->lock);
+        if (!idle)
+            return 0;
+    }
+    return 1;
+}
+
+void fanout_mkdir(fanout *fo, const char *rel)
+{
+    char dst[PATH_MAX];
+
+    for (int i = 0; i < fo->cnt; i++)
+    {
+        if (fo->targets[i].detached)
+            continue;
+        target_path(dst, sizeof(dst), fo->targets[i].base, rel);
+        submit(fo, &fo->targets[i], new_op(OP_MKDIR, NULL, dst));
+    }
+}
+
+void fanout_remove(fanout *fo, const char *rel)
+{
+    char dst[PATH_MAX];
+
+    for (int i = 0; i < fo->cnt; i++)
+    {
+        if (fo->targets[i].detached)
+            continue;
+        target_path(dst, sizeof(dst), fo->targets[i].base, rel);
+        submit(fo, &fo->targets[i], new_op(OP_REMOVE, NULL, dst));
+    }
+}
+
+/* move the entry at from_rel to rel on every target, src is where the source has it now
+ * returns: 0 on success, -1 if the targets keep packs, which name each file by its path
+ */
+int fanout_rename(fanout *fo, const char *src, const char *from_rel, const char *rel)
+{
+    char dst[PATH_MAX];
+
+    if (fo->packed)
+        return -1;
+
+    for (int i = 0; i < fo->cnt; i++)
+    {
+        if (fo->targets[i].detached)
+            continue;
+        target_path(dst, sizeof(dst), fo->targets[i].base, rel);
+        fan_op *op = new_op(OP_RENAME, src, dst);
+        target_path(dst, sizeof(dst), fo->targets[i].base, from_rel);
+        if ((op->from = strdup(dst)) == NULL)
+            ERR("strdup");
+        submit(fo, &fo->targets[i], op);
+    }
+    return 0;
+}
+
+/* read a small file once and append it to the packs of every target
+ * returns: 0 on success, -1 if the source could not be read
+ */
+static int fanout_pack_file(fanout *fo, const char *src, const char *rel, const struct stat *st)
+{
+    char dst[PATH_MAX];
+
+    fan_chunk *chunk = malloc(sizeof(fan_chunk) + PACK_FILE_MAX);
+    if (chunk == NULL)
+        ERR("malloc");
+    atomic_init(&chunk->refs, 1);
+
+    int src_fd = TEMP_FAILURE_RETRY(open(src, O_RDONLY));
+    ssize_t len = src_fd < 0 ? -1 : bulk_read(src_fd, chunk->data, PACK_FILE_MAX);
+    if (src_fd >= 0)
+        TEMP_FAILURE_RETRY(close(src_fd));
+    if (len < 0)
+    {
+        free(chunk);
+        return -1;
+    }
+    chunk->len = len;
+
+    for (int i = 0; i < fo->cnt; i++)
+    {
+        fanout_target *t = &fo->targets[i];
+        if (t->detached)
+            continue;
+        target_path(dst, sizeof(dst), t->base, rel);
+        if (fo->skip_unchanged && target_current(fo, t, src, st, dst))
+            continue;
+
+        fan_op *op = new_op(OP_PACK, NULL, dst);
+        atomic_fetch_add(&chunk->refs, 1);
+        op->chunk = chunk;
+        op->st = *st;
+        submit(fo, t, op);
+    }
+
+    chunk_release(chunk);
+    return 0;
+}
+
+/* chunk src into the store once and give every target its recipe
+ * returns: 0 on success, -1 if the source could not be read or stored
+ */
+static int fanout_store_file(fanout *fo, const char *src, const char *rel, const struct stat *st)
+{
+    char dst[PATH_MAX];
+    char *recipe;
+    size_t len;
+    off_t stored;
+    int wanted = 0;
+
+    for (int i = 0; i < fo->cnt; i++)
+    {
+        if (fo->targets[i].detached)
+            continue;
+        target_path(dst, sizeof(dst), fo->targets[i].base, rel);
+        if (!fo->skip_unchanged || !dedup_recipe_current(dst, st))
+            wanted++;
+    }
+    if (wanted == 0)
+        return 0;
+
+    if (dedup_chunk_file(fo->store, src, &recipe, &len, &stored) != 0)
+        return -1;
+    copy_stats_record(src, COPY_DEDUP, stored);
+
+    fan_chunk *chunk = malloc(sizeof(fan_chunk) + len);
+    if (chunk == NULL)
+        ERR("malloc");
+    atomic_init(&chunk->refs, 1);
+    memcpy(chunk->data, recipe, len);
+    chunk->len = len;
+    free(recipe);
+
+    for (int i = 0; i < fo->cnt; i++)
+    {
+        if (fo->targets[i].detached)
+            continue;
+        target_path(dst, sizeof(dst), fo->targets[i].base, rel);
+        if (fo->skip_unchanged && dedup_recipe_current(dst, st))
+            continue;
+
+        fan_op *op = new_op(OP_RECIPE, NULL, dst);
+        atomic_fetch_add(&chunk->refs, 1);
+        op->chunk = chunk;
+        op->st = *st;
+        submit(fo, &fo->targets[i], op);
+    }
+
+    chunk_release(chunk);
+    return 0;
+}
+
+/* read src once and stream it to every target under rel, a target that falls
+ * FAN_LAG_MAX behind stops receiving chunks and copies the rest on its own
+ * returns: 0 on success, -1 if the source could not be read
+ */
+int fanout_copy_file(fanout *fo, const char *src, const char *rel)
+{
+    struct stat st;
+    char dst[PATH_MAX];
+
+    if (lstat(src, &st) == -1)
+        return -1;
+
+    if (S_ISDIR(st.st_mode))
+    {
+        fanout_mkdir(fo, rel);
+        return 0;
+    }
+
+    if (fo->store != NULL && S_ISREG(st.st_mode))
+        return fanout_store_file(fo, src, rel, &st);
+
+    /* one inode per small file costs the target more than its data */
+    if (fo->packed && S_ISREG(st.st_mode) && st.st_size <= PACK_FILE_MAX && !is_sparse(&st))
+        return fanout_pack_file(fo, src, rel, &st);
+
+    /* large files changed in place only get their changed blocks rewritten on each target */
+    fan_op_type type = OP_COPY;
+    if (fo->delta_min > 0 && S_ISREG(st.st_mode) && st.st_size >= fo->delta_min)
+        type = OP_DELTA;
+
+    /* the check samples the source, data that won't shrink is copied as it is */
+    int compress = fo->compress && compress_worthwhile(src, &st);
+    fan_op_type copy_type = compress ? OP_COMPRESS : OP_COPY;
+    if (compress)
+        type = OP_COMPRESS;
+
+    /* links, single targets and delta updates don't need streaming, sparse files
+     * are copied per target so the holes are skipped instead of streamed as zeros
+     */
+    if (!fo->threaded || !S_ISREG(st.st_mode) || type == OP_DELTA || is_sparse(&st))
+    {
+        for (int i = 0; i < fo->cnt; i++)
+        {
+            if (fo->targets[i].detached)
+                continue;
+            target_path(dst, sizeof(dst), fo->targets[i].base, rel);
+            if (fo->skip_unchanged && target_current(fo, &fo->targets[i], src, &st, dst))
+                continue;
+            submit(fo, &fo->targets[i], new_copy_op(type, src, dst, &st));
+        }
+        return 0;
+    }
+
+    int src_fd = TEMP_FAILURE_RETRY(open(src, O_RDONLY));
+    if (src_fd < 0)
+        return -1;
+    io_prepare(src_fd, -1, &st);
+
+    fan_file **files = calloc(fo->cnt, sizeof(fan_file *));
+    char *streaming = calloc(fo->cnt, sizeof(char));
+    if (files == NULL || streaming == NULL)
+        ERR("calloc");
+
+    int streams = 0;
+    for (int i = 0; i < fo->cnt; i++)
+    {
+        fanout_target *t = &fo->targets[i];
+        if (t->detached)
+            continue;
+
+        target_path(dst, sizeof(dst), t->base, rel);
+        if (fo->skip_unchanged && target_current(fo, t, src, &st, dst))
+            continue;
+
+        /* already far behind, let it copy the whole file itself */
+        if (pending_bytes(t) >= FAN_LAG_MAX)
+        {
+            submit(fo, t, new_copy_op(copy_type, src, dst, &st));
+            continue;
+        }
+
+        files[i] = calloc(1, sizeof(fan_file));
+        if (files[i] == NULL || (files[i]->src = strdup(src)) == NULL || (files[i]->dst = strdup(dst)) == NULL)
+            ERR("calloc");
+        files[i]->fd = -1;
+        files[i]->compress = compress;
+        files[i]->st = st;
+
+        fan_op *op = new_op(OP_OPEN, NULL, NULL);
+        op->file = files[i];
+        submit(fo, t, op);
+        streaming[i] = 1;
+        streams++;
+    }
+
+    /* each chunk is compressed once here, the calling copy thread pays for it and not the writers */
+    char *raw = compress ? malloc(FAN_CHUNK) : NULL;
+    if (compress && raw == NULL)
+        ERR("malloc");
+
+    off_t offset = 0;
+    while (streams > 0)
+    {
+        fan_chunk *chunk = malloc(sizeof(fan_chunk) + (compress ? COMPRESS_BOUND : FAN_CHUNK));
+        if (chunk == NULL)
+            ERR("malloc");
+        atomic_init(&chunk->refs, 1);
+
+        ssize_t len = bulk_read(src_fd, compress ? raw : chunk->data, FAN_CHUNK);
+        if (len < 0)
+            perror("bulk_read");
+        if (len <= 0)
+        {
+            free(chunk);
+            break;
+        }
+        chunk->len = compress ? compress_block(raw, len, chunk->data) : (size_t)len;
+
+        for (int i = 0; i < fo->cnt; i++)
+        {
+            if (!streaming[i])
+                continue;
+
+            fan_op *op = new_op(OP_DATA, NULL, NULL);
+            op->file = files[i];
+
+            if (pending_bytes(&fo->targets[i]) + chunk->len > FAN_LAG_MAX)
+            {
+                op->type = OP_CATCHUP;
+                op->offset = offset;
+                streaming[i] = 0;
+                streams--;
+            }
+            else
+            {
+                atomic_fetch_add(&chunk->refs, 1);
+                op->chunk = chunk;
+            }
+            submit(fo, &fo->targets[i], op);
+        }
+
+        chunk_release(chunk);
+        offset += len;
+        if (len < FAN_CHUNK)
+            break;
+    }
+
+    for (int i = 0; i < fo->cnt; i++)
+    {
+        if (files[i] == NULL)
+            continue;
+        fan_op *op = new_op(OP_CLOSE, NULL, NULL);
+        op->file = files[i];
+        submit(fo, &fo->targets[i], op);
+    }
+
+    free(raw);
+    free(files);
+    free(streaming);
+    io_release(src_fd, -1, offset);
+    TEMP_FAILURE_RETRY(close(src_fd));
+    return 0;
+}
@@ -0,0 +1,87 @@
+#ifndef FO_H
+#define FO_H
+
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "dedup.h"
+#include "delta.h"
+#include "journal.h"
+#include "pack.h"
+
+struct FanOp;
+
+struct WorkerStats;
+
+struct Fanout;
+
+typedef struct FanoutTarget
+{
+    struct Fanout *owner;
+    char *base;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct FanOp *head;
+    struct FanOp *tail;
+    size_t pending_bytes; /* data and whole-file copies queued, see FAN_LAG_MAX */
+    size_t pending_ops;
+    long long running_ms; /* when the op the writer is busy with was queued */
+    int behind; /* dropped paths past FAN_QUEUE_MAX, an OP_RESCAN is queued for them */
+    int busy;
+    delta_table *delta; /* block sums of large replica files, used by this target only */
+    pack_store *pack;   /* small files of this target, NULL when every file is written as it is */
+    volatile sig_atomic_t detached;
+} fanout_target;
+
+/* one source streamed to cnt targets, every source byte is read once */
+typedef struct Fanout
+{
+    char *src_base;
+    int cnt;
+    int threaded;
+    int skip_unchanged; /* leave targets alone where entry_unchanged() says so */
+    int verify;
+    off_t delta_min; /* regular files this large are rewritten block by block, 0 never */
+    dedup_store *store; /* targets hold recipes of chunks kept here instead of file data */
+    int compress;       /* regular files that look compressible are written in compress.h blocks */
+    int packed;         /* small regular files are appended to the packs of each target */
+    journal *journal;   /* changes noted for a resume after a crash, NULL without -J */
+    char **missed;      /* changes whose source was gone, a rename may have taken it; apply_change only */
+    size_t missed_cnt;
+    struct WorkerStats *stats; /* writer threads count their copies where the creator does */
+    pthread_mutex_t stats_lock; /* keeps the queue totals of the writers in order */
+    fanout_target *targets;
+} fanout;
+
+fanout *fanout_create(const char *, char **, int);
+
+void fanout_destroy(fanout *);
+
+int fanout_use_store(fanout *, const char *);
+
+int fanout_use_packs(fanout *);
+
+int fanout_use_journal(fanout *);
+
+void fanout_install_detach(fanout *);
+
+int fanout_active(fanout *);
+
+int fanout_idle(fanout *);
+
+void fanout_mkdir(fanout *, const char *);
+
+void fanout_remove(fanout *, const char *);
+
+int fanout_rename(fanout *, const char *, const char *, const char *);
+
+int fanout_copy_file(fanout *, const char *, const char *);
+
+void fanout_flush(fanout *);
+
+void target_path(char *, size_t, const char *, const char *);
+
+#endif
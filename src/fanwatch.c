@@ -0,0 +1,245 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "coalesce.h"
+#include "fanwatch.h"
+#include "stats.h"
+#include "synchro.h"
+#include "utils.h"
+#include "walk.h"
+
+#define FAN_BUF (256 * 1024)
+#define FAN_EVENT_MAX \
+    (sizeof(struct fanotify_event_metadata) + sizeof(struct fanotify_event_info_fid) + MAX_HANDLE_SZ + NAME_MAX + 1)
+#define FAN_EVENTS (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_CLOSE_WRITE | FAN_ONDIR)
+
+/* current absolute path of the directory behind a file handle
+ * returns: 0 on success, -1 if the directory is gone
+ */
+static int handle_path(int mount_fd, struct file_handle *fh, char *buf, size_t size)
+{
+    char proc_path[64];
+
+    int fd = open_by_handle_at(mount_fd, fh, O_PATH);
+    if (fd < 0)
+        return -1;
+
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+    ssize_t len = readlink(proc_path, buf, size - 1);
+    TEMP_FAILURE_RETRY(close(fd));
+    if (len < 0)
+        return -1;
+
+    buf[len] = '\0';
+    return 0;
+}
+
+/* a directory moved into the source, whose contents have no events of their own */
+typedef struct MovedTree
+{
+    coalescer *co;
+    const char *src_path; /* the directory as the backup names it */
+    const char *rel_path;
+} moved_tree;
+
+static int moved_entry(const walk_entry *entry, void *arg)
+{
+    moved_tree *mt = arg;
+    char src[PATH_MAX], rel[PATH_MAX];
+    const char *rest = entry->path + entry->root_len;
+
+    if (snprintf(src, sizeof(src), "%s%s", mt->src_path, rest) >= (int)sizeof(src) ||
+        snprintf(rel, sizeof(rel), "%s%s", mt->rel_path, rest) >= (int)sizeof(rel))
+        return WALK_SKIP;
+    coalesce_change(mt->co, entry->type == DT_DIR ? SYNC_MKDIR : SYNC_COPY, src, rel);
+    return WALK_CONTINUE;
+}
+
+/* translate one (directory handle, name) event into a change of the source tree
+ * returns: 1 if it removed the source itself, otherwise 0
+ */
+static int handle_event(struct fanotify_event_metadata *meta, int mount_fd, const char *root,
+                        const char *source_base_dir, coalescer *co)
+{
+    struct fanotify_event_info_fid *fid = (struct fanotify_event_info_fid *)(meta + 1);
+    char dir_path[PATH_MAX];
+    char full_path[PATH_MAX];
+    char full_src_path[PATH_MAX];
+    size_t root_len = strlen(root);
+    struct stat st;
+
+    if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+        return 0;
+
+    struct file_handle *fh = (struct file_handle *)fid->handle;
+    const char *name = (const char *)(fh->f_handle + fh->handle_bytes);
+
+    if (handle_path(mount_fd, fh, dir_path, sizeof(dir_path)) == -1)
+        return 0;
+
+    const char *sep = dir_path[strlen(dir_path) - 1] == '/' ? "" : "/";
+    if (snprintf(full_path, sizeof(full_path), "%s%s%s", dir_path, sep, name) >= (int)sizeof(full_path))
+        return 0;
+
+    /* the mark covers the whole filesystem, only the source tree matters */
+    if (strncmp(full_path, root, root_len) != 0 || (full_path[root_len] != '/' && full_path[root_len] != '\0'))
+        return 0;
+
+    int gone = lstat(full_path, &st) == -1;
+    if (full_path[root_len] == '\0')
+        return gone && (meta->mask & (FAN_DELETE | FAN_MOVED_FROM));
+
+    const char *rel_path = full_path + root_len + 1;
+    if (snprintf(full_src_path, sizeof(full_src_path), "%s/%s", source_base_dir, rel_path) >=
+        (int)sizeof(full_src_path))
+        return 0;
+
+    /* one record may merge several events, the current state decides */
+    if (gone && (meta->mask & (FAN_DELETE | FAN_MOVED_FROM)))
+    {
+        coalesce_change(co, SYNC_REMOVE, full_src_path, rel_path);
+    }
+    else if (meta->mask & FAN_ONDIR)
+    {
+        moved_tree mt = {co, full_src_path, rel_path};
+        if (meta->mask & (FAN_CREATE | FAN_MOVED_TO))
+            coalesce_change(co, SYNC_MKDIR, full_src_path, rel_path);
+        if (!gone && (meta->mask & FAN_MOVED_TO))
+            walk_tree(full_path, 0, moved_entry, &mt);
+    }
+    else if (meta->mask & (FAN_CLOSE_WRITE | FAN_MOVED_TO))
+    {
+        coalesce_change(co, SYNC_COPY, full_src_path, rel_path);
+    }
+
+    return 0;
+}
+
+/* open a filesystem-wide fanotify mark covering source_base_dir
+ * returns: the watch, NULL if fanotify can't be used
+ */
+fan_watch *fanotify_open(const char *source_base_dir)
+{
+    fan_watch *fw = calloc(1, sizeof(fan_watch));
+    if (fw == NULL)
+        ERR("calloc");
+
+    fw->fd = fw->mount_fd = -1;
+    fw->root = realpath(source_base_dir, NULL);
+    if (fw->root == NULL)
+    {
+        fanotify_close(fw);
+        return NULL;
+    }
+
+    fw->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC, O_RDONLY);
+    if (fw->fd < 0)
+    {
+        fanotify_close(fw);
+        return NULL;
+    }
+
+    fw->mount_fd = open(fw->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fw->mount_fd < 0 ||
+        fanotify_mark(fw->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FAN_EVENTS, AT_FDCWD, fw->root) < 0)
+    {
+        fanotify_close(fw);
+        return NULL;
+    }
+
+    fw->buffer = malloc(FAN_BUF);
+    if (fw->buffer == NULL)
+        ERR("malloc");
+    fw->calm = time(NULL);
+    return fw;
+}
+
+void fanotify_close(fan_watch *fw)
+{
+    if (fw->mount_fd >= 0)
+        close(fw->mount_fd);
+    if (fw->fd >= 0)
+        close(fw->fd);
+    free(fw->buffer);
+    free(fw->root);
+    free(fw);
+}
+
+/* read what is queued on the mark and hand every change below source_base_dir to co
+ * returns: 1 once the source directory itself is gone, otherwise 0
+ */
+int fanotify_dispatch(fan_watch *fw, const char *source_base_dir, coalescer *co)
+{
+    union
+    {
+        struct fanotify_event_metadata meta;
+        char bytes[FAN_EVENT_MAX];
+    } event;
+
+    time_t now = time(NULL);
+    ssize_t length = read(fw->fd, fw->buffer, FAN_BUF);
+    if (length <= 0)
+        return 0;
+
+    /* records are only 4-byte aligned inside the buffer, handle each from an aligned copy */
+    size_t offset = 0;
+    while (offset + sizeof(struct fanotify_event_metadata) <= (size_t)length)
+    {
+        memcpy(&event.meta, fw->buffer + offset, sizeof(event.meta));
+        if (event.meta.event_len < sizeof(event.meta) || offset + event.meta.event_len > (size_t)length)
+            break;
+
+        size_t event_len = event.meta.event_len;
+        offset += event_len;
+        if (event_len > sizeof(event) || event.meta.vers != FANOTIFY_METADATA_VERSION ||
+            (event.meta.mask & FAN_Q_OVERFLOW))
+        {
+            stats_add(STAT_DROPPED, 1);
+            if (event.meta.mask & FAN_Q_OVERFLOW)
+                coalesce_lost(co, fw->calm - RESCAN_SLACK);
+            continue;
+        }
+
+        memcpy(&event, fw->buffer + offset - event_len, event_len);
+        if (handle_event(&event.meta, fw->mount_fd, fw->root, source_base_dir, co))
+            return 1;
+    }
+
+    /* room for one more record means the read took everything queued */
+    if ((size_t)length + FAN_EVENT_MAX <= FAN_BUF)
+        fw->calm = now;
+    return 0;
+}
+
+/* synchronize through a single filesystem-wide fanotify mark, events carry the
+ * parent directory handle and entry name so no per-directory watch is needed
+ * returns: 0 when the source is gone or no target is left, -1 if fanotify can't be used
+ */
+int synchronize_fanotify(const char *source_base_dir, coalescer *co)
+{
+    fan_watch *fw = fanotify_open(source_base_dir);
+    if (fw == NULL)
+        return -1;
+
+    int source_deleted = 0;
+    while (!source_deleted && fanout_active(co->fo))
+    {
+        if (!coalesce_wait(co, fw->fd))
+            continue;
+
+        source_deleted = fanotify_dispatch(fw, source_base_dir, co);
+    }
+
+    fanotify_close(fw);
+    return 0;
+}
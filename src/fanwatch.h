@@ -0,0 +1,26 @@
+#ifndef FW_H
+#define FW_H
+
+#include <time.h>
+
+#include "coalesce.h"
+
+/* a fanotify mark on the filesystem of one source */
+typedef struct FanWatch
+{
+    int fd;
+    int mount_fd; /* resolves the directory handles events carry */
+    char *root;   /* canonical source path, events outside it are ignored */
+    char *buffer;
+    time_t calm; /* when a read last emptied the queue, events lost later can't be older */
+} fan_watch;
+
+fan_watch *fanotify_open(const char *);
+
+void fanotify_close(fan_watch *);
+
+int fanotify_dispatch(fan_watch *, const char *, coalescer *);
+
+int synchronize_fanotify(const char *, coalescer *);
+
+#endif
@@ -3,72 +3,53 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "copyeng.h"
 #include "fileproc.h"
+#include "hash.h"
+#include "iopolicy.h"
+#include "journal.h"
+#include "pack.h"
+#include "pool.h"
+#include "snapshot.h"
+#include "uring.h"
 #include "utils.h"
+#include "walk.h"
 #include "worker.h"
 
 #define MAX_PATH 1024
-#define MAX_BUF 1024
-
-int remove_directory_recursive(const char *path)
+/* files this big are copied as SPLIT_RANGE pieces by several threads */
+#define SPLIT_MIN ((off_t)256 << 20)
+#define SPLIT_RANGE ((off_t)64 << 20)
+/* files found by the walk but not copied yet */
+#define COPY_QUEUE_MAX 1024
+
+/* walk callback: unlink files on the way down and directories once empty */
+static int remove_entry(const walk_entry *entry, void *arg)
 {
-    DIR *d = opendir(path);
-    size_t path_len = strlen(path);
-    int r = 0;
-
-    if (!d)
-    {
-        return 0;
-    }
+    int *result = arg;
 
-    struct dirent *p;
-    while ((p = readdir(d)))
-    {
-        int r2;
-        char *buf;
-        size_t len;
-
-        if (!strcmp(p->d_name, ".") || !strcmp(p->d_name, ".."))
-            continue;
+    if (entry->type == DT_DIR && !entry->post)
+        return WALK_CONTINUE;
 
-        len = path_len + strlen(p->d_name) + 2;
-        buf = malloc(len);
-
-        if (buf)
-        {
-            snprintf(buf, len, "%s/%s", path, p->d_name);
-            struct stat statbuf;
-
-            /* ignore symlink destinations */
-            if (lstat(buf, &statbuf) == -1)
-            {
-                perror("lstat");
-                r = -1;
-                free(buf);
-                continue;
-            }
+    if (unlinkat(entry->dir_fd, entry->name, entry->type == DT_DIR ? AT_REMOVEDIR : 0) != 0)
+        *result = -1;
+    return WALK_CONTINUE;
+}
 
-            if (S_ISDIR(statbuf.st_mode))
-            {
-                r2 = remove_directory_recursive(buf);
-            }
-            else
-            {
-                r2 = unlink(buf);
-            }
+int remove_directory_recursive(const char *path)
+{
+    int r = 0;
 
-            if (r2)
-                r = -1;
-            free(buf);
-        }
-    }
-    closedir(d);
+    /* an unreadable directory can't be emptied, rmdir reports why */
+    walk_tree(path, WALK_POST, remove_entry, &r);
 
     if (r == 0)
     {
@@ -77,59 +58,6 @@ int remove_directory_recursive(const char *path)
 
     return r;
 }
-/* save path to paths array*/
-void add_path(char ***paths, size_t *count, size_t *capacity, const char *path)
-{
-    if (*count >= *capacity)
-    {
-        if (*capacity == 0)
-            *capacity = 5;
-        *capacity = *capacity * 2;
-
-        char **new_paths = realloc(*paths, *capacity * sizeof(char *));
-        if (new_paths == NULL)
-        {
-            ERR("realloc");
-        }
-        *paths = new_paths;
-    }
-
-    (*paths)[*count] = strdup(path);
-    if ((*paths)[*count] == NULL)
-    {
-        ERR("strdup");
-        return;
-    }
-
-    (*count)++;
-}
-
-/* find all files in a crt_path directory*/
-void find_files_recursive(const char *crt_path, char ***paths, size_t *count, size_t *capacity)
-{
-    char file[PATH_MAX];
-    struct dirent *dp;
-    DIR *dir = opendir(crt_path);
-
-    if (!dir)
-        return;
-
-    while ((dp = readdir(dir)) != NULL)
-    {
-        if (strcmp(dp->d_name, ".") != 0 && strcmp(dp->d_name, "..") != 0)
-        {
-            snprintf(file, sizeof(file), "%s/%s", crt_path, dp->d_name);
-            add_path(paths, count, capacity, file);
-
-            /* if dirent is a directory search deeper*/
-            if (dp->d_type == DT_DIR)
-            {
-                find_files_recursive(file, paths, count, capacity);
-            }
-        }
-    }
-    closedir(dir);
-}
 
 int create_directories(const char *path)
 {
@@ -172,85 +100,170 @@ int create_directories(const char *path)
     return 0;
 }
 
-ssize_t bulk_read(int fd, char *buf, size_t count)
-{
-    ssize_t c;
-    ssize_t len = 0;
-    do
-    {
-        c = TEMP_FAILURE_RETRY(read(fd, buf, count));
-        if (c < 0)
-            return c;
-        if (c == 0)
-            return len;  // EOF
-        buf += c;
-        len += c;
-        count -= c;
-    } while (count > 0);
-    return len;
+/* create every directory leading to path, but not path itself */
+int create_parent_directories(const char *path)
+{
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+
+    char *last_slash = strrchr(dir, '/');
+    if (last_slash == NULL || last_slash == dir)
+        return 0;
+
+    *last_slash = '\0';
+    return create_directories(dir);
+}
+
+/* remove a file, link or whole directory tree at path */
+int remove_target_entry(const char *path)
+{
+    struct stat st;
+
+    if (lstat(path, &st) == -1)
+        return 0;
+
+    return S_ISDIR(st.st_mode) ? remove_directory_recursive(path) : unlink(path);
+}
+
+/* remove whatever sits at path unless it is already the wanted kind of entry,
+ * so a file never gets written through a stale symlink or into a directory
+ */
+int clear_target_entry(const char *path, int want_dir)
+{
+    struct stat st;
+
+    if (lstat(path, &st) == -1)
+        return 0;
+
+    if (S_ISDIR(st.st_mode))
+        return want_dir ? 0 : remove_directory_recursive(path);
+
+    if (!want_dir && S_ISREG(st.st_mode))
+        return 0;
+
+    return unlink(path);
 }
 
-ssize_t bulk_write(int fd, char *buf, size_t count)
+/* target the backup copy of link src should point to
+ * returns: 0 on success, -1 if src can't be read
+ */
+static int backup_link_target(const char *src, const char *base_src, const char *base_dest, char *final_target,
+                              size_t size)
 {
-    ssize_t c;
-    ssize_t len = 0;
-    do
+    char link_target[PATH_MAX];
+    ssize_t len;
+
+    len = readlink(src, link_target, sizeof(link_target) - 1);
+    if (len == -1)
+    {
+        return -1;
+    }
+    link_target[len] = '\0';
+
+    /* if link points to local file change target accordingly */
+    size_t base_src_len = strlen(base_src);
+    if (link_target[0] == '/' && strncmp(link_target, base_src, base_src_len) == 0)
     {
-        c = TEMP_FAILURE_RETRY(write(fd, buf, count));
-        if (c < 0)
-            return c;
-        buf += c;
-        len += c;
-        count -= c;
-    } while (count > 0);
-    return len;
+        // base="/src", link="/src_backup/file"
+        if (link_target[base_src_len] == '/' || link_target[base_src_len] == '\0')
+        {
+            const char *suffix = link_target + base_src_len;
+            snprintf(final_target, size, "%s%s", base_dest, suffix);
+        }
+        else
+        {
+            /* link is external */
+            snprintf(final_target, size, "%s", link_target);
+        }
+    }
+    else
+    {
+        /* link is external */
+        snprintf(final_target, size, "%s", link_target);
+    }
+
+    return 0;
+}
+
+/* return 1 if dst already holds what copying src would produce: same type,
+ * same link target, or same size and mtime (and content hash when verify is set)
+ */
+int entry_unchanged(const char *src, const struct stat *src_st, const char *dst, const char *base_src,
+                    const char *base_dest, int verify)
+{
+    struct stat dst_st;
+
+    if (lstat(dst, &dst_st) == -1 || (src_st->st_mode & S_IFMT) != (dst_st.st_mode & S_IFMT))
+        return 0;
+
+    if (S_ISDIR(src_st->st_mode))
+        return 1;
+
+    if (S_ISLNK(src_st->st_mode))
+    {
+        char expected[PATH_MAX];
+        char current[PATH_MAX];
+        ssize_t len = readlink(dst, current, sizeof(current) - 1);
+
+        if (len == -1 || backup_link_target(src, base_src, base_dest, expected, sizeof(expected)) == -1)
+            return 0;
+        current[len] = '\0';
+        return strcmp(expected, current) == 0;
+    }
+
+    if (src_st->st_size != dst_st.st_size || src_st->st_mtim.tv_sec != dst_st.st_mtim.tv_sec ||
+        src_st->st_mtim.tv_nsec != dst_st.st_mtim.tv_nsec)
+        return 0;
+
+    if (verify)
+    {
+        uint64_t src_hash, dst_hash;
+        if (file_hash64(src, &src_hash) == -1 || file_hash64(dst, &dst_hash) == -1)
+            return 0;
+        return src_hash == dst_hash;
+    }
+
+    return 1;
+}
+
+/* give dst the timestamps of src so later incremental passes see it as unchanged */
+void copy_times(int dst_fd, const struct stat *src_st)
+{
+    struct timespec times[2] = {src_st->st_atim, src_st->st_mtim};
+    futimens(dst_fd, times);
+}
+
+/* returns: 1 if the last call on the source failed because it was removed or replaced meanwhile */
+static int source_vanished(void)
+{
+    return errno == ENOENT || errno == ENOTDIR || errno == EINVAL;
 }
 
+/* copies queued earlier may find their source gone, its removal is reported by the watcher
+ * returns: 0 on success, -1 if the source vanished
+ */
 int copy_single_file(const char *src, const char *dest, const char *base_src, const char *base_dest)
 {
     struct stat st;
 
     if (lstat(src, &st) == -1)
     {
-        ERR("lstat");
+        if (!source_vanished())
+            ERR("lstat");
         return -1;
     }
     if (S_ISLNK(st.st_mode))
     {
-        char link_target[MAX_BUF];
-        char final_target[MAX_BUF];
-        ssize_t len;
+        char final_target[PATH_MAX];
 
-        len = readlink(src, link_target, sizeof(link_target) - 1);
-        if (len == -1)
+        if (backup_link_target(src, base_src, base_dest, final_target, sizeof(final_target)) == -1)
         {
-            ERR("readlink error");
+            if (!source_vanished())
+                ERR("readlink error");
             return -1;
         }
-        link_target[len] = '\0';
-
-        /* if link points to local file change target accordingly */
-        size_t base_src_len = strlen(base_src);
-        if (link_target[0] == '/' && strncmp(link_target, base_src, base_src_len) == 0)
-        {
-            // base="/src", link="/src_backup/file"
-            if (link_target[base_src_len] == '/' || link_target[base_src_len] == '\0')
-            {
-                const char *suffix = link_target + base_src_len;
-                snprintf(final_target, sizeof(final_target), "%s%s", base_dest, suffix);
-            }
-            else
-            {
-                /* link is external */
-                strcpy(final_target, link_target);
-            }
-        }
-        else
-        {
-            /* link is external */
-            strcpy(final_target, link_target);
-        }
 
+        clear_target_entry(dest, 0);
         if (symlink(final_target, dest) == -1)
         {
             ERR("symlink");
@@ -265,14 +278,16 @@ int copy_single_file(const char *src, const char *dest, const char *base_src, co
         return 0;
     }
 
+    clear_target_entry(dest, 0);
+
     int src_fd, dst_fd;
-    char buffer[MAX_BUF];
-    ssize_t bytes_read, bytes_written;
+    copy_method method;
 
     src_fd = TEMP_FAILURE_RETRY(open(src, O_RDONLY));
     if (src_fd < 0)
     {
-        ERR("open src");
+        if (!source_vanished())
+            ERR("open src");
         return -1;
     }
 
@@ -284,22 +299,14 @@ int copy_single_file(const char *src, const char *dest, const char *base_src, co
         return -1;
     }
 
-    while ((bytes_read = bulk_read(src_fd, buffer, MAX_BUF)) > 0)
-    {
-        bytes_written = bulk_write(dst_fd, buffer, bytes_read);
-
-        if (bytes_written != bytes_read)
-        {
-            ERR("bulk_write");
-            break;
-        }
-    }
-
-    if (bytes_read < 0)
+    if (copy_data(src_fd, dst_fd, st.st_size, &method) < 0)
     {
-        ERR("bulk_read");
+        ERR("copy_data");
         return -1;
     }
+    copy_stats_record(src, method, st.st_size);
+    copy_times(dst_fd, &st);
+    io_release(src_fd, dst_fd, st.st_size);
 
     if (TEMP_FAILURE_RETRY(close(src_fd)) < 0)
     {
@@ -315,83 +322,550 @@ int copy_single_file(const char *src, const char *dest, const char *base_src, co
     return 0;
 }
 
-int copy_files(char **file_paths, size_t count, const char *base_path, const char *target_dir)
+struct SmallBatch;
+
+/* what the walk feeds into the copy pipeline */
+typedef struct CopyCtx
+{
+    fanout *fo;
+    thread_pool *pool;
+    int use_uring;
+    struct SmallBatch *batch;
+} copy_ctx;
+
+/* small files collected for one io_uring submission */
+typedef struct SmallBatch
+{
+    fanout *fo;
+    size_t base_len;
+    int cnt;
+    uring_file files[URING_BATCH];
+} small_batch;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static _Thread_local int ring_tried = 0;
+
+typedef struct CopyJob
 {
+    fanout *fo;
+    thread_pool *pool;
+    char *src;
+    const char *rel;
+} copy_job;
+
+/* one huge file shared by the range tasks copying it */
+typedef struct SplitFile
+{
+    atomic_int left;
+    atomic_int failed; /* a range could not be copied, the last one copies the whole file again */
+    atomic_int method; /* highest copy_method of the ranges */
+    int src_fd;
+    int dst_fd;
     struct stat st;
+    char *src;
+} split_file;
+
+typedef struct RangeJob
+{
+    split_file *file;
+    off_t offset;
+    off_t len;
+} range_job;
+
+static void range_task(void *arg)
+{
+    range_job *job = arg;
+    split_file *file = job->file;
+    copy_method method;
+    int result;
 
-    for (size_t i = 0; i < count; i++)
+    /* the target was already sized, so skipping a hole leaves it reading as zeros */
+    if (is_sparse(&file->st))
+    {
+        result = copy_sparse_range(file->src_fd, file->dst_fd, job->offset, job->len, &method);
+        method = COPY_SPARSE;
+    }
+    else
     {
-        const char *src_path = file_paths[i];
-        const char *rel_path;
-        char dest_path[PATH_MAX];
-        char dest_dir[PATH_MAX];
+        result = copy_range(file->src_fd, file->dst_fd, job->offset, job->len, &method);
+    }
 
-        size_t base_len = strlen(base_path);
+    if (result != 0)
+    {
+        atomic_store(&file->failed, 1);
+    }
+    else
+    {
+        int seen = atomic_load(&file->method);
+        while ((int)method > seen && !atomic_compare_exchange_weak(&file->method, &seen, (int)method))
+            ;
+    }
 
-        rel_path = src_path + base_len;
-        if (*rel_path == '/')
+    /* last range closes the file */
+    if (atomic_fetch_sub(&file->left, 1) == 1)
+    {
+        method = atomic_load(&file->method);
+
+        /* the sparse ranges moved the source offset looking for data, the retry starts over at 0 */
+        if (atomic_load(&file->failed) &&
+            (lseek(file->src_fd, 0, SEEK_SET) != 0 || lseek(file->dst_fd, 0, SEEK_SET) != 0 ||
+             copy_data(file->src_fd, file->dst_fd, file->st.st_size, &method) != 0))
         {
-            rel_path++;
+            perror(file->src);
         }
-
-        snprintf(dest_path, MAX_BUF, "%s/%s", target_dir, rel_path);
-
-        if (stat(src_path, &st) == -1)
+        else
         {
-            ERR("stat");
-            continue;
+            copy_stats_record(file->src, method, file->st.st_size);
+            copy_times(file->dst_fd, &file->st);
         }
+        io_release(file->src_fd, file->dst_fd, file->st.st_size);
+        TEMP_FAILURE_RETRY(close(file->src_fd));
+        TEMP_FAILURE_RETRY(close(file->dst_fd));
+        free(file->src);
+        free(file);
+    }
+    free(job);
+}
 
-        if (S_ISDIR(st.st_mode))
+/* cut a huge file into ranges so idle threads can steal parts of it */
+static void split_copy(copy_job *job, const struct stat *st)
+{
+    char dst[PATH_MAX];
+    off_t size = st->st_size;
+    fanout *fo = job->fo;
+
+    target_path(dst, sizeof(dst), fo->targets[0].base, job->rel);
+    if (fo->skip_unchanged && entry_unchanged(job->src, st, dst, fo->src_base, fo->targets[0].base, fo->verify))
+        return;
+
+    create_parent_directories(dst);
+    clear_target_entry(dst, 0);
+
+    int src_fd = TEMP_FAILURE_RETRY(open(job->src, O_RDONLY));
+    if (src_fd < 0)
+    {
+        perror(job->src);
+        return;
+    }
+
+    int dst_fd = TEMP_FAILURE_RETRY(open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0777));
+    if (dst_fd < 0)
+        ERR("open dest");
+
+    /* a clone beats any amount of parallelism */
+    if (copy_reflink(src_fd, dst_fd) == 0)
+    {
+        copy_stats_record(job->src, COPY_REFLINK, size);
+        copy_times(dst_fd, st);
+        TEMP_FAILURE_RETRY(close(src_fd));
+        TEMP_FAILURE_RETRY(close(dst_fd));
+        return;
+    }
+
+    io_prepare(src_fd, dst_fd, st);
+    if (ftruncate(dst_fd, size) != 0)
+        ERR("ftruncate");
+
+    split_file *file = malloc(sizeof(split_file));
+    if (file == NULL || (file->src = strdup(job->src)) == NULL)
+        ERR("malloc");
+    file->src_fd = src_fd;
+    file->dst_fd = dst_fd;
+    file->st = *st;
+    atomic_init(&file->failed, 0);
+    atomic_init(&file->method, COPY_NONE);
+    atomic_init(&file->left, (int)((size + SPLIT_RANGE - 1) / SPLIT_RANGE));
+
+    for (off_t offset = 0; offset < size; offset += SPLIT_RANGE)
+    {
+        range_job *range = malloc(sizeof(range_job));
+        if (range == NULL)
+            ERR("malloc");
+        range->file = file;
+        range->offset = offset;
+        range->len = size - offset < SPLIT_RANGE ? size - offset : SPLIT_RANGE;
+        pool_submit(job->pool, range_task, range);
+    }
+}
+
+static void copy_task(void *arg)
+{
+    copy_job *job = arg;
+    fanout *fo = job->fo;
+    struct stat st;
+
+    /* resuming into an existing replica, rewriting changed blocks beats a parallel full copy */
+    if (!fo->threaded && !fo->store && !fo->compress && lstat(job->src, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size >= SPLIT_MIN && !(fo->skip_unchanged && fo->delta_min > 0 && st.st_size >= fo->delta_min) &&
+        !io_use_direct(&st))
+    {
+        split_copy(job, &st);
+    }
+    else if (fanout_copy_file(fo, job->src, job->rel) != 0)
+    {
+        /* removed after the walk saw it */
+        perror(job->src);
+    }
+    free(job->src);
+    free(job);
+}
+
+static void free_ring(void *ring) { uring_destroy(ring); }
+
+static void make_ring_key(void) { pthread_key_create(&ring_key, free_ring); }
+
+/* returns: the calling thread's ring, NULL when io_uring can't be used here */
+static uring *thread_ring(void)
+{
+    pthread_once(&ring_once, make_ring_key);
+
+    uring *ring = pthread_getspecific(ring_key);
+    if (ring == NULL && !ring_tried)
+    {
+        ring_tried = 1;
+        ring = uring_create();
+        pthread_setspecific(ring_key, ring);
+    }
+    return ring;
+}
+
+/* copy a batch of small files through the thread's ring, whatever the ring
+ * can't do goes through the regular per-file path
+ */
+static void batch_task(void *arg)
+{
+    small_batch *batch = arg;
+    fanout *fo = batch->fo;
+    uring_file *files = batch->files;
+    uring *ring = thread_ring();
+    int ok = ring != NULL;
+
+    for (int i = 0; i < batch->cnt; i++)
+        files[i].skip = files[i].clear = 0;
+
+    if (ok && fo->skip_unchanged)
+    {
+        if (fo->verify)
         {
-            if (create_directories(dest_path) != 0)
+            /* a changed entry may be a stale link the ring's open would follow */
+            for (int i = 0; i < batch->cnt; i++)
             {
-                ERR("create_directories");
+                files[i].skip = entry_unchanged(files[i].src, &files[i].st, files[i].dst, fo->src_base,
+                                                fo->targets[0].base, 1);
+                files[i].clear = !files[i].skip;
             }
         }
         else
         {
-            /* if dest path points to file -> extract parent dir*/
-            char *last_slash = strrchr(dest_path, '/');
-            if (last_slash != NULL)
-            {
-                size_t dir_len = last_slash - dest_path;
-                strncpy(dest_dir, dest_path, dir_len);
-                dest_dir[dir_len] = '\0';
+            ok = uring_stat_batch(ring, files, batch->cnt) == 0;
+        }
 
-                /* create parent dirs */
-                create_directories(dest_dir);
-            }
+        for (int i = 0; ok && i < batch->cnt; i++)
+        {
+            if (files[i].clear)
+                clear_target_entry(files[i].dst, 0);
+        }
+    }
+
+    if (ok)
+        ok = uring_copy_batch(ring, files, batch->cnt) == 0;
+
+    for (int i = 0; i < batch->cnt; i++)
+    {
+        if (!ok || (!files[i].skip && files[i].result != 0))
+        {
+            if (fanout_copy_file(fo, files[i].src, files[i].src + batch->base_len) != 0)
+                perror(files[i].src);
+        }
+        else if (!files[i].skip)
+        {
+            struct timespec times[2] = {files[i].st.st_atim, files[i].st.st_mtim};
+            utimensat(AT_FDCWD, files[i].dst, times, AT_SYMLINK_NOFOLLOW);
+            copy_stats_record(files[i].src, COPY_URING, files[i].st.st_size);
+        }
+
+        free(files[i].src);
+        free(files[i].dst);
+    }
+    free(batch);
+}
+
+static void flush_batch(copy_ctx *ctx)
+{
+    if (ctx->batch != NULL && ctx->batch->cnt > 0)
+        pool_submit(ctx->pool, batch_task, ctx->batch);
+    else
+        free(ctx->batch);
+    ctx->batch = NULL;
+}
+
+/* queue a small regular file for the next io_uring batch */
+static void batch_file(copy_ctx *ctx, const char *src_path, const char *rel_path, const struct stat *st)
+{
+    char dst[PATH_MAX];
+
+    if (ctx->batch == NULL)
+    {
+        ctx->batch = calloc(1, sizeof(small_batch));
+        if (ctx->batch == NULL)
+            ERR("calloc");
+        ctx->batch->fo = ctx->fo;
+        ctx->batch->base_len = rel_path - src_path;
+    }
+
+    uring_file *file = &ctx->batch->files[ctx->batch->cnt++];
+    target_path(dst, sizeof(dst), ctx->fo->targets[0].base, rel_path);
+    file->src = strdup(src_path);
+    file->dst = strdup(dst);
+    if (file->src == NULL || file->dst == NULL)
+        ERR("strdup");
+    file->st = *st;
+
+    if (ctx->batch->cnt == URING_BATCH)
+        flush_batch(ctx);
+}
 
-            if (copy_single_file(src_path, dest_path, base_path, target_dir) != 0)
+/* walk callback: directories are created right away in walk order so they
+ * exist before any task copies into them, files are queued for the pool
+ */
+static int copy_entry(const walk_entry *entry, void *arg)
+{
+    copy_ctx *ctx = arg;
+    struct stat st;
+    const char *src_path = entry->path;
+
+    const char *rel_path = src_path + entry->root_len;
+    if (*rel_path == '/')
+    {
+        rel_path++;
+    }
+
+    /* a link to a directory is mirrored as a directory */
+    struct stat link_st;
+    if (entry->type == DT_DIR || (entry->type == DT_LNK && walk_stat(entry->dir_fd, entry->name, &link_st, 0) == 0 &&
+                                  S_ISDIR(link_st.st_mode)))
+    {
+        fanout_mkdir(ctx->fo, rel_path);
+        return WALK_CONTINUE;
+    }
+
+    if (walk_stat(entry->dir_fd, entry->name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+    {
+        if (!source_vanished())
+            ERR("lstat");
+        return WALK_CONTINUE;
+    }
+
+    /* parents were created earlier in the walk, so batched files need no mkdir at all */
+    if (ctx->use_uring && S_ISREG(st.st_mode) && st.st_size <= URING_BUF && !is_sparse(&st))
+    {
+        batch_file(ctx, src_path, rel_path, &st);
+        return WALK_CONTINUE;
+    }
+
+    copy_job *job = malloc(sizeof(copy_job));
+    if (job == NULL || (job->src = strdup(src_path)) == NULL)
+        ERR("malloc");
+    job->fo = ctx->fo;
+    job->pool = ctx->pool;
+    job->rel = job->src + (rel_path - src_path);
+
+    /* blocks while COPY_QUEUE_MAX files wait, so memory stays flat */
+    pool_submit(ctx->pool, copy_task, job);
+    return WALK_CONTINUE;
+}
+
+/* stream every path below base_path to all targets of fo, copying starts with the first file found */
+void copy_files(const char *base_path, fanout *fo, thread_pool *pool, int use_uring)
+{
+    /* batches write straight to the one target, fan-out keeps its own streams, stores write recipes,
+     * compressed targets go through fanout_copy_file to be compressed on the pool threads and packs
+     * take the small files batches are made of
+     */
+    copy_ctx ctx = {fo, pool, use_uring && !fo->threaded && !fo->store && !fo->compress && !fo->packed, NULL};
+
+    walk_tree(base_path, 0, copy_entry, &ctx);
+    flush_batch(&ctx);
+
+    pool_wait(pool);
+    fanout_flush(fo);
+}
+
+/* returns: 1 for the entries below the target root that belong to the backup itself,
+ * the packs are pruned through their index, snapshots only by their retention
+ */
+int backup_own_entry(const char *name)
+{
+    return strcmp(name, PACK_DIR) == 0 || strcmp(name, SNAPSHOT_DIR) == 0 || strcmp(name, JOURNAL_NAME) == 0;
+}
+
+/* walk callback over a target: drop entries the source no longer has */
+static int prune_entry(const walk_entry *entry, void *arg)
+{
+    const char *src_base = arg;
+    char src_path[PATH_MAX];
+    struct stat st;
+
+    if (entry->depth == 1 && backup_own_entry(entry->name))
+        return WALK_SKIP;
+
+    snprintf(src_path, sizeof(src_path), "%s%s", src_base, entry->path + entry->root_len);
+    if (lstat(src_path, &st) == -1 && errno == ENOENT)
+    {
+        remove_target_entry(entry->path);
+        return WALK_SKIP;
+    }
+    return WALK_CONTINUE;
+}
+
+/* remove what target has below it but source no longer does, packs aside */
+void prune_target(const char *target, const char *source)
+{
+    walk_tree(target, 0, prune_entry, (void *)source);
+}
+
+/* walk state of a resume from the journals */
+typedef struct ResumeCtx
+{
+    copy_ctx copy;
+    journal *journal;
+    char fresh[PATH_MAX]; /* directory a target lacked, everything below it is copied, empty if none */
+    size_t compared;
+} resume_ctx;
+
+/* remove what the targets have in directory rel but the source directory src_dir doesn't */
+static void prune_children(fanout *fo, const char *src_dir, const char *rel)
+{
+    char dst[PATH_MAX], path[PATH_MAX], child[PATH_MAX];
+    const char *name;
+    unsigned char type;
+    struct stat st;
+    dir_reader r;
+
+    for (int i = 0; i < fo->cnt; i++)
+    {
+        target_path(dst, sizeof(dst), fo->targets[i].base, rel);
+        if (fo->targets[i].detached || dir_open(&r, AT_FDCWD, dst) != 0)
+            continue;
+
+        while (dir_next(&r, &name, &type) > 0)
+        {
+            if (rel[0] == '\0' && backup_own_entry(name))
+                continue;
+            snprintf(path, sizeof(path), "%s/%s", src_dir, name);
+            if (lstat(path, &st) == -1 && errno == ENOENT)
             {
-                ERR("copy_single_file");
+                snprintf(child, sizeof(child), rel[0] == '\0' ? "%s%s" : "%s/%s", rel, name);
+                target_path(path, sizeof(path), fo->targets[i].base, child);
+                remove_target_entry(path);
             }
         }
+        dir_close(&r);
     }
-    return 0;
 }
 
-void free_paths(char **paths, size_t count)
+/* walk callback over the source on resume: only entries changed after the watermark
+ * or named by the journal are compared with the targets
+ */
+static int resume_entry(const walk_entry *entry, void *arg)
 {
-    for (size_t i = 0; i < count; i++)
+    resume_ctx *ctx = arg;
+    fanout *fo = ctx->copy.fo;
+    char dst[PATH_MAX];
+    struct stat st, dst_st;
+
+    const char *rel = entry->path + entry->root_len;
+    if (*rel == '/')
+        rel++;
+
+    /* the walk is depth first, the first path outside the fresh directory ends it */
+    size_t fresh_len = strlen(ctx->fresh);
+    int fresh = fresh_len > 0 && strncmp(rel, ctx->fresh, fresh_len) == 0 && rel[fresh_len] == '/';
+    if (!fresh)
+        ctx->fresh[0] = '\0';
+
+    /* writes, renames and removals inside all move the ctime, what is older was applied before the watermark */
+    if (walk_stat(entry->dir_fd, entry->name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+        (!fresh && st.st_ctim.tv_sec < ctx->journal->watermark && !journal_dirty(ctx->journal, rel)))
+        return WALK_CONTINUE;
+    ctx->compared++;
+
+    if (S_ISDIR(st.st_mode))
     {
-        free(paths[i]);
+        /* a directory moved in while nothing watched keeps the old times of everything below it */
+        for (int i = 0; !fresh && i < fo->cnt; i++)
+        {
+            target_path(dst, sizeof(dst), fo->targets[i].base, rel);
+            if (lstat(dst, &dst_st) != 0 || !S_ISDIR(dst_st.st_mode))
+            {
+                snprintf(ctx->fresh, sizeof(ctx->fresh), "%s", rel);
+                fresh = 1;
+            }
+        }
+        prune_children(fo, entry->path, rel);
     }
-    free(paths);
+    return copy_entry(entry, &ctx->copy);
+}
+
+/* bring targets holding journals of source up to date, comparing only what
+ * changed after their watermark or had events recorded since
+ */
+static void resume_files(const char *base_path, fanout *fo, thread_pool *pool)
+{
+    resume_ctx ctx = {{fo, pool, 0, NULL}, fo->journal, "", 0};
+    struct stat st;
+
+    if (stat(base_path, &st) == 0 && st.st_ctim.tv_sec >= fo->journal->watermark)
+        prune_children(fo, base_path, "");
+    walk_tree(base_path, 0, resume_entry, &ctx);
+
+    pool_wait(pool);
+    fanout_flush(fo);
+
+    if (getenv("SOP_BACKUP_TRACE"))
+        fprintf(stderr, "resume: %zu entries compared\n", ctx.compared);
 }
 
-void start_copy(char *source, char *target)
+void start_copy(char *source, fanout *fo, const backup_opts *opts)
 {
-    char **file_paths = NULL;
-    size_t path_count = 0;
-    size_t path_capacity = 0;
+    thread_pool *pool = pool_create(opts->threads, COPY_QUEUE_MAX);
+    journal *j = fo->journal;
 
-    find_files_recursive(source, &file_paths, &path_count, &path_capacity);
+    /* a journal with a watermark on every target bounds what a resume compares,
+     * any other journal means a target that was never fully copied
+     */
+    int resume = j && j->resumable && !opts->incremental;
 
-    copy_files(file_paths, path_count, source, target);
+    /* an existing target only needs what differs from the source */
+    if (opts->incremental || (j && j->found))
+    {
+        for (int i = 0; i < fo->cnt; i++)
+        {
+            if (!resume)
+                prune_target(fo->targets[i].base, source);
+            if (fo->targets[i].pack)
+                pack_prune(fo->targets[i].pack, source);
+        }
+        fo->skip_unchanged = 1;
+        fo->verify = opts->verify;
+    }
 
-    free_paths(file_paths, path_count);
+    if (resume)
+        resume_files(source, fo, pool);
+    else
+        copy_files(source, fo, pool, opts->uring);
+    fo->skip_unchanged = 0;
+
+    pool_destroy(pool);
+    journal_ready(j);
+
+    if (getenv("SOP_BACKUP_TRACE"))
+    {
+        copy_stats_print(stderr);
+        if (fo->store)
+            dedup_stats_print(fo->store, stderr);
+    }
 }
 
 int setup_target_dir(const char *t_path)
@@ -1,25 +1,38 @@
 #ifndef FP_H
 #define FP_H
 
+#include <sys/stat.h>
+
+#include "fanout.h"
+#include "opts.h"
+#include "pool.h"
 #include "utils.h"
 #include "worker.h"
 
-void add_path(char ***, size_t *, size_t *, const char *);
+int copy_single_file(const char *, const char *, const char *, const char *);
+
+int entry_unchanged(const char *, const struct stat *, const char *, const char *, const char *, int);
 
-void free_paths(char **, size_t);
+void copy_times(int, const struct stat *);
 
-int copy_single_file(const char *, const char *, const char *, const char *);
+int clear_target_entry(const char *, int);
 
-int copy_files(char **, size_t, const char *, const char *);
+int remove_target_entry(const char *);
 
-void find_files_recursive(const char *, char ***, size_t *, size_t *);
+int backup_own_entry(const char *);
+
+void prune_target(const char *, const char *);
+
+void copy_files(const char *, fanout *, thread_pool *, int);
 
 int create_directories(const char *);
 
+int create_parent_directories(const char *);
+
 int remove_directory_recursive(const char *);
 
 int setup_target_dir(const char *);
 
-void start_copy(char *, char *);
+void start_copy(char *, fanout *, const backup_opts *);
 
 #endif
@@ -0,0 +1,19 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH64_SEED 0xcbf29ce484222325ULL
+
+uint64_t hash64(const void *, size_t, uint64_t);
+
+int file_hash64(const char *, uint64_t *);
+
+#define SHA256_LEN 32
+
+void sha256(const void *, size_t, unsigned char *);
+
+void sha256_hex(const unsigned char *, char *);
+
+#endif
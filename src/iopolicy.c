@@ -0,0 +1,67 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "copyeng.h"
+#include "iopolicy.h"
+
+/* set once per worker before any copy starts, read by every copy thread */
+static int use_direct = 0;
+
+void io_configure(int direct) { use_direct = direct; }
+
+/* returns: 1 if st should be copied with O_DIRECT */
+int io_use_direct(const struct stat *st)
+{
+    return use_direct && S_ISREG(st->st_mode) && st->st_size >= IO_DIRECT_MIN && !is_sparse(st);
+}
+
+/* a buffer holding the whole file when it is small, rounded up to the preferred
+ * I/O size of the device behind fd and to IO_ALIGN, never above IO_BUF_MAX
+ */
+size_t io_buffer_size(int fd, off_t size)
+{
+    struct stat st;
+    size_t block = IO_ALIGN;
+
+    if (fstat(fd, &st) == 0 && st.st_blksize > IO_ALIGN)
+        block = (st.st_blksize + IO_ALIGN - 1) / IO_ALIGN * IO_ALIGN;
+
+    if (size <= 0)
+        return block;
+    if ((size_t)size >= IO_BUF_MAX)
+        return IO_BUF_MAX > block ? IO_BUF_MAX : block;
+    return ((size_t)size + block - 1) / block * block;
+}
+
+/* hint a front-to-back read and reserve the target's blocks in one extent,
+ * KEEP_SIZE so a source that shrinks meanwhile doesn't leave a longer target
+ */
+void io_prepare(int src_fd, int dst_fd, const struct stat *st)
+{
+    if (src_fd >= 0)
+        posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (dst_fd >= 0 && S_ISREG(st->st_mode) && st->st_size > 0 && !is_sparse(st))
+        fallocate(dst_fd, FALLOC_FL_KEEP_SIZE, 0, st->st_size);
+}
+
+/* drop what a copy of size bytes put in the page cache, dirty target pages
+ * are written back first since the kernel only drops clean ones
+ */
+void io_release(int src_fd, int dst_fd, off_t size)
+{
+    if (size < IO_DROP_MIN)
+        return;
+
+    if (dst_fd >= 0)
+    {
+        sync_file_range(dst_fd, 0, 0,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(dst_fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    if (src_fd >= 0)
+        posix_fadvise(src_fd, 0, 0, POSIX_FADV_DONTNEED);
+}
@@ -0,0 +1,27 @@
+#ifndef IOP_H
+#define IOP_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* largest user-space copy buffer, files are moved in pieces of at most this */
+#define IO_BUF_MAX ((size_t)4 << 20)
+/* O_DIRECT needs buffers, offsets and lengths aligned to the logical block size */
+#define IO_ALIGN 4096
+/* smaller files leave too little in the page cache to be worth a writeback */
+#define IO_DROP_MIN ((off_t)1 << 20)
+/* files this large bypass the page cache when direct I/O is enabled */
+#define IO_DIRECT_MIN ((off_t)1 << 30)
+
+void io_configure(int);
+
+int io_use_direct(const struct stat *);
+
+size_t io_buffer_size(int, off_t);
+
+void io_prepare(int, int, const struct stat *);
+
+void io_release(int, int, off_t);
+
+#endif
@@ -0,0 +1,390 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "journal.h"
+#include "utils.h"
+
+#define JOURNAL_MAGIC "#sop-backup journal 1\n"
+#define JOURNAL_BUCKETS 256
+
+/* record types */
+#define RECORD_SOURCE 1 /* path is the source directory of the backup */
+#define RECORD_MARK 2   /* value is the watermark, in seconds of the wall clock */
+#define RECORD_DIRTY 3  /* path had events after the watermark */
+
+/* one journal record, followed by path_len bytes of path */
+typedef struct JournalRecord
+{
+    uint32_t type;
+    uint32_t path_len;
+    int64_t value;
+} journal_record;
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void set_init(journal_set *set)
+{
+    set->bucket_cnt = JOURNAL_BUCKETS;
+    set->cnt = 0;
+    set->buckets = calloc(set->bucket_cnt, sizeof(journal_path *));
+    if (set->buckets == NULL)
+        ERR("calloc");
+}
+
+static void set_clear(journal_set *set)
+{
+    for (size_t i = 0; i < set->bucket_cnt; i++)
+    {
+        while (set->buckets[i])
+        {
+            journal_path *jp = set->buckets[i];
+            set->buckets[i] = jp->next;
+            free(jp->path);
+            free(jp);
+        }
+    }
+    set->cnt = 0;
+}
+
+static int set_find(journal_set *set, const char *path, size_t len)
+{
+    journal_path *jp = set->buckets[hash64(path, len, HASH64_SEED) & (set->bucket_cnt - 1)];
+    while (jp && (strncmp(jp->path, path, len) != 0 || jp->path[len] != '\0'))
+        jp = jp->next;
+    return jp != NULL;
+}
+
+/* returns: 1 if path was added, 0 if the set already had it */
+static int set_add(journal_set *set, const char *path)
+{
+    size_t len = strlen(path);
+    if (set_find(set, path, len))
+        return 0;
+
+    if (set->cnt >= set->bucket_cnt)
+    {
+        journal_path **buckets = calloc(set->bucket_cnt * 2, sizeof(journal_path *));
+        if (buckets == NULL)
+            ERR("calloc");
+        for (size_t i = 0; i < set->bucket_cnt; i++)
+        {
+            while (set->buckets[i])
+            {
+                journal_path *jp = set->buckets[i];
+                set->buckets[i] = jp->next;
+                size_t b = hash64(jp->path, strlen(jp->path), HASH64_SEED) & (set->bucket_cnt * 2 - 1);
+                jp->next = buckets[b];
+                buckets[b] = jp;
+            }
+        }
+        free(set->buckets);
+        set->buckets = buckets;
+        set->bucket_cnt *= 2;
+    }
+
+    journal_path *jp = malloc(sizeof(journal_path));
+    if (jp == NULL || (jp->path = strdup(path)) == NULL)
+        ERR("malloc");
+    size_t b = hash64(path, len, HASH64_SEED) & (set->bucket_cnt - 1);
+    jp->next = set->buckets[b];
+    set->buckets[b] = jp;
+    set->cnt++;
+    return 1;
+}
+
+static void append_record(journal *j, uint32_t type, int64_t value, const char *path)
+{
+    journal_record rec = {type, (uint32_t)strlen(path), value};
+
+    if (j->len + sizeof(rec) + rec.path_len > j->cap)
+    {
+        j->cap = (j->len + sizeof(rec) + rec.path_len) * 2;
+        j->buf = realloc(j->buf, j->cap);
+        if (j->buf == NULL)
+            ERR("realloc");
+    }
+    memcpy(j->buf + j->len, &rec, sizeof(rec));
+    memcpy(j->buf + j->len + sizeof(rec), path, rec.path_len);
+    j->len += sizeof(rec) + rec.path_len;
+}
+
+/* append the buffered records to every journal in one write each */
+static void write_out(journal *j)
+{
+    for (int i = 0; i < j->cnt; i++)
+    {
+        if (j->fds[i] >= 0 && pwrite(j->fds[i], j->buf, j->len, j->size) != (ssize_t)j->len)
+            perror("journal");
+    }
+    j->size += j->len;
+    j->len = 0;
+}
+
+/* read the next record of f into rec and path
+ * returns: 1 on success, 0 at the end or at a torn record
+ */
+static int read_record(FILE *f, journal_record *rec, char *path)
+{
+    if (fread(rec, sizeof(*rec), 1, f) != 1 || rec->path_len >= PATH_MAX ||
+        (rec->path_len > 0 && fread(path, rec->path_len, 1, f) != 1))
+        return 0;
+    path[rec->path_len] = '\0';
+    return 1;
+}
+
+/* open the journal of fd for replay
+ * returns: stream positioned after the source record, NULL unless it is a journal of src
+ */
+static FILE *open_replay(int fd, const char *src)
+{
+    char magic[sizeof(JOURNAL_MAGIC) - 1];
+    char path[PATH_MAX];
+    journal_record rec;
+
+    FILE *f = fdopen(dup(fd), "r");
+    if (f == NULL)
+        return NULL;
+    if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, JOURNAL_MAGIC, sizeof(magic)) != 0 ||
+        !read_record(f, &rec, path) || rec.type != RECORD_SOURCE || strcmp(path, src) != 0)
+    {
+        fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+/* returns: 1 if target holds a journal of a backup of src, so a backup may resume into it */
+int journal_matches(const char *target, const char *src)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/" JOURNAL_NAME, target);
+    int fd = TEMP_FAILURE_RETRY(open(path, O_RDONLY | O_CLOEXEC));
+    if (fd < 0)
+        return 0;
+
+    FILE *f = open_replay(fd, src);
+    TEMP_FAILURE_RETRY(close(fd));
+    if (f == NULL)
+        return 0;
+    fclose(f);
+    return 1;
+}
+
+/* collect the watermark and dirty paths of one journal
+ * returns: 1 if it belongs to src and has a watermark, 0 otherwise
+ */
+static int replay(journal *j, int fd, const char *src)
+{
+    char path[PATH_MAX];
+    journal_record rec;
+    int marked = 0;
+
+    FILE *f = open_replay(fd, src);
+    if (f == NULL)
+        return 0;
+    j->found = 1;
+
+    while (read_record(f, &rec, path))
+    {
+        if (rec.type == RECORD_MARK)
+        {
+            if (!marked || rec.value < j->watermark)
+                j->watermark = rec.value;
+            marked = 1;
+        }
+        else if (rec.type == RECORD_DIRTY)
+        {
+            set_add(&j->resume, path);
+        }
+    }
+    fclose(f);
+    return marked;
+}
+
+/* open the journals of a backup of src to cnt targets, whatever they recorded
+ * before is kept until the first watermark of this run replaces it
+ * returns: journal, NULL if a target can't hold one
+ */
+journal *journal_open(const char *src, char **targets, int cnt)
+{
+    char path[PATH_MAX];
+
+    journal *j = calloc(1, sizeof(journal));
+    if (j == NULL || (j->fds = malloc(cnt * sizeof(int))) == NULL)
+        ERR("calloc");
+    j->cnt = cnt;
+    set_init(&j->dirty);
+    set_init(&j->resume);
+    pthread_mutex_init(&j->lock, NULL);
+
+    int resumable = 1;
+    for (int i = 0; i < cnt; i++)
+    {
+        snprintf(path, sizeof(path), "%s/" JOURNAL_NAME, targets[i]);
+        j->fds[i] = TEMP_FAILURE_RETRY(open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666));
+        if (j->fds[i] < 0)
+        {
+            j->cnt = i;
+            journal_close(j);
+            return NULL;
+        }
+        resumable &= replay(j, j->fds[i], src);
+    }
+    j->resumable = resumable;
+    if (!resumable)
+        set_clear(&j->resume);
+
+    /* the same contents go to every target, only a watermark all of them had survives */
+    append_record(j, RECORD_SOURCE, 0, src);
+    size_t magic_len = sizeof(JOURNAL_MAGIC) - 1;
+    j->base = (off_t)(magic_len + j->len);
+    if (resumable)
+    {
+        append_record(j, RECORD_MARK, j->watermark, "");
+        for (size_t b = 0; b < j->resume.bucket_cnt; b++)
+        {
+            for (journal_path *jp = j->resume.buckets[b]; jp; jp = jp->next)
+                append_record(j, RECORD_DIRTY, 0, jp->path);
+        }
+    }
+    for (int i = 0; i < j->cnt; i++)
+    {
+        if (ftruncate(j->fds[i], 0) != 0 || pwrite(j->fds[i], JOURNAL_MAGIC, magic_len, 0) != (ssize_t)magic_len)
+            perror("journal");
+    }
+    j->size = (off_t)magic_len;
+    write_out(j);
+    for (int i = 0; i < j->cnt; i++)
+        fdatasync(j->fds[i]);
+
+    j->started = time(NULL);
+    j->changed = 1;
+    return j;
+}
+
+/* write what is buffered, a backup closing now leaves its changes to the next resume */
+void journal_close(journal *j)
+{
+    if (j->len > 0)
+        write_out(j);
+    for (int i = 0; i < j->cnt; i++)
+        TEMP_FAILURE_RETRY(close(j->fds[i]));
+
+    set_clear(&j->dirty);
+    set_clear(&j->resume);
+    free(j->dirty.buckets);
+    free(j->resume.buckets);
+    pthread_mutex_destroy(&j->lock);
+    free(j->fds);
+    free(j->buf);
+    free(j);
+}
+
+/* record that rel changed, every path once per watermark */
+void journal_note(journal *j, const char *rel)
+{
+    if (j == NULL)
+        return;
+    if (set_add(&j->dirty, rel))
+        append_record(j, RECORD_DIRTY, 0, rel);
+    j->changed = 1;
+}
+
+/* the initial copy or resume is over, watermarks may follow */
+void journal_ready(journal *j)
+{
+    if (j == NULL)
+        return;
+    pthread_mutex_lock(&j->lock);
+    j->ready = 1;
+    pthread_mutex_unlock(&j->lock);
+}
+
+/* returns: ms until journal_tick has work to do, -1 if it has none */
+int journal_timeout(journal *j)
+{
+    if (j == NULL || (!j->changed && j->len == 0))
+        return -1;
+
+    long long left = j->due_ms - now_ms();
+    return left < 0 ? 0 : (int)left;
+}
+
+/* write the records noted since the last call, or when idle says every noted
+ * change has reached the targets, flush the targets and replace the records by
+ * a new watermark; both happen at most every JOURNAL_INTERVAL_MS
+ */
+void journal_tick(journal *j, int idle)
+{
+    if (j == NULL)
+        return;
+
+    long long now = now_ms();
+    if (now < j->due_ms)
+        return;
+    j->due_ms = now + JOURNAL_INTERVAL_MS;
+
+    pthread_mutex_lock(&j->lock);
+    int ready = j->ready;
+    time_t started = j->started;
+    pthread_mutex_unlock(&j->lock);
+
+    if (!idle || !ready || !j->changed)
+    {
+        /* dirty records need no flush, changes they name are newer than the watermark anyway */
+        if (j->len > 0)
+            write_out(j);
+        return;
+    }
+
+    /* the first watermark of a run can't claim what happened before the copy or resume started */
+    time_t mark = (j->marked ? time(NULL) : started) - JOURNAL_SLACK;
+    for (int i = 0; i < j->cnt; i++)
+    {
+        if (syncfs(j->fds[i]) != 0)
+            perror("journal");
+    }
+
+    j->len = 0;
+    set_clear(&j->dirty);
+    append_record(j, RECORD_MARK, mark, "");
+    for (int i = 0; i < j->cnt; i++)
+    {
+        if (ftruncate(j->fds[i], j->base) != 0)
+            perror("journal");
+    }
+    j->size = j->base;
+    write_out(j);
+    for (int i = 0; i < j->cnt; i++)
+        fdatasync(j->fds[i]);
+
+    j->changed = 0;
+    j->marked = 1;
+}
+
+/* returns: 1 if rel or a directory above it had events after the watermark of the journals on disk */
+int journal_dirty(journal *j, const char *rel)
+{
+    for (const char *p = rel;; p++)
+    {
+        if ((*p == '/' || *p == '\0') && set_find(&j->resume, rel, p - rel))
+            return 1;
+        if (*p == '\0')
+            return 0;
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef JR_H
+#define JR_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* file below the target root recording what a backup may not have applied yet */
+#define JOURNAL_NAME ".sop-journal"
+/* records are written at most this often, the watermark only when the backup is idle */
+#define JOURNAL_INTERVAL_MS 500
+/* a watermark trusts changes only up to this many seconds before it was taken,
+ * events still unread in the kernel queue then are covered on resume
+ */
+#define JOURNAL_SLACK 5
+
+/* a path with events since the last watermark */
+typedef struct JournalPath
+{
+    char *path;
+    struct JournalPath *next; /* hash chain */
+} journal_path;
+
+typedef struct JournalSet
+{
+    journal_path **buckets;
+    size_t bucket_cnt;
+    size_t cnt;
+} journal_set;
+
+/* journals of all targets of one backup, identical files written together: a source
+ * record, the last watermark and the paths with events since, appended in batches
+ */
+typedef struct Journal
+{
+    int cnt;
+    int *fds;
+    off_t base; /* end of the source record, a new watermark replaces everything after it */
+    off_t size;
+    char *buf; /* records not written yet */
+    size_t len;
+    size_t cap;
+    journal_set dirty;  /* paths noted since the last watermark, event loop only */
+    journal_set resume; /* paths the journals on disk had events for after their watermark, read-only */
+    int found;          /* a target already held a journal of this source */
+    int resumable;      /* every target did, with a watermark */
+    time_t watermark;   /* the oldest one found */
+    int changed;        /* something to cover by the next watermark */
+    int marked;         /* a watermark was written in this run */
+    long long due_ms;
+    pthread_mutex_t lock; /* guards the two below, the engine finishes initial copies on its own threads */
+    int ready;            /* the initial copy or resume is over */
+    time_t started;       /* when it began, the first watermark can't be newer */
+} journal;
+
+int journal_matches(const char *, const char *);
+
+journal *journal_open(const char *, char **, int);
+
+void journal_close(journal *);
+
+void journal_note(journal *, const char *);
+
+void journal_ready(journal *);
+
+int journal_timeout(journal *);
+
+void journal_tick(journal *, int);
+
+int journal_dirty(journal *, const char *);
+
+#endif
@@ -8,7 +8,13 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "dedup.h"
+#include "engine.h"
 #include "fileproc.h"
+#include "opts.h"
+#include "restore.h"
+#include "snapshot.h"
+#include "stats.h"
 #include "synchro.h"
 #include "utils.h"
 #include "worker.h"
@@ -33,6 +39,8 @@ void collectDeadWorkers(workerList *workers)
             return;
 
         delete_workers_by_pid(pid, workers);
+        stats_release_pid(pid);
+        engine_reaped(pid);
         i++;
     }
 }
@@ -50,6 +58,7 @@ int main()
 
     workerList *workers;
     init_workerList(&workers);
+    stats_init();
 
     char line[10 * PATH_MAX];
     while (!END)
@@ -70,24 +79,68 @@ int main()
 
         /* check if any of workers died */
         collectDeadWorkers(workers);
+        engine_collect(workers);
 
         if (strcmp(cmd, "add") == 0)
         {
-            if (argc < 3)
+            backup_opts opts;
+            int first = parse_backup_opts(argc, argv, &opts);
+
+            if (first == -1 || argc - first < 2)
             {
-                printf("usage: add <source path> <target paths>\n");
+                printf("usage: add [-f] [-E] [-i|-c] [-F] [-u] [-O] [-z] [-p] [-J] [-d MiB] [-D store] [-j threads] "
+                       "[-w ms] <source path> <target paths>\n");
                 free(argv);
                 continue;
             }
 
-            for (int i = 2; i < argc; i++)
+            char *src = argv[first];
+            char **dsts = argv + first + 1;
+            int dst_cnt = 0;
+
+            for (int i = 0; dsts[i] != NULL; i++)
             {
-                if (prep_dirs(argv[1], argv[i], workers) == -1)
+                if (prep_dirs(src, dsts[i], workers, &opts) == -1)
                 {
                     printf("invalid arguments.\n");
                     break;
                 }
 
+                if (opts.fan_out || opts.engine)
+                {
+                    dsts[dst_cnt++] = dsts[i];
+                    continue;
+                }
+
+                int stats = stats_claim();
+                pid_t pid = fork();
+                if (pid < 0)
+                {
+                    ERR("fork");
+                }
+                else if (pid == 0)
+                {
+                    setHandler(SIG_DFL, SIGTERM);
+                    stats_attach(stats);
+                    backup_work(src, dsts + i, 1, &opts);
+                    exit(EXIT_SUCCESS);
+                }
+
+                stats_set_pid(stats, pid);
+                add_worker(src, dsts[i], pid, 0, stats, -1, workers);
+            }
+
+            /* the engine process runs the backups next to all its others, without -f one per target */
+            if (opts.engine)
+            {
+                int per_backup = opts.fan_out ? dst_cnt : 1;
+                for (int i = 0; i < dst_cnt; i += per_backup)
+                    engine_add(src, dsts + i, per_backup, &opts, workers);
+            }
+            /* one process reads the source for all accepted targets */
+            else if (opts.fan_out && dst_cnt > 0)
+            {
+                int stats = stats_claim();
                 pid_t pid = fork();
                 if (pid < 0)
                 {
@@ -96,11 +149,14 @@ int main()
                 else if (pid == 0)
                 {
                     setHandler(SIG_DFL, SIGTERM);
-                    backup_work(argv[1], argv[i]);
+                    stats_attach(stats);
+                    backup_work(src, dsts, dst_cnt, &opts);
                     exit(EXIT_SUCCESS);
                 }
 
-                add_worker(argv[1], argv[i], pid, workers);
+                stats_set_pid(stats, pid);
+                for (int i = 0; i < dst_cnt; i++)
+                    add_worker(src, dsts[i], pid, i, stats, -1, workers);
             }
         }
         else if (strcmp(cmd, "end") == 0)
@@ -121,20 +177,72 @@ int main()
         {
             display_workerList(workers);
         }
+        else if (strcmp(cmd, "stats") == 0)
+        {
+            display_worker_stats(workers);
+        }
         else if (strcmp(cmd, "exit") == 0)
         {
             free(argv);
             break;
         }
+        else if (strcmp(cmd, "snapshot") == 0)
+        {
+            long keep = 0;
+            int first = parse_number_opt(argc, argv, 'k', &keep);
+
+            if (first == -1 || argc - first < 1)
+            {
+                printf("usage: snapshot [-k generations] <target paths>.\n");
+                free(argv);
+                continue;
+            }
+
+            for (int i = first; i < argc; i++)
+            {
+                if (snapshot_take(argv[i], keep) == -1)
+                    printf("invalid arguments.\n");
+            }
+        }
+        else if (strcmp(cmd, "gc") == 0)
+        {
+            if (argc != 2)
+            {
+                printf("usage: gc <store path>.\n");
+                free(argv);
+                continue;
+            }
+
+            if (dedup_gc(argv[1], stdout) != 0)
+                printf("invalid arguments.\n");
+        }
+        else if (strcmp(cmd, "echo") == 0)
+        {
+            /* answered in order with the others, so a script can tell its earlier commands are done */
+            for (int i = 1; i < argc; i++)
+                printf("%s%s", argv[i], i + 1 < argc ? " " : "");
+            printf("\n");
+        }
         else if (strcmp(cmd, "restore") == 0)
         {
-            if (argc != 3)
+            char generation[PATH_MAX];
+            long gen = 0;
+            int first = parse_number_opt(argc, argv, 'g', &gen);
+
+            if (first == -1 || argc - first != 2)
             {
-                printf("usage: restore <source path> <target path>.\n");
+                printf("usage: restore [-g generation] <source path> <target path>.\n");
                 free(argv);
                 continue;
             }
-            restore(argv[1], argv[2]);
+
+            /* a generation is a complete tree of its own */
+            if (gen == 0)
+                restore(argv[first], argv[first + 1]);
+            else if (snapshot_path(generation, sizeof(generation), argv[first + 1], gen) == 0)
+                restore(argv[first], generation);
+            else
+                printf("invalid arguments.\n");
         }
         else
         {
@@ -0,0 +1,129 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "opts.h"
+#include "pool.h"
+
+void init_backup_opts(backup_opts *opts)
+{
+    opts->fan_out = 0;
+    opts->threads = pool_default_threads();
+    opts->incremental = 0;
+    opts->verify = 0;
+    opts->fanotify = 0;
+    opts->debounce_ms = 0;
+    opts->uring = 0;
+    opts->delta_mib = 0;
+    opts->store = NULL;
+    opts->direct = 0;
+    opts->engine = 0;
+    opts->compress = 0;
+    opts->pack = 0;
+    opts->journal = 0;
+}
+
+/* parse options following the command in argv[0]
+ * returns: index of the first non-option argument, -1 on invalid option
+ */
+int parse_backup_opts(int argc, char **argv, backup_opts *opts)
+{
+    int opt;
+
+    init_backup_opts(opts);
+
+    /* options come right after the command */
+    optind = 0;
+    while ((opt = getopt(argc, argv, "+fj:icFw:ud:D:OEzpJ")) != -1)
+    {
+        switch (opt)
+        {
+            case 'f':
+                opts->fan_out = 1;
+                break;
+            case 'j':
+                opts->threads = atoi(optarg);
+                if (opts->threads < 1)
+                    return -1;
+                break;
+            case 'i':
+                opts->incremental = 1;
+                break;
+            case 'c':
+                opts->incremental = 1;
+                opts->verify = 1;
+                break;
+            case 'F':
+                opts->fanotify = 1;
+                break;
+            case 'w':
+                opts->debounce_ms = atol(optarg);
+                if (opts->debounce_ms < 0)
+                    return -1;
+                break;
+            case 'u':
+                opts->uring = 1;
+                break;
+            case 'd':
+                opts->delta_mib = atol(optarg);
+                if (opts->delta_mib < 1)
+                    return -1;
+                break;
+            case 'D':
+                opts->store = optarg;
+                break;
+            case 'O':
+                opts->direct = 1;
+                break;
+            case 'E':
+                opts->engine = 1;
+                break;
+            case 'z':
+                opts->compress = 1;
+                break;
+            case 'p':
+                opts->pack = 1;
+                break;
+            case 'J':
+                opts->journal = 1;
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    /* the engine process shares one I/O policy between all its backups */
+    if (opts->engine && opts->direct)
+        return -1;
+
+    /* block deltas patch plain replicas and recipes hold no file data to compress */
+    if (opts->compress && (opts->delta_mib || opts->store))
+        return -1;
+
+    /* with a store every target file already is a small recipe */
+    if (opts->pack && opts->store)
+        return -1;
+
+    return optind;
+}
+
+/* parse the single numeric option flag of commands other than add, value is left alone when it isn't given
+ * returns: index of the first non-option argument, -1 on invalid option or a value below 1
+ */
+int parse_number_opt(int argc, char **argv, char flag, long *value)
+{
+    char optstring[] = {'+', flag, ':', '\0'};
+    int opt;
+
+    optind = 0;
+    while ((opt = getopt(argc, argv, optstring)) != -1)
+    {
+        if (opt != flag)
+            return -1;
+        *value = atol(optarg);
+        if (*value < 1)
+            return -1;
+    }
+    return optind;
+}
@@ -0,0 +1,29 @@
+#ifndef OPTS_H
+#define OPTS_H
+
+/* per-backup settings given as options of the add command */
+typedef struct BackupOpts
+{
+    int fan_out;
+    int threads;
+    int incremental; /* accept a non-empty target and copy only the difference */
+    int verify;      /* incremental also compares content hashes */
+    int fanotify;    /* watch the source filesystem instead of every directory */
+    long debounce_ms; /* quiet window before a changed path is copied, 0 copies at once */
+    int uring;        /* batch small files through io_uring when the kernel allows */
+    long delta_mib;   /* files of at least this many MiB are updated block by block, 0 disables */
+    char *store;      /* chunk store directory for deduplicated targets, NULL keeps plain mirrors */
+    int direct;       /* copy very large files with O_DIRECT, past the page cache */
+    int engine;       /* run inside the shared engine process instead of a process of its own */
+    int compress;     /* write compressible files to the targets compressed */
+    int pack;         /* append small files to pack files on the targets instead of creating them */
+    int journal;      /* journal changes in the targets, a backup added again resumes from there */
+} backup_opts;
+
+void init_backup_opts(backup_opts *);
+
+int parse_backup_opts(int, char **, backup_opts *);
+
+int parse_number_opt(int, char **, char, long *);
+
+#endif
@@ -0,0 +1,726 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "copyeng.h"
+#include "fileproc.h"
+#include "hash.h"
+#include "pack.h"
+#include "utils.h"
+
+#define PACK_BUCKETS 1024
+#define INDEX_MAGIC "#sop-backup pack index 1\n"
+/* len of a record that removes its path */
+#define RECORD_GONE UINT32_MAX
+/* the index is rewritten once it holds this many records more than twice the live entries */
+#define INDEX_SLACK 4096
+
+/* one index record, followed by path_len bytes of path */
+typedef struct PackRecord
+{
+    uint32_t pack;
+    uint32_t len;
+    uint64_t offset;
+    int64_t atime_sec;
+    int64_t mtime_sec;
+    uint32_t atime_nsec;
+    uint32_t mtime_nsec;
+    uint32_t mode;
+    uint32_t path_len;
+} pack_record;
+
+static size_t bucket_of(pack_store *pk, const char *path)
+{
+    return hash64(path, strlen(path), HASH64_SEED) & (pk->bucket_cnt - 1);
+}
+
+static void pack_path(pack_store *pk, char *buf, size_t size, uint32_t pack)
+{
+    snprintf(buf, size, "%s/pack-%06u", pk->dir, pack);
+}
+
+/* returns: 1 if name is a pack of a pack directory, packs are only ever appended to under one name */
+int pack_data_file(const char *name)
+{
+    unsigned int pack;
+    return sscanf(name, "pack-%u", &pack) == 1;
+}
+
+static void free_entry(pack_entry *entry)
+{
+    free(entry->path);
+    free(entry);
+}
+
+static void grow_table(pack_store *pk)
+{
+    size_t cnt = pk->bucket_cnt * 2;
+    pack_entry **buckets = calloc(cnt, sizeof(pack_entry *));
+    if (buckets == NULL)
+        ERR("calloc");
+
+    for (size_t i = 0; i < pk->bucket_cnt; i++)
+    {
+        pack_entry *entry = pk->buckets[i];
+        while (entry)
+        {
+            pack_entry *next = entry->next;
+            size_t b = hash64(entry->path, strlen(entry->path), HASH64_SEED) & (cnt - 1);
+            entry->next = buckets[b];
+            buckets[b] = entry;
+            entry = next;
+        }
+    }
+    free(pk->buckets);
+    pk->buckets = buckets;
+    pk->bucket_cnt = cnt;
+}
+
+/* make room for the counters of pack */
+static void reserve_pack(pack_store *pk, uint32_t pack)
+{
+    if (pack < pk->pack_cap)
+        return;
+
+    uint32_t cap = pk->pack_cap ? pk->pack_cap : 16;
+    while (cap <= pack)
+        cap *= 2;
+    pk->total = realloc(pk->total, cap * sizeof(off_t));
+    pk->live = realloc(pk->live, cap * sizeof(off_t));
+    pk->fds = realloc(pk->fds, cap * sizeof(int));
+    if (pk->total == NULL || pk->live == NULL || pk->fds == NULL)
+        ERR("realloc");
+
+    for (uint32_t i = pk->pack_cap; i < cap; i++)
+    {
+        pk->total[i] = pk->live[i] = 0;
+        pk->fds[i] = -1;
+    }
+    pk->pack_cap = cap;
+}
+
+static pack_entry **find_link(pack_store *pk, const char *path)
+{
+    pack_entry **link = &pk->buckets[bucket_of(pk, path)];
+    while (*link && strcmp((*link)->path, path) != 0)
+        link = &(*link)->next;
+    return link;
+}
+
+/* point path at its new place, creating the entry when the path is new */
+static pack_entry *set_entry(pack_store *pk, const char *path, uint32_t pack, off_t offset, uint32_t len)
+{
+    pack_entry **link = find_link(pk, path);
+    pack_entry *entry = *link;
+
+    reserve_pack(pk, pack);
+    if (entry)
+    {
+        pk->live[entry->pack] -= entry->len;
+    }
+    else
+    {
+        entry = calloc(1, sizeof(pack_entry));
+        if (entry == NULL || (entry->path = strdup(path)) == NULL)
+            ERR("calloc");
+        if (pk->cnt >= pk->bucket_cnt)
+        {
+            grow_table(pk);
+            link = find_link(pk, path);
+        }
+        *link = entry;
+        pk->cnt++;
+    }
+
+    entry->pack = pack;
+    entry->offset = offset;
+    entry->len = len;
+    pk->live[pack] += len;
+    return entry;
+}
+
+static void unlink_entry(pack_store *pk, pack_entry **link)
+{
+    pack_entry *entry = *link;
+
+    *link = entry->next;
+    pk->live[entry->pack] -= entry->len;
+    pk->cnt--;
+    free_entry(entry);
+}
+
+static int write_record(int fd, const pack_entry *entry, const char *path, uint32_t len)
+{
+    char buf[sizeof(pack_record) + PATH_MAX];
+    pack_record rec = {0};
+    size_t path_len = strlen(path);
+
+    if (path_len >= PATH_MAX)
+        return -1;
+
+    rec.len = len;
+    rec.path_len = (uint32_t)path_len;
+    if (entry)
+    {
+        rec.pack = entry->pack;
+        rec.offset = (uint64_t)entry->offset;
+        rec.atime_sec = entry->atime.tv_sec;
+        rec.atime_nsec = (uint32_t)entry->atime.tv_nsec;
+        rec.mtime_sec = entry->mtime.tv_sec;
+        rec.mtime_nsec = (uint32_t)entry->mtime.tv_nsec;
+        rec.mode = entry->mode;
+    }
+    memcpy(buf, &rec, sizeof(rec));
+    memcpy(buf + sizeof(rec), path, path_len);
+
+    /* one write per record so a crash leaves at most a torn last record */
+    size_t size = sizeof(rec) + path_len;
+    return bulk_write(fd, buf, size) == (ssize_t)size ? 0 : -1;
+}
+
+/* apply every record of the index, a torn record at the end is what a crash left and is ignored
+ * returns: 0 on success, -1 if the index can't be read
+ */
+static int replay_index(pack_store *pk, int fd)
+{
+    char path[PATH_MAX];
+    char magic[sizeof(INDEX_MAGIC) - 1];
+    pack_record rec;
+
+    ssize_t c = bulk_read(fd, magic, sizeof(magic));
+    if (c == 0)
+        return 0;
+    if (c != (ssize_t)sizeof(magic) || memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0)
+        return -1;
+
+    FILE *f = fdopen(dup(fd), "r");
+    if (f == NULL)
+        return -1;
+    fseeko(f, sizeof(magic), SEEK_SET);
+
+    while (fread(&rec, sizeof(rec), 1, f) == 1)
+    {
+        if (rec.path_len == 0 || rec.path_len >= PATH_MAX || fread(path, rec.path_len, 1, f) != 1)
+            break;
+        path[rec.path_len] = '\0';
+        pk->index_records++;
+
+        if (rec.len == RECORD_GONE)
+        {
+            pack_entry **link = find_link(pk, path);
+            if (*link)
+                unlink_entry(pk, link);
+            continue;
+        }
+
+        pack_entry *entry = set_entry(pk, path, rec.pack, (off_t)rec.offset, rec.len);
+        entry->mode = rec.mode;
+        entry->atime.tv_sec = rec.atime_sec;
+        entry->atime.tv_nsec = rec.atime_nsec;
+        entry->mtime.tv_sec = rec.mtime_sec;
+        entry->mtime.tv_nsec = rec.mtime_nsec;
+    }
+    fclose(f);
+    return 0;
+}
+
+/* learn the size of every pack on disk, appends go to a fresh pack after the last one */
+static int scan_packs(pack_store *pk)
+{
+    DIR *dir = opendir(pk->dir);
+    struct dirent *de;
+    unsigned int pack;
+    struct stat st;
+    char path[PATH_MAX];
+
+    if (dir == NULL)
+        return -1;
+
+    pk->cur = 0;
+    while ((de = readdir(dir)) != NULL)
+    {
+        if (sscanf(de->d_name, "pack-%u", &pack) != 1)
+            continue;
+        pack_path(pk, path, sizeof(path), pack);
+        if (stat(path, &st) != 0)
+            continue;
+
+        reserve_pack(pk, pack);
+        pk->total[pack] = st.st_size;
+        if (pack + 1 > pk->cur)
+            pk->cur = pack + 1;
+    }
+    closedir(dir);
+    return 0;
+}
+
+/* write the live entries to a new index and put it in place of the old one, lock held */
+static int rewrite_index(pack_store *pk)
+{
+    char path[PATH_MAX], tmp[PATH_MAX + 8];
+
+    snprintf(path, sizeof(path), "%s/" PACK_INDEX, pk->dir);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    int fd = TEMP_FAILURE_RETRY(open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0666));
+    if (fd < 0)
+        return -1;
+
+    int result = bulk_write(fd, INDEX_MAGIC, sizeof(INDEX_MAGIC) - 1) == (ssize_t)sizeof(INDEX_MAGIC) - 1 ? 0 : -1;
+    for (size_t i = 0; result == 0 && i < pk->bucket_cnt; i++)
+    {
+        for (pack_entry *entry = pk->buckets[i]; result == 0 && entry; entry = entry->next)
+            result = write_record(fd, entry, entry->path, entry->len);
+    }
+
+    if (result != 0 || rename(tmp, path) != 0)
+    {
+        TEMP_FAILURE_RETRY(close(fd));
+        unlink(tmp);
+        return -1;
+    }
+
+    if (pk->index_fd >= 0)
+        TEMP_FAILURE_RETRY(close(pk->index_fd));
+    pk->index_fd = fd;
+    pk->index_records = pk->cnt;
+    return 0;
+}
+
+/* returns: descriptor to read pack from, -1 if it can't be opened, lock held */
+static int read_fd(pack_store *pk, uint32_t pack)
+{
+    char path[PATH_MAX];
+
+    reserve_pack(pk, pack);
+    if (pk->fds[pack] < 0)
+    {
+        pack_path(pk, path, sizeof(path), pack);
+        pk->fds[pack] = TEMP_FAILURE_RETRY(open(path, O_RDONLY | O_CLOEXEC));
+    }
+    return pk->fds[pack];
+}
+
+/* append data as the new version of entry to the current pack and log it, lock held
+ * returns: 0 on success, -1 on a write error
+ */
+static int append_locked(pack_store *pk, const char *path, const char *data, uint32_t len, mode_t mode,
+                         const struct timespec *atime, const struct timespec *mtime)
+{
+    char name[PATH_MAX];
+
+    if (pk->cur_fd < 0 || pk->cur_size + len > PACK_SIZE)
+    {
+        if (pk->cur_fd >= 0)
+        {
+            TEMP_FAILURE_RETRY(close(pk->cur_fd));
+            pk->cur++;
+        }
+        pack_path(pk, name, sizeof(name), pk->cur);
+        pk->cur_fd = TEMP_FAILURE_RETRY(open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+        if (pk->cur_fd < 0)
+            return -1;
+        pk->cur_size = 0;
+        reserve_pack(pk, pk->cur);
+        pk->total[pk->cur] = 0;
+    }
+
+    /* data first, an index record never points at bytes that aren't there */
+    if (pwrite(pk->cur_fd, data, len, pk->cur_size) != (ssize_t)len)
+        return -1;
+
+    pack_entry *entry = set_entry(pk, path, pk->cur, pk->cur_size, len);
+    entry->mode = mode;
+    entry->atime = *atime;
+    entry->mtime = *mtime;
+    pk->cur_size += len;
+    pk->total[pk->cur] += len;
+
+    pk->index_records++;
+    return write_record(pk->index_fd, entry, path, len);
+}
+
+/* returns: a pack other than the current one that is at least half dead, -1 if there is none */
+static int64_t compaction_victim(pack_store *pk)
+{
+    for (uint32_t p = 0; p < pk->pack_cap && p < pk->cur; p++)
+    {
+        if (pk->total[p] > 0 && (pk->total[p] - pk->live[p]) * 2 >= pk->total[p])
+            return p;
+    }
+    return -1;
+}
+
+/* move what is still live in pack to the current pack and delete it, lock held but
+ * dropped between files so writers aren't held up for a whole pack
+ */
+static void compact_pack(pack_store *pk, uint32_t pack)
+{
+    char name[PATH_MAX];
+    char *data = malloc(PACK_FILE_MAX);
+    char **paths = NULL;
+    size_t cnt = 0, cap = 0;
+
+    if (data == NULL)
+        ERR("malloc");
+
+    for (size_t i = 0; i < pk->bucket_cnt; i++)
+    {
+        for (pack_entry *entry = pk->buckets[i]; entry; entry = entry->next)
+        {
+            if (entry->pack != pack)
+                continue;
+            if (cnt == cap)
+            {
+                cap = cap ? cap * 2 : 64;
+                paths = realloc(paths, cap * sizeof(char *));
+                if (paths == NULL)
+                    ERR("realloc");
+            }
+            if ((paths[cnt++] = strdup(entry->path)) == NULL)
+                ERR("strdup");
+        }
+    }
+
+    for (size_t i = 0; i < cnt; i++)
+    {
+        pack_entry *entry = *find_link(pk, paths[i]);
+
+        /* rewritten or dropped while the lock was released */
+        if (entry && entry->pack == pack)
+        {
+            int fd = read_fd(pk, pack);
+            if (fd < 0 || pread(fd, data, entry->len, entry->offset) != (ssize_t)entry->len ||
+                append_locked(pk, entry->path, data, entry->len, entry->mode, &entry->atime, &entry->mtime) != 0)
+            {
+                perror("pack compaction");
+                break;
+            }
+        }
+        free(paths[i]);
+        paths[i] = NULL;
+
+        pthread_mutex_unlock(&pk->lock);
+        pthread_mutex_lock(&pk->lock);
+    }
+
+    for (size_t i = 0; i < cnt; i++)
+        free(paths[i]);
+    free(paths);
+    free(data);
+
+    if (pk->live[pack] != 0)
+        return;
+    if (pk->fds[pack] >= 0)
+        TEMP_FAILURE_RETRY(close(pk->fds[pack]));
+    pk->fds[pack] = -1;
+    pack_path(pk, name, sizeof(name), pack);
+    unlink(name);
+    pk->total[pack] = 0;
+}
+
+/* background thread: rewrites packs that are mostly dead and an index that is mostly superseded */
+static void *compact_work(void *arg)
+{
+    pack_store *pk = arg;
+
+    pthread_mutex_lock(&pk->lock);
+    while (!pk->stop)
+    {
+        int64_t victim = compaction_victim(pk);
+        if (victim >= 0)
+        {
+            compact_pack(pk, (uint32_t)victim);
+            continue;
+        }
+
+        if (pk->index_records > 2 * pk->cnt + INDEX_SLACK)
+        {
+            if (rewrite_index(pk) != 0)
+                perror("pack index");
+            continue;
+        }
+        pthread_cond_wait(&pk->cond, &pk->lock);
+    }
+    pthread_mutex_unlock(&pk->lock);
+    return NULL;
+}
+
+/* wake the compactor when a pack or the index became worth rewriting, lock held */
+static void check_compaction(pack_store *pk, uint32_t pack)
+{
+    int dead_pack = pack < pk->cur && pk->total[pack] > 0 && (pk->total[pack] - pk->live[pack]) * 2 >= pk->total[pack];
+    if (dead_pack || pk->index_records > 2 * pk->cnt + INDEX_SLACK)
+        pthread_cond_signal(&pk->cond);
+}
+
+/* open the packs kept below base, writable creates them and starts the compactor
+ * returns: the store, NULL if base has no packs or they can't be read
+ */
+pack_store *pack_open(const char *base, int writable)
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    pack_store *pk = calloc(1, sizeof(pack_store));
+    if (pk == NULL)
+        ERR("calloc");
+    if (asprintf(&pk->dir, "%s/" PACK_DIR, base) < 0)
+        ERR("asprintf");
+
+    if (stat(pk->dir, &st) != 0 && (!writable || mkdir(pk->dir, 0777) != 0))
+    {
+        free(pk->dir);
+        free(pk);
+        return NULL;
+    }
+
+    pk->writable = writable;
+    pk->index_fd = -1;
+    pk->cur_fd = -1;
+    pk->bucket_cnt = PACK_BUCKETS;
+    pk->buckets = calloc(pk->bucket_cnt, sizeof(pack_entry *));
+    if (pk->buckets == NULL)
+        ERR("calloc");
+    pthread_mutex_init(&pk->lock, NULL);
+    pthread_cond_init(&pk->cond, NULL);
+
+    snprintf(path, sizeof(path), "%s/" PACK_INDEX, pk->dir);
+    int fd = TEMP_FAILURE_RETRY(open(path, writable ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0666));
+    if (fd < 0 || replay_index(pk, fd) != 0 || scan_packs(pk) != 0)
+    {
+        if (fd >= 0)
+            TEMP_FAILURE_RETRY(close(fd));
+        pk->stop = 1;
+        pack_close(pk);
+        return NULL;
+    }
+    TEMP_FAILURE_RETRY(close(fd));
+
+    if (!writable)
+        return pk;
+
+    /* a fresh index leaves out everything superseded, so the log starts small on every run */
+    if (rewrite_index(pk) != 0)
+    {
+        pk->stop = 1;
+        pack_close(pk);
+        return NULL;
+    }
+    if (pthread_create(&pk->compactor, NULL, compact_work, pk) != 0)
+        ERR("pthread_create");
+    return pk;
+}
+
+void pack_close(pack_store *pk)
+{
+    if (pk->writable && !pk->stop)
+    {
+        pthread_mutex_lock(&pk->lock);
+        pk->stop = 1;
+        pthread_cond_signal(&pk->cond);
+        pthread_mutex_unlock(&pk->lock);
+        pthread_join(pk->compactor, NULL);
+    }
+
+    for (size_t i = 0; i < pk->bucket_cnt; i++)
+    {
+        pack_entry *entry = pk->buckets[i];
+        while (entry)
+        {
+            pack_entry *next = entry->next;
+            free_entry(entry);
+            entry = next;
+        }
+    }
+    for (uint32_t p = 0; p < pk->pack_cap; p++)
+    {
+        if (pk->fds[p] >= 0)
+            TEMP_FAILURE_RETRY(close(pk->fds[p]));
+    }
+    if (pk->cur_fd >= 0)
+        TEMP_FAILURE_RETRY(close(pk->cur_fd));
+    if (pk->index_fd >= 0)
+        TEMP_FAILURE_RETRY(close(pk->index_fd));
+
+    pthread_mutex_destroy(&pk->lock);
+    pthread_cond_destroy(&pk->cond);
+    free(pk->total);
+    free(pk->live);
+    free(pk->fds);
+    free(pk->buckets);
+    free(pk->dir);
+    free(pk);
+}
+
+/* store len bytes of data as the content of path, with the metadata of st
+ * returns: 0 on success, -1 on a write error
+ */
+int pack_put(pack_store *pk, const char *path, const char *data, size_t len, const struct stat *st)
+{
+    pthread_mutex_lock(&pk->lock);
+    pack_entry *old = *find_link(pk, path);
+    uint32_t old_pack = old ? old->pack : pk->cur;
+    int result = append_locked(pk, path, data, (uint32_t)len, st->st_mode, &st->st_atim, &st->st_mtim);
+    check_compaction(pk, old_pack);
+    pthread_mutex_unlock(&pk->lock);
+    return result;
+}
+
+/* forget path, and with tree every path below it too */
+void pack_drop(pack_store *pk, const char *path, int tree)
+{
+    size_t len = strlen(path);
+
+    pthread_mutex_lock(&pk->lock);
+    if (!tree)
+    {
+        pack_entry **link = find_link(pk, path);
+        if (*link)
+        {
+            uint32_t pack = (*link)->pack;
+            unlink_entry(pk, link);
+            pk->index_records++;
+            if (write_record(pk->index_fd, NULL, path, RECORD_GONE) != 0)
+                perror("pack index");
+            check_compaction(pk, pack);
+        }
+        pthread_mutex_unlock(&pk->lock);
+        return;
+    }
+
+    for (size_t i = 0; i < pk->bucket_cnt; i++)
+    {
+        pack_entry **link = &pk->buckets[i];
+        while (*link)
+        {
+            pack_entry *entry = *link;
+            int below = strncmp(entry->path, path, len) == 0 && (entry->path[len] == '\0' || entry->path[len] == '/');
+            if (len > 0 && !below)
+            {
+                link = &entry->next;
+                continue;
+            }
+
+            uint32_t pack = entry->pack;
+            pk->index_records++;
+            if (write_record(pk->index_fd, NULL, entry->path, RECORD_GONE) != 0)
+                perror("pack index");
+            unlink_entry(pk, link);
+            check_compaction(pk, pack);
+        }
+    }
+    pthread_mutex_unlock(&pk->lock);
+}
+
+/* returns: 1 if path is packed with the size and mtime of st */
+int pack_current(pack_store *pk, const char *path, const struct stat *st)
+{
+    pthread_mutex_lock(&pk->lock);
+    pack_entry *entry = *find_link(pk, path);
+    int current = entry && entry->len == st->st_size && entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+                  entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+    pthread_mutex_unlock(&pk->lock);
+    return current;
+}
+
+/* returns: the entry of path, NULL if it isn't packed; only for stores nobody writes */
+const pack_entry *pack_find(pack_store *pk, const char *path)
+{
+    return *find_link(pk, path);
+}
+
+/* call fn for every packed file; only for stores nobody writes */
+void pack_foreach(pack_store *pk, pack_visit_fn fn, void *arg)
+{
+    for (size_t i = 0; i < pk->bucket_cnt; i++)
+    {
+        for (pack_entry *entry = pk->buckets[i]; entry; entry = entry->next)
+            fn(entry, arg);
+    }
+}
+
+/* drop packed files whose source below src_base no longer exists */
+void pack_prune(pack_store *pk, const char *src_base)
+{
+    char src[PATH_MAX];
+    struct stat st;
+    char **gone = NULL;
+    size_t cnt = 0, cap = 0;
+
+    pthread_mutex_lock(&pk->lock);
+    for (size_t i = 0; i < pk->bucket_cnt; i++)
+    {
+        for (pack_entry *entry = pk->buckets[i]; entry; entry = entry->next)
+        {
+            snprintf(src, sizeof(src), "%s/%s", src_base, entry->path);
+            if (lstat(src, &st) == 0 && S_ISREG(st.st_mode))
+                continue;
+            if (cnt == cap)
+            {
+                cap = cap ? cap * 2 : 64;
+                gone = realloc(gone, cap * sizeof(char *));
+                if (gone == NULL)
+                    ERR("realloc");
+            }
+            if ((gone[cnt++] = strdup(entry->path)) == NULL)
+                ERR("strdup");
+        }
+    }
+    pthread_mutex_unlock(&pk->lock);
+
+    for (size_t i = 0; i < cnt; i++)
+    {
+        pack_drop(pk, gone[i], 0);
+        free(gone[i]);
+    }
+    free(gone);
+}
+
+/* write the packed file of entry to dst with its times
+ * returns: 0 on success, -1 on error
+ */
+int pack_restore_entry(pack_store *pk, const pack_entry *entry, const char *dst)
+{
+    char data[PACK_FILE_MAX];
+
+    if (entry->len > PACK_FILE_MAX)
+    {
+        errno = EIO;
+        return -1;
+    }
+
+    pthread_mutex_lock(&pk->lock);
+    int fd = read_fd(pk, entry->pack);
+    pthread_mutex_unlock(&pk->lock);
+    if (fd < 0 || pread(fd, data, entry->len, entry->offset) != (ssize_t)entry->len)
+    {
+        if (fd >= 0)
+            errno = EIO;
+        return -1;
+    }
+
+    clear_target_entry(dst, 0);
+    int out = TEMP_FAILURE_RETRY(open(dst, O_WRONLY | O_CREAT | O_TRUNC, entry->mode & 0777));
+    if (out < 0)
+        return -1;
+
+    int result = bulk_write(out, data, entry->len) == (ssize_t)entry->len ? 0 : -1;
+    if (result == 0)
+    {
+        struct timespec times[2] = {entry->atime, entry->mtime};
+        futimens(out, times);
+    }
+    TEMP_FAILURE_RETRY(close(out));
+    return result;
+}
@@ -0,0 +1,80 @@
+#ifndef PK_H
+#define PK_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* directory below the target root holding the packs and their index */
+#define PACK_DIR ".sop-packs"
+/* the index log inside PACK_DIR */
+#define PACK_INDEX "index"
+/* regular files up to this size go into a pack instead of a file of their own */
+#define PACK_FILE_MAX (16 * 1024)
+/* a pack takes no more appends once it is this large */
+#define PACK_SIZE ((off_t)64 << 20)
+
+/* where the current version of one small file lives */
+typedef struct PackEntry
+{
+    char *path; /* relative to the target root */
+    uint32_t pack;
+    uint32_t len;
+    off_t offset;
+    mode_t mode;
+    struct timespec atime;
+    struct timespec mtime;
+    struct PackEntry *next; /* hash chain */
+} pack_entry;
+
+/* packs of one target: append-only data files and an index log replayed on open,
+ * the latest record of a path wins and a compactor thread rewrites mostly dead packs
+ */
+typedef struct PackStore
+{
+    char *dir;
+    int writable;
+    pthread_mutex_t lock; /* guards everything below */
+    pthread_cond_t cond;  /* wakes the compactor */
+    pthread_t compactor;
+    int stop;
+    pack_entry **buckets;
+    size_t bucket_cnt;
+    size_t cnt;
+    int index_fd;
+    size_t index_records;
+    uint32_t cur; /* pack taking appends */
+    int cur_fd;
+    off_t cur_size;
+    uint32_t pack_cap;
+    off_t *total; /* bytes ever appended to each pack */
+    off_t *live;  /* bytes of each pack still referenced */
+    int *fds;     /* read descriptors, opened on demand */
+} pack_store;
+
+typedef void (*pack_visit_fn)(const pack_entry *, void *);
+
+pack_store *pack_open(const char *, int);
+
+void pack_close(pack_store *);
+
+int pack_put(pack_store *, const char *, const char *, size_t, const struct stat *);
+
+void pack_drop(pack_store *, const char *, int);
+
+int pack_current(pack_store *, const char *, const struct stat *);
+
+const pack_entry *pack_find(pack_store *, const char *);
+
+void pack_foreach(pack_store *, pack_visit_fn, void *);
+
+void pack_prune(pack_store *, const char *);
+
+int pack_restore_entry(pack_store *, const pack_entry *, const char *);
+
+int pack_data_file(const char *);
+
+#endif
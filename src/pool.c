@@ -0,0 +1,241 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "stats.h"
+#include "utils.h"
+
+#define DEQUE_INIT 64
+#define DEFAULT_THREADS_MAX 16
+
+typedef struct PoolSelf
+{
+    thread_pool *pool;
+    int idx;
+} pool_self;
+
+static _Thread_local pool_self self = {NULL, -1};
+
+typedef struct WorkerArg
+{
+    thread_pool *pool;
+    int idx;
+} worker_arg;
+
+static void deque_push(deque *dq, task t)
+{
+    pthread_mutex_lock(&dq->lock);
+    if (dq->size == dq->capacity)
+    {
+        size_t new_capacity = dq->capacity ? dq->capacity * 2 : DEQUE_INIT;
+        task *items = malloc(new_capacity * sizeof(task));
+        if (items == NULL)
+            ERR("malloc");
+
+        /* unroll the ring into the new buffer */
+        for (size_t i = 0; i < dq->size; i++)
+            items[i] = dq->items[(dq->head + i) % dq->capacity];
+
+        free(dq->items);
+        dq->items = items;
+        dq->capacity = new_capacity;
+        dq->head = 0;
+    }
+    dq->items[(dq->head + dq->size) % dq->capacity] = t;
+    dq->size++;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+/* owner end: newest task first, keeps split work hot in cache */
+static int deque_pop(deque *dq, task *t)
+{
+    int found = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->size > 0)
+    {
+        dq->size--;
+        *t = dq->items[(dq->head + dq->size) % dq->capacity];
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+/* thief end: oldest task first */
+static int deque_steal(deque *dq, task *t)
+{
+    int found = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->size > 0)
+    {
+        *t = dq->items[dq->head];
+        dq->head = (dq->head + 1) % dq->capacity;
+        dq->size--;
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static int take_task(thread_pool *pool, int idx, task *t)
+{
+    int found = deque_pop(&pool->deques[idx], t);
+
+    for (int i = 1; !found && i < pool->cnt; i++)
+        found = deque_steal(&pool->deques[(idx + i) % pool->cnt], t);
+
+    if (found)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->available--;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return found;
+}
+
+static void *pool_work(void *arg)
+{
+    worker_arg *wa = arg;
+    thread_pool *pool = wa->pool;
+    self.pool = pool;
+    self.idx = wa->idx;
+    free(wa);
+    stats_use(pool->stats);
+
+    for (;;)
+    {
+        task t;
+        if (take_task(pool, self.idx, &t))
+        {
+            t.fn(t.arg);
+
+            pthread_mutex_lock(&pool->lock);
+            if (--pool->outstanding == 0)
+                pthread_cond_broadcast(&pool->idle_cond);
+            pthread_cond_signal(&pool->space_cond);
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->available == 0 && !pool->stop)
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        int done = pool->stop && pool->available == 0;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (done)
+            break;
+    }
+
+    return NULL;
+}
+
+int pool_default_threads(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        return 1;
+    return cpus > DEFAULT_THREADS_MAX ? DEFAULT_THREADS_MAX : (int)cpus;
+}
+
+/* limit bounds the tasks outside submitters may have in flight, 0 for no bound */
+thread_pool *pool_create(int cnt, size_t limit)
+{
+    sigset_t all, old;
+
+    thread_pool *pool = calloc(1, sizeof(thread_pool));
+    if (pool == NULL)
+        ERR("calloc");
+
+    pool->cnt = cnt < 1 ? 1 : cnt;
+    pool->limit = limit;
+    pool->stats = stats_current();
+    pool->threads = calloc(pool->cnt, sizeof(pthread_t));
+    pool->deques = calloc(pool->cnt, sizeof(deque));
+    if (pool->threads == NULL || pool->deques == NULL)
+        ERR("calloc");
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+    pthread_cond_init(&pool->space_cond, NULL);
+
+    /* signals stay with the thread that created the pool */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (int i = 0; i < pool->cnt; i++)
+    {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+
+        worker_arg *wa = malloc(sizeof(worker_arg));
+        if (wa == NULL)
+            ERR("malloc");
+        wa->pool = pool;
+        wa->idx = i;
+        if (pthread_create(&pool->threads[i], NULL, pool_work, wa) != 0)
+            ERR("pthread_create");
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return pool;
+}
+
+/* pool threads push to their own deque, everybody else spreads round robin
+ * and waits while the pool is full, pool threads never wait so they can't deadlock
+ */
+void pool_submit(thread_pool *pool, task_fn fn, void *arg)
+{
+    task t = {fn, arg};
+    int idx;
+
+    pthread_mutex_lock(&pool->lock);
+    while (self.pool != pool && pool->limit && pool->outstanding >= pool->limit)
+        pthread_cond_wait(&pool->space_cond, &pool->lock);
+    pool->outstanding++;
+    idx = self.pool == pool ? self.idx : (int)(pool->next++ % pool->cnt);
+    pthread_mutex_unlock(&pool->lock);
+
+    deque_push(&pool->deques[idx], t);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->available++;
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* block until every submitted task, including ones spawned by tasks, finished */
+void pool_wait(thread_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->outstanding > 0)
+        pthread_cond_wait(&pool->idle_cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(thread_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->cnt; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].items);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->idle_cond);
+    pthread_cond_destroy(&pool->space_cond);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+}
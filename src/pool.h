@@ -0,0 +1,54 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+struct WorkerStats;
+
+typedef void (*task_fn)(void *);
+
+typedef struct Task
+{
+    task_fn fn;
+    void *arg;
+} task;
+
+/* per-thread deque, the owner works at the tail and thieves take from the head */
+typedef struct Deque
+{
+    pthread_mutex_t lock;
+    task *items;
+    size_t capacity;
+    size_t head;
+    size_t size;
+} deque;
+
+typedef struct ThreadPool
+{
+    int cnt;
+    pthread_t *threads;
+    deque *deques;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t idle_cond;
+    pthread_cond_t space_cond;
+    size_t available;
+    size_t outstanding;
+    size_t limit;
+    unsigned int next;
+    int stop;
+    struct WorkerStats *stats; /* pool threads count their copies where the creator does */
+} thread_pool;
+
+thread_pool *pool_create(int, size_t);
+
+void pool_submit(thread_pool *, task_fn, void *);
+
+void pool_wait(thread_pool *);
+
+void pool_destroy(thread_pool *);
+
+int pool_default_threads(void);
+
+#endif
@@ -0,0 +1,540 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "registry.h"
+#include "utils.h"
+#include "walk.h"
+
+#define EVENT_SIZE (sizeof(struct inotify_event))
+#define BUF_LEN (1024 * (EVENT_SIZE + 16)) * 4
+
+#define WATCH_MASK (IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF)
+/* how long a MOVED_FROM left at the end of the queue waits for its MOVED_TO */
+#define MOVE_PAIR_MS 10
+
+/* a MOVED_FROM waiting for the MOVED_TO with the same cookie */
+typedef struct WatchMove
+{
+    int pending;
+    uint32_t cookie;
+    int wd; /* directory the entry left */
+    int is_dir;
+    char name[NAME_MAX + 1];
+    char path[PATH_MAX];
+} watch_move;
+
+/* watch nodes of the directories currently open in the walk, by depth */
+typedef struct WatchCtx
+{
+    watch_registry *reg;
+    int deliver; /* entries found are changes too, they may predate the watches */
+    watch_node **nodes;
+    int depth_cap;
+} watch_ctx;
+
+/* changes found by walking a directory that appeared, for one interest */
+typedef struct TreeCtx
+{
+    watch_registry *reg;
+    watch_interest *in;
+} tree_ctx;
+
+static void deliver(watch_registry *, watch_interest *, sync_action, const char *);
+
+static int watch_entry(const walk_entry *entry, void *arg)
+{
+    watch_ctx *ctx = arg;
+
+    if (ctx->deliver)
+        deliver(ctx->reg, NULL, entry->type == DT_DIR ? SYNC_MKDIR : SYNC_COPY, entry->path);
+    if (entry->type != DT_DIR)
+        return WALK_CONTINUE;
+
+    int wd = inotify_add_watch(ctx->reg->fd, entry->path, WATCH_MASK);
+    if (wd < 0)
+        return WALK_SKIP;
+
+    if (entry->depth >= ctx->depth_cap)
+    {
+        ctx->depth_cap *= 2;
+        ctx->nodes = realloc(ctx->nodes, ctx->depth_cap * sizeof(watch_node *));
+        if (ctx->nodes == NULL)
+            ERR("realloc");
+    }
+    ctx->nodes[entry->depth] = watch_add(ctx->reg->table, wd, ctx->nodes[entry->depth - 1], entry->name);
+    return WALK_CONTINUE;
+}
+
+/* watch path and every directory below it, name is what the node is called under parent,
+ * with contents set everything below path is delivered as a change as well
+ * returns: node of path, NULL if it can't be watched
+ */
+static watch_node *add_watches_recursive(watch_registry *reg, watch_node *parent, const char *path, const char *name,
+                                         int contents)
+{
+    int wd = inotify_add_watch(reg->fd, path, WATCH_MASK);
+    if (wd < 0)
+        return NULL;
+
+    watch_ctx ctx = {reg, contents, malloc(16 * sizeof(watch_node *)), 16};
+    if (ctx.nodes == NULL)
+        ERR("malloc");
+    watch_node *node = ctx.nodes[0] = watch_add(reg->table, wd, parent, name);
+
+    walk_tree(path, 0, watch_entry, &ctx);
+    free(ctx.nodes);
+    return node;
+}
+
+static int tree_entry(const walk_entry *entry, void *arg)
+{
+    tree_ctx *ctx = arg;
+
+    deliver(ctx->reg, ctx->in, entry->type == DT_DIR ? SYNC_MKDIR : SYNC_COPY, entry->path);
+    return WALK_CONTINUE;
+}
+
+watch_registry *registry_create(void)
+{
+    watch_registry *reg = calloc(1, sizeof(watch_registry));
+    if (reg == NULL)
+        ERR("calloc");
+
+    reg->fd = inotify_init1(IN_CLOEXEC);
+    if (reg->fd < 0)
+    {
+        free(reg);
+        return NULL;
+    }
+    reg->table = watch_table_create();
+    reg->calm = time(NULL);
+    return reg;
+}
+
+void registry_destroy(watch_registry *reg)
+{
+    while (reg->interests)
+    {
+        watch_interest *in = reg->interests;
+        reg->interests = in->next;
+        while (in->subs)
+        {
+            watch_sub *sub = in->subs;
+            in->subs = sub->next;
+            free(sub->src);
+            free(sub);
+        }
+        free(in->path);
+        free(in);
+    }
+
+    watch_table_destroy(reg->table);
+    close(reg->fd);
+    free(reg->roots);
+    free(reg);
+}
+
+/* returns: 1 if path is dir or lies below it */
+static int path_within(const char *path, const char *dir, size_t dir_len)
+{
+    return strncmp(path, dir, dir_len) == 0 && (path[dir_len] == '/' || path[dir_len] == '\0');
+}
+
+/* keep only nodes that are still roots, a wider root may have adopted some */
+static void prune_roots(watch_registry *reg)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < reg->root_cnt; i++)
+    {
+        if (reg->roots[i]->parent == NULL && watch_find(reg->table, reg->roots[i]->wd) == reg->roots[i])
+            reg->roots[kept++] = reg->roots[i];
+    }
+    reg->root_cnt = kept;
+}
+
+/* make sure path and everything below it is watched
+ * returns: 0 on success, -1 if path can't be watched
+ */
+static int watch_tree(watch_registry *reg, const char *path)
+{
+    for (size_t i = 0; i < reg->root_cnt; i++)
+    {
+        if (path_within(path, reg->roots[i]->name, strlen(reg->roots[i]->name)))
+            return 0;
+    }
+
+    /* roots inside path get the same wds again and move below the new root */
+    watch_node *root = add_watches_recursive(reg, NULL, path, path, 0);
+    if (root == NULL)
+        return -1;
+
+    prune_roots(reg);
+    if (reg->root_cnt == reg->root_cap)
+    {
+        reg->root_cap = reg->root_cap ? reg->root_cap * 2 : 16;
+        reg->roots = realloc(reg->roots, reg->root_cap * sizeof(watch_node *));
+        if (reg->roots == NULL)
+            ERR("realloc");
+    }
+    reg->roots[reg->root_cnt++] = root;
+    return 0;
+}
+
+/* deliver changes below src to co, a backup of a source already watched adds no watch at all
+ * returns: the subscription, NULL if src can't be watched
+ */
+watch_sub *registry_subscribe(watch_registry *reg, const char *src, coalescer *co, void *owner)
+{
+    char *path = realpath(src, NULL);
+    if (path == NULL || watch_tree(reg, path) != 0)
+    {
+        free(path);
+        return NULL;
+    }
+
+    watch_interest *in = reg->interests;
+    while (in && strcmp(in->path, path) != 0)
+        in = in->next;
+
+    if (in)
+    {
+        free(path);
+    }
+    else
+    {
+        in = calloc(1, sizeof(watch_interest));
+        if (in == NULL)
+            ERR("calloc");
+        in->path = path;
+        in->len = strlen(path);
+        in->next = reg->interests;
+        reg->interests = in;
+    }
+
+    watch_sub *sub = calloc(1, sizeof(watch_sub));
+    if (sub == NULL || (sub->src = strdup(src)) == NULL)
+        ERR("calloc");
+    sub->interest = in;
+    sub->co = co;
+    sub->stats = stats_current();
+    sub->owner = owner;
+    sub->next = in->subs;
+    in->subs = sub;
+    return sub;
+}
+
+/* stop delivering to sub, trees nobody is interested in any more lose their watches */
+void registry_unsubscribe(watch_registry *reg, watch_sub *sub)
+{
+    watch_interest *in = sub->interest;
+
+    watch_sub **link = &in->subs;
+    while (*link != sub)
+        link = &(*link)->next;
+    *link = sub->next;
+    free(sub->src);
+    free(sub);
+
+    if (in->subs)
+        return;
+
+    watch_interest **in_link = &reg->interests;
+    while (*in_link != in)
+        in_link = &(*in_link)->next;
+    *in_link = in->next;
+    free(in->path);
+    free(in);
+
+    /* a root still covering a narrower interest is kept whole */
+    size_t kept = 0;
+    for (size_t i = 0; i < reg->root_cnt; i++)
+    {
+        watch_node *root = reg->roots[i];
+        size_t root_len = strlen(root->name);
+        int wanted = 0;
+        for (watch_interest *other = reg->interests; other && !wanted; other = other->next)
+            wanted = path_within(other->path, root->name, root_len);
+
+        if (wanted)
+            reg->roots[kept++] = root;
+        else
+            watch_remove(reg->table, root, reg->fd);
+    }
+    reg->root_cnt = kept;
+}
+
+/* absolute path of entry name inside the directory of node, name may be empty
+ * returns: 0 on success, -1 if it doesn't fit into size
+ */
+static int node_path(watch_node *node, const char *name, char *buf, size_t size)
+{
+    char rel[PATH_MAX];
+    watch_node *root = node;
+
+    while (root->parent)
+        root = root->parent;
+    if (watch_rel_path(node, rel, sizeof(rel)) != 0)
+        return -1;
+
+    int len = snprintf(buf, size, "%s%s%s%s%s", root->name, *rel ? "/" : "", rel, *name ? "/" : "", name);
+    return len < 0 || (size_t)len >= size ? -1 : 0;
+}
+
+/* tell the owners of every backup whose source is the removed directory path or lies below it */
+static void report_gone(watch_registry *reg, const char *path, gone_fn gone)
+{
+    size_t len = strlen(path);
+
+    for (watch_interest *in = reg->interests; in; in = in->next)
+    {
+        if (!path_within(in->path, path, len))
+            continue;
+
+        for (watch_sub *sub = in->subs; sub; sub = sub->next)
+            gone(sub->owner);
+    }
+}
+
+/* source path of the entry rel_path below the source of sub
+ * returns: 0 on success, -1 if it doesn't fit, which counts as a dropped event
+ */
+static int sub_path(watch_sub *sub, const char *rel_path, char *buf, size_t size)
+{
+    if (snprintf(buf, size, "%s/%s", sub->src, rel_path) < (int)size)
+        return 0;
+    stats_add(STAT_DROPPED, 1);
+    return -1;
+}
+
+/* hand one change to every backup whose source contains path, or to those of only when it is set */
+static void deliver(watch_registry *reg, watch_interest *only, sync_action action, const char *path)
+{
+    char full_src_path[PATH_MAX];
+
+    for (watch_interest *in = only ? only : reg->interests; in; in = only ? NULL : in->next)
+    {
+        if (!path_within(path, in->path, in->len) || path[in->len] == '\0')
+            continue;
+
+        for (watch_sub *sub = in->subs; sub; sub = sub->next)
+        {
+            stats_use(sub->stats);
+
+            const char *rel_path = path + in->len + 1;
+            if (sub_path(sub, rel_path, full_src_path, sizeof(full_src_path)) == 0)
+                coalesce_change(sub->co, action, full_src_path, rel_path);
+        }
+    }
+}
+
+/* hand a move from one path to another to every backup whose source contains either, a backup
+ * that sees only one side gets a removal or the entry with all it holds
+ */
+static void deliver_move(watch_registry *reg, const char *from, const char *to, int is_dir)
+{
+    char full_src_path[PATH_MAX];
+
+    for (watch_interest *in = reg->interests; in; in = in->next)
+    {
+        int had = path_within(from, in->path, in->len) && from[in->len] != '\0';
+        int has = path_within(to, in->path, in->len) && to[in->len] != '\0';
+
+        if (had && !has)
+        {
+            deliver(reg, in, SYNC_REMOVE, from);
+        }
+        else if (has && !had)
+        {
+            tree_ctx ctx = {reg, in};
+            deliver(reg, in, is_dir ? SYNC_MKDIR : SYNC_COPY, to);
+            if (is_dir)
+                walk_tree(to, 0, tree_entry, &ctx);
+        }
+        else if (had && has)
+        {
+            for (watch_sub *sub = in->subs; sub; sub = sub->next)
+            {
+                stats_use(sub->stats);
+                if (sub_path(sub, to + in->len + 1, full_src_path, sizeof(full_src_path)) == 0)
+                    coalesce_rename(sub->co, from + in->len + 1, full_src_path, to + in->len + 1);
+            }
+        }
+    }
+}
+
+/* lost says the kernel dropped events, every backup rescans what changed since the queue was last empty */
+static void count_dropped(watch_registry *reg, int lost)
+{
+    for (watch_interest *in = reg->interests; in; in = in->next)
+    {
+        for (watch_sub *sub = in->subs; sub; sub = sub->next)
+        {
+            stats_use(sub->stats);
+            stats_add(STAT_DROPPED, 1);
+            if (lost)
+                coalesce_lost(sub->co, reg->calm - RESCAN_SLACK);
+        }
+    }
+}
+
+/* an entry left the watched tree, or its MOVED_TO never came */
+static void moved_out(watch_registry *reg, watch_move *move, gone_fn gone)
+{
+    move->pending = 0;
+    if (move->is_dir)
+    {
+        /* a moved-out subtree keeps its kernel watches unless dropped here */
+        watch_node *node = watch_find(reg->table, move->wd);
+        watch_node *child = node ? watch_child(node, move->name) : NULL;
+        if (child)
+            watch_remove(reg->table, child, reg->fd);
+    }
+
+    deliver(reg, NULL, SYNC_REMOVE, move->path);
+    if (move->is_dir)
+        report_gone(reg, move->path, gone);
+}
+
+/* an entry appeared in the directory of node, a directory is watched and delivered with its contents */
+static void moved_in(watch_registry *reg, watch_node *node, const char *path, const char *name, int is_dir)
+{
+    if (!is_dir)
+    {
+        deliver(reg, NULL, SYNC_COPY, path);
+        return;
+    }
+    deliver(reg, NULL, SYNC_MKDIR, path);
+    add_watches_recursive(reg, node, path, name, 1);
+}
+
+/* both ends of a move are watched, the watches of a moved directory keep their wds and only move in the
+ * tree, so the targets can rename instead of copying again
+ */
+static void moved_within(watch_registry *reg, watch_move *move, watch_node *node, const char *path, const char *name,
+                         gone_fn gone)
+{
+    move->pending = 0;
+    if (move->is_dir)
+    {
+        watch_node *from = watch_find(reg->table, move->wd);
+        watch_node *child = from ? watch_child(from, move->name) : NULL;
+        if (child)
+            watch_add(reg->table, child->wd, node, name);
+        else
+            add_watches_recursive(reg, node, path, name, 0);
+    }
+
+    deliver_move(reg, move->path, path, move->is_dir);
+    if (move->is_dir)
+        report_gone(reg, move->path, gone);
+}
+
+static void dispatch_event(watch_registry *reg, struct inotify_event *event, watch_move *move, gone_fn gone)
+{
+    char path[PATH_MAX];
+
+    /* the kernel queues both halves of a rename back to back */
+    int paired = move->pending && (event->mask & IN_MOVED_TO) && event->cookie == move->cookie;
+    if (move->pending && !paired)
+        moved_out(reg, move, gone);
+
+    watch_node *node = watch_find(reg->table, event->wd);
+
+    /* the kernel queue overflowed, or the event is for a directory we no longer track */
+    if ((event->mask & IN_Q_OVERFLOW) || (event->len && node == NULL))
+        count_dropped(reg, (event->mask & IN_Q_OVERFLOW) != 0);
+    if (node == NULL || node_path(node, event->len ? event->name : "", path, sizeof(path)) != 0)
+    {
+        if (paired)
+            moved_out(reg, move, gone);
+        return;
+    }
+
+    if (event->len == 0)
+    {
+        if (event->mask & IN_DELETE_SELF)
+            report_gone(reg, path, gone);
+
+        /* kernel dropped the watch, forget the directory */
+        if (event->mask & IN_IGNORED)
+        {
+            watch_remove(reg->table, node, -1);
+            prune_roots(reg);
+        }
+        return;
+    }
+
+    int is_dir = (event->mask & IN_ISDIR) != 0;
+    if (paired)
+    {
+        moved_within(reg, move, node, path, event->name, gone);
+    }
+    else if (event->mask & IN_MOVED_FROM)
+    {
+        move->pending = 1;
+        move->cookie = event->cookie;
+        move->wd = event->wd;
+        move->is_dir = is_dir;
+        snprintf(move->name, sizeof(move->name), "%s", event->name);
+        snprintf(move->path, sizeof(move->path), "%s", path);
+    }
+    else if (event->mask & (IN_CREATE | IN_MOVED_TO))
+    {
+        /* a created file is copied on IN_CLOSE_WRITE, a created directory may already have contents */
+        if (is_dir || (event->mask & IN_MOVED_TO))
+            moved_in(reg, node, path, event->name, is_dir);
+    }
+    else if (event->mask & IN_CLOSE_WRITE)
+    {
+        deliver(reg, NULL, SYNC_COPY, path);
+    }
+    else if (event->mask & IN_DELETE)
+    {
+        if (is_dir)
+        {
+            watch_node *child = watch_child(node, event->name);
+            if (child)
+                watch_remove(reg->table, child, reg->fd);
+        }
+        deliver(reg, NULL, SYNC_REMOVE, path);
+        if (is_dir)
+            report_gone(reg, path, gone);
+    }
+}
+
+/* read what is queued on the registry and deliver every change once to each interested backup,
+ * gone is called for backups whose source disappeared, they must not be unsubscribed from within it
+ */
+void registry_dispatch(watch_registry *reg, gone_fn gone)
+{
+    char buffer[BUF_LEN];
+    struct pollfd pfd = {.fd = reg->fd, .events = POLLIN};
+    watch_move move = {0};
+    int length;
+
+    /* a rename split across reads is paired when the rest comes in time */
+    do
+    {
+        time_t now = time(NULL);
+        length = read(reg->fd, buffer, BUF_LEN);
+        for (int i = 0; i < length; i += EVENT_SIZE + ((struct inotify_event *)&buffer[i])->len)
+            dispatch_event(reg, (struct inotify_event *)&buffer[i], &move, gone);
+
+        /* room for one more event of any size means the read took everything queued */
+        if (length >= 0 && (size_t)length + EVENT_SIZE + NAME_MAX + 1 <= BUF_LEN)
+            reg->calm = now;
+    } while (length > 0 && move.pending && poll(&pfd, 1, MOVE_PAIR_MS) > 0);
+
+    if (move.pending)
+        moved_out(reg, &move, gone);
+    stats_use(NULL);
+}
@@ -0,0 +1,59 @@
+#ifndef RG_H
+#define RG_H
+
+#include <stddef.h>
+#include <time.h>
+
+#include "coalesce.h"
+#include "stats.h"
+#include "watch.h"
+
+struct WatchInterest;
+
+/* one backup receiving the changes below its source */
+typedef struct WatchSub
+{
+    struct WatchInterest *interest;
+    char *src; /* source path as the backup names it, changes are reported below it */
+    coalescer *co;
+    worker_stats *stats;
+    void *owner;
+    struct WatchSub *next;
+} watch_sub;
+
+/* backups of the same source directory, matched against each event once */
+typedef struct WatchInterest
+{
+    char *path; /* canonical */
+    size_t len;
+    watch_sub *subs;
+    struct WatchInterest *next;
+} watch_interest;
+
+/* one inotify instance whose watches are shared by every backup with an
+ * overlapping source, each directory is watched once however many backups want it
+ */
+typedef struct WatchRegistry
+{
+    int fd;
+    watch_table *table;
+    watch_node **roots; /* top watched directories, named by their canonical path */
+    size_t root_cnt;
+    size_t root_cap;
+    watch_interest *interests;
+    time_t calm; /* when a read last emptied the kernel queue, events lost later can't be older */
+} watch_registry;
+
+typedef void (*gone_fn)(void *);
+
+watch_registry *registry_create(void);
+
+void registry_destroy(watch_registry *);
+
+watch_sub *registry_subscribe(watch_registry *, const char *, coalescer *, void *);
+
+void registry_unsubscribe(watch_registry *, watch_sub *);
+
+void registry_dispatch(watch_registry *, gone_fn);
+
+#endif
@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "fileproc.h"
+#include "rescan.h"
+#include "utils.h"
+#include "walk.h"
+
+/* state of one walk over the source */
+typedef struct RescanWalk
+{
+    rescan *rs;
+    time_t mark;
+    char fresh[PATH_MAX]; /* directory a target lacks, everything below it is copied, empty if none */
+    size_t walked;
+    size_t listed;
+    size_t found;
+} rescan_walk;
+
+static void push(rescan_walk *w, sync_action action, const char *rel)
+{
+    rescan_item *item = malloc(sizeof(rescan_item));
+    if (item == NULL || (item->rel = strdup(rel)) == NULL)
+        ERR("malloc");
+    item->action = action;
+    item->next = NULL;
+
+    pthread_mutex_lock(&w->rs->lock);
+    if (w->rs->tail)
+        w->rs->tail->next = item;
+    else
+        w->rs->head = item;
+    w->rs->tail = item;
+    pthread_mutex_unlock(&w->rs->lock);
+    w->found++;
+}
+
+static int stopped(rescan *rs)
+{
+    pthread_mutex_lock(&rs->lock);
+    int stop = rs->stop;
+    pthread_mutex_unlock(&rs->lock);
+    return stop;
+}
+
+/* queue removals of what the targets have in directory rel but the source directory src_dir doesn't */
+static void list_targets(rescan_walk *w, const char *src_dir, const char *rel)
+{
+    fanout *fo = w->rs->fo;
+    char dst[PATH_MAX], path[PATH_MAX], child[PATH_MAX];
+    const char *name;
+    unsigned char type;
+    struct stat st;
+    dir_reader r;
+
+    w->listed++;
+    for (int i = 0; i < fo->cnt; i++)
+    {
+        target_path(dst, sizeof(dst), fo->targets[i].base, rel);
+        if (fo->targets[i].detached || dir_open(&r, AT_FDCWD, dst) != 0)
+            continue;
+
+        while (dir_next(&r, &name, &type) > 0)
+        {
+            if (rel[0] == '\0' && backup_own_entry(name))
+                continue;
+            snprintf(path, sizeof(path), "%s/%s", src_dir, name);
+            if (lstat(path, &st) == -1 && errno == ENOENT)
+            {
+                snprintf(child, sizeof(child), rel[0] == '\0' ? "%s%s" : "%s/%s", rel, name);
+                push(w, SYNC_REMOVE, child);
+            }
+        }
+        dir_close(&r);
+    }
+}
+
+/* walk callback over the source: entries whose ctime reached the mark are copied, directories
+ * whose mtime did may have lost entries the targets still hold
+ */
+static int rescan_entry(const walk_entry *entry, void *arg)
+{
+    rescan_walk *w = arg;
+    fanout *fo = w->rs->fo;
+    char dst[PATH_MAX];
+    struct stat st, dst_st;
+
+    if (stopped(w->rs))
+        return -1;
+
+    const char *rel = entry->path + entry->root_len;
+    if (*rel == '/')
+        rel++;
+
+    /* the walk is depth first, the first path outside the fresh directory ends it */
+    size_t fresh_len = strlen(w->fresh);
+    int fresh = fresh_len > 0 && strncmp(rel, w->fresh, fresh_len) == 0 && rel[fresh_len] == '/';
+    if (!fresh)
+        w->fresh[0] = '\0';
+
+    if (walk_stat(entry->dir_fd, entry->name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+        return WALK_CONTINUE;
+    w->walked++;
+
+    if (S_ISDIR(st.st_mode) && !fresh)
+    {
+        /* a directory moved in keeps the old times of everything below it */
+        for (int i = 0; i < fo->cnt && !fresh; i++)
+        {
+            target_path(dst, sizeof(dst), fo->targets[i].base, rel);
+            if (!fo->targets[i].detached && (lstat(dst, &dst_st) != 0 || !S_ISDIR(dst_st.st_mode)))
+            {
+                snprintf(w->fresh, sizeof(w->fresh), "%s", rel);
+                fresh = 1;
+            }
+        }
+        if (!fresh && st.st_mtim.tv_sec >= w->mark)
+            list_targets(w, entry->path, rel);
+    }
+
+    if (fresh || st.st_ctim.tv_sec >= w->mark)
+        push(w, S_ISDIR(st.st_mode) ? SYNC_MKDIR : SYNC_COPY, rel);
+    return WALK_CONTINUE;
+}
+
+static void check_packed(const pack_entry *entry, void *arg)
+{
+    rescan_walk *w = arg;
+    char src[PATH_MAX];
+    struct stat st;
+
+    snprintf(src, sizeof(src), "%s/%s", w->rs->fo->src_base, entry->path);
+    if (lstat(src, &st) == -1 && errno == ENOENT)
+        push(w, SYNC_REMOVE, entry->path);
+}
+
+/* one pass over the source, repeated while more events get lost */
+static void *rescan_work(void *arg)
+{
+    rescan *rs = arg;
+    fanout *fo = rs->fo;
+    struct stat st;
+    sigset_t mask;
+
+    /* signals are for the thread that started it */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    pthread_mutex_lock(&rs->lock);
+    while (!rs->stop)
+    {
+        rescan_walk w = {rs, rs->mark, "", 0, 0, 0};
+        rs->again = 0;
+        pthread_mutex_unlock(&rs->lock);
+
+        if (stat(fo->src_base, &st) == 0 && st.st_mtim.tv_sec >= w.mark)
+            list_targets(&w, fo->src_base, "");
+        walk_tree(fo->src_base, 0, rescan_entry, &w);
+
+        /* packed files have no directory on the target to list, their index is checked instead */
+        for (int i = 0; i < fo->cnt && w.listed > 0; i++)
+        {
+            pack_store *pk = fo->targets[i].pack;
+            if (pk == NULL || fo->targets[i].detached)
+                continue;
+            pthread_mutex_lock(&pk->lock);
+            pack_foreach(pk, check_packed, &w);
+            pthread_mutex_unlock(&pk->lock);
+        }
+
+        if (getenv("SOP_BACKUP_TRACE"))
+            fprintf(stderr, "rescan: %zu entries walked, %zu directories listed, %zu changes found\n", w.walked,
+                    w.listed, w.found);
+
+        pthread_mutex_lock(&rs->lock);
+        if (!rs->again)
+            break;
+    }
+    rs->running = 0;
+    pthread_mutex_unlock(&rs->lock);
+    return NULL;
+}
+
+rescan *rescan_create(fanout *fo)
+{
+    rescan *rs = calloc(1, sizeof(rescan));
+    if (rs == NULL)
+        ERR("calloc");
+    rs->fo = fo;
+    pthread_mutex_init(&rs->lock, NULL);
+    return rs;
+}
+
+/* stop a walk still running, whatever it found and nobody took is dropped */
+void rescan_destroy(rescan *rs)
+{
+    pthread_mutex_lock(&rs->lock);
+    rs->stop = 1;
+    pthread_mutex_unlock(&rs->lock);
+    if (rs->started)
+        pthread_join(rs->thread, NULL);
+
+    while (rs->head)
+    {
+        rescan_item *item = rs->head;
+        rs->head = item->next;
+        free(item->rel);
+        free(item);
+    }
+    pthread_mutex_destroy(&rs->lock);
+    free(rs);
+}
+
+/* compare everything changed at or after mark with the targets, a walk already
+ * running starts over from the older mark once it is done
+ */
+void rescan_request(rescan *rs, time_t mark)
+{
+    pthread_mutex_lock(&rs->lock);
+    if (rs->running)
+    {
+        if (mark < rs->mark)
+            rs->mark = mark;
+        rs->again = 1;
+        pthread_mutex_unlock(&rs->lock);
+        return;
+    }
+    rs->mark = mark;
+    rs->running = 1;
+    pthread_mutex_unlock(&rs->lock);
+
+    if (rs->started)
+        pthread_join(rs->thread, NULL);
+    if (pthread_create(&rs->thread, NULL, rescan_work, rs) != 0)
+        ERR("pthread_create");
+    rs->started = 1;
+}
+
+/* returns: the changes found since the last call, oldest first, for the caller to free */
+rescan_item *rescan_take(rescan *rs)
+{
+    pthread_mutex_lock(&rs->lock);
+    rescan_item *head = rs->head;
+    rs->head = rs->tail = NULL;
+    pthread_mutex_unlock(&rs->lock);
+    return head;
+}
+
+/* returns: 1 while a walk runs or what it found waits to be taken */
+int rescan_busy(rescan *rs)
+{
+    pthread_mutex_lock(&rs->lock);
+    int busy = rs->running || rs->head != NULL;
+    pthread_mutex_unlock(&rs->lock);
+    return busy;
+}
@@ -0,0 +1,51 @@
+#ifndef RS_H
+#define RS_H
+
+#include <pthread.h>
+#include <time.h>
+
+#include "fanout.h"
+#include "synchro.h"
+
+/* while a rescan runs, what it found is taken from it at least this often */
+#define RESCAN_POLL_MS 50
+/* a lost event may date from this many seconds before the last read that emptied the kernel queue */
+#define RESCAN_SLACK 2
+
+/* one change a rescan found, relative to the source */
+typedef struct RescanItem
+{
+    sync_action action;
+    char *rel;
+    struct RescanItem *next;
+} rescan_item;
+
+/* reconciliation of one backup whose events were lost: a thread walks the source beside the
+ * live events, entries changed since the mark are copied again and directories modified since
+ * are listed on the targets for what the source no longer has
+ */
+typedef struct Rescan
+{
+    fanout *fo;
+    pthread_t thread;
+    pthread_mutex_t lock; /* guards everything below */
+    int started;          /* the thread was created and not joined yet */
+    int running;          /* it is walking */
+    int again;            /* more was lost during the walk, it starts over */
+    int stop;
+    time_t mark;
+    rescan_item *head; /* found and not taken yet */
+    rescan_item *tail;
+} rescan;
+
+rescan *rescan_create(fanout *);
+
+void rescan_destroy(rescan *);
+
+void rescan_request(rescan *, time_t);
+
+rescan_item *rescan_take(rescan *);
+
+int rescan_busy(rescan *);
+
+#endif
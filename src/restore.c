@@ -0,0 +1,281 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "dedup.h"
+#include "fileproc.h"
+#include "journal.h"
+#include "pack.h"
+#include "pool.h"
+#include "restore.h"
+#include "snapshot.h"
+#include "utils.h"
+#include "walk.h"
+
+/* copies and removals waiting for a restore thread */
+#define RESTORE_QUEUE_MAX 1024
+
+/* what one entry of the restore directory needs to match the backup */
+typedef enum PlanOp
+{
+    PLAN_MKDIR,
+    PLAN_COPY,
+    PLAN_UNPACK,
+    PLAN_REMOVE
+} plan_op;
+
+typedef struct PlanStep
+{
+    plan_op op;
+    char *rel;
+} plan_step;
+
+typedef struct RestorePlan
+{
+    const char *backup_dir;
+    const char *restore_dir;
+    pack_store *pack; /* small files kept in packs of the backup, NULL if it has none */
+    plan_step *steps;
+    size_t cnt;
+    size_t capacity;
+    size_t counts[PLAN_REMOVE + 1];
+    size_t unchanged;
+} restore_plan;
+
+typedef struct RestoreJob
+{
+    restore_plan *plan;
+    plan_step *step;
+} restore_job;
+
+static void plan_add(restore_plan *plan, plan_op op, const char *rel)
+{
+    if (plan->cnt == plan->capacity)
+    {
+        plan->capacity = plan->capacity ? plan->capacity * 2 : 64;
+        plan->steps = realloc(plan->steps, plan->capacity * sizeof(plan_step));
+        if (plan->steps == NULL)
+            ERR("realloc");
+    }
+
+    plan_step *step = &plan->steps[plan->cnt++];
+    step->op = op;
+    if ((step->rel = strdup(rel)) == NULL)
+        ERR("strdup");
+    plan->counts[op]++;
+}
+
+static void join_path(char *buf, size_t size, const char *base, const char *rel)
+{
+    if (rel[0] == '\0' || base[0] == '\0')
+        snprintf(buf, size, "%s", rel[0] == '\0' ? base : rel);
+    else
+        snprintf(buf, size, "%s/%s", base, rel);
+}
+
+/* returns: 1 if the restore entry r_st (NULL when missing) already matches the backup entry b_st */
+static int entry_matches(restore_plan *plan, const char *rel, const struct stat *b_st, const struct stat *r_st)
+{
+    char backup_path[PATH_MAX], restore_path[PATH_MAX];
+
+    if (r_st == NULL || (b_st->st_mode & S_IFMT) != (r_st->st_mode & S_IFMT))
+        return 0;
+
+    int same_mtime = b_st->st_mtim.tv_sec == r_st->st_mtim.tv_sec && b_st->st_mtim.tv_nsec == r_st->st_mtim.tv_nsec;
+    if (S_ISREG(b_st->st_mode) && same_mtime && b_st->st_size == r_st->st_size)
+        return 1;
+    if (S_ISREG(b_st->st_mode) && !same_mtime)
+        return 0;
+
+    /* recipes and compressed copies match the rebuilt file when their recorded size does, links compare targets */
+    join_path(backup_path, sizeof(backup_path), plan->backup_dir, rel);
+    join_path(restore_path, sizeof(restore_path), plan->restore_dir, rel);
+    if (S_ISREG(b_st->st_mode))
+        return dedup_recipe_current(backup_path, r_st) || compress_current(backup_path, r_st);
+    return entry_unchanged(backup_path, b_st, restore_path, plan->backup_dir, plan->restore_dir, 0);
+}
+
+/* compare the backup directory listed by b with its restore counterpart r,
+ * whose fd is -1 when the restore side was no directory, rel names both
+ */
+static void plan_dir(restore_plan *plan, dir_reader *b, dir_reader *r, const char *rel)
+{
+    char child[PATH_MAX];
+    const char *name;
+    unsigned char type;
+
+    while (dir_next(b, &name, &type) > 0)
+    {
+        struct stat b_st, r_st;
+
+        if (rel[0] == '\0' &&
+            (strcmp(name, PACK_DIR) == 0 || strcmp(name, SNAPSHOT_DIR) == 0 || strcmp(name, JOURNAL_NAME) == 0))
+            continue;
+        join_path(child, sizeof(child), rel, name);
+        if (walk_stat(b->fd, name, &b_st, AT_SYMLINK_NOFOLLOW) == -1)
+            continue;
+        int exists = r->fd >= 0 && walk_stat(r->fd, name, &r_st, AT_SYMLINK_NOFOLLOW) == 0;
+
+        if (S_ISDIR(b_st.st_mode))
+        {
+            dir_reader b_child, r_child = {-1, NULL, 0, 0};
+            int is_dir = exists && S_ISDIR(r_st.st_mode);
+
+            if (!is_dir)
+                plan_add(plan, PLAN_MKDIR, child);
+            if (dir_open(&b_child, b->fd, name) != 0)
+                continue;
+            if (is_dir)
+                dir_open(&r_child, r->fd, name);
+
+            plan_dir(plan, &b_child, &r_child, child);
+            dir_close(&b_child);
+            dir_close(&r_child);
+            continue;
+        }
+
+        if (entry_matches(plan, child, &b_st, exists ? &r_st : NULL))
+            plan->unchanged++;
+        else
+            plan_add(plan, PLAN_COPY, child);
+    }
+
+    if (r->fd < 0)
+        return;
+
+    /* whatever the backup doesn't have, in its tree or its packs, is an extra left from after the backup */
+    while (dir_next(r, &name, &type) > 0)
+    {
+        struct stat st;
+
+        if (walk_stat(b->fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1 && errno == ENOENT)
+        {
+            join_path(child, sizeof(child), rel, name);
+            if (plan->pack == NULL || pack_find(plan->pack, child) == NULL)
+                plan_add(plan, PLAN_REMOVE, child);
+        }
+    }
+}
+
+/* pack_foreach callback: unpack a packed file unless the restore directory already has it */
+static void plan_packed(const pack_entry *entry, void *arg)
+{
+    restore_plan *plan = arg;
+    char restore_path[PATH_MAX];
+    struct stat st;
+
+    join_path(restore_path, sizeof(restore_path), plan->restore_dir, entry->path);
+    if (lstat(restore_path, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == entry->len &&
+        st.st_mtim.tv_sec == entry->mtime.tv_sec && st.st_mtim.tv_nsec == entry->mtime.tv_nsec)
+        plan->unchanged++;
+    else
+        plan_add(plan, PLAN_UNPACK, entry->path);
+}
+
+static void restore_task(void *arg)
+{
+    restore_job *job = arg;
+    restore_plan *plan = job->plan;
+    char backup_path[PATH_MAX], restore_path[PATH_MAX];
+    struct stat st;
+
+    join_path(backup_path, sizeof(backup_path), plan->backup_dir, job->step->rel);
+    join_path(restore_path, sizeof(restore_path), plan->restore_dir, job->step->rel);
+
+    if (job->step->op == PLAN_REMOVE)
+    {
+        remove_target_entry(restore_path);
+    }
+    else if (job->step->op == PLAN_UNPACK)
+    {
+        if (pack_restore_entry(plan->pack, pack_find(plan->pack, job->step->rel), restore_path) != 0)
+            perror("restore");
+    }
+    else if (lstat(backup_path, &st) == 0)
+    {
+        /* deduplicated backups hold recipes, compressed ones blocks, everything else is a plain copy */
+        int rebuilt = S_ISREG(st.st_mode) ? dedup_restore_file(backup_path, restore_path) : 0;
+        if (rebuilt == 0 && S_ISREG(st.st_mode))
+            rebuilt = compress_restore_file(backup_path, restore_path);
+        if (rebuilt == -1)
+            perror("restore");
+        else if (rebuilt == 0)
+            copy_single_file(backup_path, restore_path, plan->backup_dir, plan->restore_dir);
+    }
+    free(job);
+}
+
+/* make restore_dir match backup_dir: plan every difference in size, mtime or
+ * type first, listing both trees through directory descriptors and the pack
+ * index, then create directories in plan order and hand copies and removals
+ * to a thread pool, so the work depends on the damage only
+ */
+void restore(const char *restore_dir, const char *backup_dir)
+{
+    char path[PATH_MAX];
+    restore_plan plan = {0};
+
+    plan.backup_dir = backup_dir;
+    plan.restore_dir = restore_dir;
+
+    dir_reader b, r;
+    if (create_directories(restore_dir) != 0 || dir_open(&b, AT_FDCWD, backup_dir) != 0)
+        return;
+    if (dir_open(&r, AT_FDCWD, restore_dir) != 0)
+    {
+        dir_close(&b);
+        return;
+    }
+
+    plan.pack = pack_open(backup_dir, 0);
+    plan_dir(&plan, &b, &r, "");
+    dir_close(&b);
+    dir_close(&r);
+    if (plan.pack)
+        pack_foreach(plan.pack, plan_packed, &plan);
+
+    /* parents come before children in the plan, so creating in order is enough */
+    for (size_t i = 0; i < plan.cnt; i++)
+    {
+        if (plan.steps[i].op != PLAN_MKDIR)
+            continue;
+        join_path(path, sizeof(path), restore_dir, plan.steps[i].rel);
+        clear_target_entry(path, 1);
+        create_directories(path);
+    }
+
+    thread_pool *pool = pool_create(pool_default_threads(), RESTORE_QUEUE_MAX);
+    for (size_t i = 0; i < plan.cnt; i++)
+    {
+        if (plan.steps[i].op == PLAN_MKDIR)
+            continue;
+
+        restore_job *job = malloc(sizeof(restore_job));
+        if (job == NULL)
+            ERR("malloc");
+        job->plan = &plan;
+        job->step = &plan.steps[i];
+        pool_submit(pool, restore_task, job);
+    }
+    pool_wait(pool);
+    pool_destroy(pool);
+
+    if (getenv("SOP_BACKUP_TRACE"))
+        fprintf(stderr, "restore plan: %zu dirs, %zu copies, %zu unpacked, %zu removals, %zu unchanged\n",
+                plan.counts[PLAN_MKDIR], plan.counts[PLAN_COPY], plan.counts[PLAN_UNPACK], plan.counts[PLAN_REMOVE],
+                plan.unchanged);
+
+    for (size_t i = 0; i < plan.cnt; i++)
+        free(plan.steps[i].rel);
+    free(plan.steps);
+    if (plan.pack)
+        pack_close(plan.pack);
+}
@@ -0,0 +1,6 @@
+#ifndef RS_H
+#define RS_H
+
+void restore(const char *, const char *);
+
+#endif
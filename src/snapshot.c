@@ -0,0 +1,315 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "copyeng.h"
+#include "fileproc.h"
+#include "pack.h"
+#include "pool.h"
+#include "snapshot.h"
+#include "utils.h"
+#include "walk.h"
+
+/* copies waiting for a snapshot thread */
+#define SNAPSHOT_QUEUE_MAX 1024
+/* a generation is written under this suffix and renamed once complete */
+#define PARTIAL_SUFFIX ".tmp"
+
+/* one generation being written */
+typedef struct Snapshot
+{
+    const char *target;
+    char gen_dir[PATH_MAX];     /* name the generation will have, links inside the target are pointed here */
+    char tmp_dir[PATH_MAX + 8]; /* where it is written until complete */
+    thread_pool *pool;
+    size_t linked;
+    size_t copied;
+} snapshot;
+
+typedef struct SnapshotJob
+{
+    snapshot *snap;
+    char *src;
+    char *dst;
+} snapshot_job;
+
+static void join_path(char *buf, size_t size, const char *base, const char *rel)
+{
+    if (rel[0] == '\0' || base[0] == '\0')
+        snprintf(buf, size, "%s", rel[0] == '\0' ? base : rel);
+    else
+        snprintf(buf, size, "%s/%s", base, rel);
+}
+
+static int compare_generations(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+/* generation numbers found in snap_dir in ascending order, leftovers of interrupted snapshots are removed
+ * returns: count of generations with *gens allocated, -1 if snap_dir can't be listed
+ */
+static long list_generations(const char *snap_dir, long **gens)
+{
+    DIR *dir = opendir(snap_dir);
+    struct dirent *de;
+    char path[PATH_MAX];
+    long cnt = 0, cap = 0;
+
+    *gens = NULL;
+    if (dir == NULL)
+        return -1;
+
+    while ((de = readdir(dir)) != NULL)
+    {
+        char *end;
+        long gen = strtol(de->d_name, &end, 10);
+
+        if (end != de->d_name && gen > 0 && strcmp(end, PARTIAL_SUFFIX) == 0)
+        {
+            join_path(path, sizeof(path), snap_dir, de->d_name);
+            remove_target_entry(path);
+            continue;
+        }
+        if (end == de->d_name || gen <= 0 || *end != '\0')
+            continue;
+
+        if (cnt == cap)
+        {
+            cap = cap ? cap * 2 : 16;
+            *gens = realloc(*gens, cap * sizeof(long));
+            if (*gens == NULL)
+                ERR("realloc");
+        }
+        (*gens)[cnt++] = gen;
+    }
+    closedir(dir);
+
+    if (cnt > 0)
+        qsort(*gens, cnt, sizeof(long), compare_generations);
+    return cnt;
+}
+
+/* copy one target file into the generation, a file a running backup removes meanwhile is left out */
+static void copy_task(void *arg)
+{
+    snapshot_job *job = arg;
+    struct stat st;
+    copy_method method;
+
+    int src_fd = TEMP_FAILURE_RETRY(open(job->src, O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+    if (src_fd < 0 && errno == ELOOP)
+    {
+        copy_single_file(job->src, job->dst, job->snap->target, job->snap->gen_dir);
+    }
+    else if (src_fd >= 0)
+    {
+        int dst_fd = TEMP_FAILURE_RETRY(open(job->dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0777));
+        if (dst_fd < 0 || fstat(src_fd, &st) != 0 || copy_data(src_fd, dst_fd, st.st_size, &method) < 0)
+            perror("snapshot");
+        else
+            copy_times(dst_fd, &st);
+        if (dst_fd >= 0)
+            TEMP_FAILURE_RETRY(close(dst_fd));
+        TEMP_FAILURE_RETRY(close(src_fd));
+    }
+    free(job->src);
+    free(job->dst);
+    free(job);
+}
+
+static snapshot_job *new_job(snapshot *snap, const char *rel)
+{
+    char path[PATH_MAX];
+
+    snapshot_job *job = malloc(sizeof(snapshot_job));
+    if (job == NULL)
+        ERR("malloc");
+    job->snap = snap;
+    join_path(path, sizeof(path), snap->target, rel);
+    if ((job->src = strdup(path)) == NULL)
+        ERR("strdup");
+    join_path(path, sizeof(path), snap->tmp_dir, rel);
+    if ((job->dst = strdup(path)) == NULL)
+        ERR("strdup");
+    return job;
+}
+
+static void submit_copy(snapshot *snap, const char *rel)
+{
+    snap->copied++;
+    pool_submit(snap->pool, copy_task, new_job(snap, rel));
+}
+
+/* fill the generation directory new_fd from the target directory listed by cur, prev_fd is the
+ * same directory in the previous generation or -1, rel names all three
+ */
+static void snap_dir(snapshot *snap, dir_reader *cur, int prev_fd, int new_fd, const char *rel)
+{
+    char child[PATH_MAX];
+    const char *name;
+    unsigned char type;
+
+    /* the index is copied before any pack is linked, so every pack holds at least the bytes it refers to */
+    int packs = strcmp(rel, PACK_DIR) == 0;
+    if (packs)
+    {
+        join_path(child, sizeof(child), rel, PACK_INDEX);
+        snap->copied++;
+        copy_task(new_job(snap, child));
+    }
+
+    while (dir_next(cur, &name, &type) > 0)
+    {
+        struct stat st, prev_st;
+
+        /* the journal and the generations belong to the live target, the packs hold file data */
+        if (rel[0] == '\0' && backup_own_entry(name) && strcmp(name, PACK_DIR) != 0)
+            continue;
+        if (packs && strcmp(name, PACK_INDEX) == 0)
+            continue;
+        if (walk_stat(cur->fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+            continue;
+        join_path(child, sizeof(child), rel, name);
+
+        if (S_ISDIR(st.st_mode))
+        {
+            dir_reader child_cur;
+            int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+
+            if (mkdirat(new_fd, name, 0777) != 0 || dir_open(&child_cur, cur->fd, name) != 0)
+            {
+                perror("snapshot");
+                continue;
+            }
+            int child_prev = prev_fd >= 0 ? TEMP_FAILURE_RETRY(openat(prev_fd, name, flags)) : -1;
+            int child_new = TEMP_FAILURE_RETRY(openat(new_fd, name, flags));
+
+            if (child_new >= 0)
+                snap_dir(snap, &child_cur, child_prev, child_new, child);
+            else
+                perror("snapshot");
+
+            dir_close(&child_cur);
+            if (child_prev >= 0)
+                TEMP_FAILURE_RETRY(close(child_prev));
+            if (child_new >= 0)
+                TEMP_FAILURE_RETRY(close(child_new));
+            continue;
+        }
+
+        /* the index of the generation only reaches bytes the packs already have, so appending to them
+         * later leaves the generation as it was and they are shared with the target itself
+         */
+        if (S_ISREG(st.st_mode) && packs && pack_data_file(name) &&
+            linkat(cur->fd, name, new_fd, name, 0) == 0)
+        {
+            snap->linked++;
+            continue;
+        }
+
+        /* an unchanged file shares the inode of the previous generation, which the target never writes to */
+        if (S_ISREG(st.st_mode) && prev_fd >= 0 && walk_stat(prev_fd, name, &prev_st, AT_SYMLINK_NOFOLLOW) == 0 &&
+            S_ISREG(prev_st.st_mode) && prev_st.st_size == st.st_size &&
+            prev_st.st_mtim.tv_sec == st.st_mtim.tv_sec && prev_st.st_mtim.tv_nsec == st.st_mtim.tv_nsec &&
+            linkat(prev_fd, name, new_fd, name, 0) == 0)
+        {
+            snap->linked++;
+            continue;
+        }
+
+        /* links are rewritten to point into the generation, so they are never shared */
+        if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode))
+            submit_copy(snap, child);
+    }
+}
+
+/* write the next generation of target below its SNAPSHOT_DIR, files whose size and mtime match the
+ * previous generation are hard links to it, packs are hard links to those of the target and only
+ * the rest is copied, then remove all but the newest keep generations, 0 keeps every one
+ * returns: number of the new generation, -1 on error
+ */
+long snapshot_take(const char *target, long keep)
+{
+    char snap_dir_path[PATH_MAX], prev_dir[PATH_MAX];
+    snapshot snap = {0};
+    long *gens;
+    dir_reader cur;
+
+    snap.target = target;
+    join_path(snap_dir_path, sizeof(snap_dir_path), target, SNAPSHOT_DIR);
+    if (mkdir(snap_dir_path, 0777) != 0 && errno != EEXIST)
+        return -1;
+
+    long cnt = list_generations(snap_dir_path, &gens);
+    if (cnt < 0)
+        return -1;
+    long gen = cnt > 0 ? gens[cnt - 1] + 1 : 1;
+
+    snapshot_path(snap.gen_dir, sizeof(snap.gen_dir), target, gen);
+    snprintf(snap.tmp_dir, sizeof(snap.tmp_dir), "%s" PARTIAL_SUFFIX, snap.gen_dir);
+    if (mkdir(snap.tmp_dir, 0777) != 0 || dir_open(&cur, AT_FDCWD, target) != 0)
+    {
+        free(gens);
+        return -1;
+    }
+
+    int prev_fd = -1;
+    if (cnt > 0)
+    {
+        snapshot_path(prev_dir, sizeof(prev_dir), target, gens[cnt - 1]);
+        prev_fd = TEMP_FAILURE_RETRY(open(prev_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    }
+    int new_fd = TEMP_FAILURE_RETRY(open(snap.tmp_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (new_fd < 0)
+        ERR("open");
+
+    snap.pool = pool_create(pool_default_threads(), SNAPSHOT_QUEUE_MAX);
+    snap_dir(&snap, &cur, prev_fd, new_fd, "");
+    pool_wait(snap.pool);
+    pool_destroy(snap.pool);
+
+    dir_close(&cur);
+    if (prev_fd >= 0)
+        TEMP_FAILURE_RETRY(close(prev_fd));
+    TEMP_FAILURE_RETRY(close(new_fd));
+
+    /* only complete generations carry a plain number */
+    if (rename(snap.tmp_dir, snap.gen_dir) != 0)
+    {
+        remove_target_entry(snap.tmp_dir);
+        free(gens);
+        return -1;
+    }
+    printf("%s: generation %ld, %zu linked, %zu copied\n", target, gen, snap.linked, snap.copied);
+
+    /* the generation just written counts towards keep */
+    for (long i = 0; keep > 0 && i < cnt + 1 - keep; i++)
+    {
+        snapshot_path(prev_dir, sizeof(prev_dir), target, gens[i]);
+        if (remove_target_entry(prev_dir) != 0)
+            perror("snapshot retention");
+    }
+    free(gens);
+    return gen;
+}
+
+/* path of generation gen of target
+ * returns: 0 if that generation exists, -1 otherwise
+ */
+int snapshot_path(char *buf, size_t size, const char *target, long gen)
+{
+    struct stat st;
+
+    snprintf(buf, size, "%s/" SNAPSHOT_DIR "/%06ld", target, gen);
+    return gen > 0 && stat(buf, &st) == 0 && S_ISDIR(st.st_mode) ? 0 : -1;
+}
@@ -0,0 +1,13 @@
+#ifndef SN_H
+#define SN_H
+
+#include <stddef.h>
+
+/* directory below the target root holding one directory per snapshot generation */
+#define SNAPSHOT_DIR ".sop-snapshots"
+
+long snapshot_take(const char *, long);
+
+int snapshot_path(char *, size_t, const char *, long);
+
+#endif
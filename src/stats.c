@@ -0,0 +1,221 @@
+#define _GNU_SOURCE
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "stats.h"
+#include "utils.h"
+
+/* mapped by the shell before it forks, so every worker writes into the same pages */
+static worker_stats *slots;
+/* slot of this worker process, NULL in the shell */
+static worker_stats *self;
+/* slot of the backup this thread works for when one process runs many */
+static _Thread_local worker_stats *current;
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void stats_init(void)
+{
+    slots = mmap(NULL, STATS_SLOTS * sizeof(worker_stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED)
+        ERR("mmap");
+}
+
+/* reserve a zeroed slot for a worker about to be forked
+ * returns: slot index, -1 if all are taken and the worker runs without statistics
+ */
+int stats_claim(void)
+{
+    for (int i = 0; slots && i < STATS_SLOTS; i++)
+    {
+        pid_t free_pid = 0;
+        if (atomic_load(&slots[i].pid) == 0 && atomic_compare_exchange_strong(&slots[i].pid, &free_pid, -1))
+        {
+            worker_stats *s = &slots[i];
+            atomic_store(&s->phase, STATS_STARTING);
+            for (int c = 0; c < STAT_CNT; c++)
+                atomic_store(&s->counters[c], 0);
+            for (int q = 0; q < QUEUE_CNT; q++)
+            {
+                atomic_store(&s->queued[q], 0);
+                atomic_store(&s->oldest_ms[q], 0);
+            }
+            for (int w = 0; w < STATS_WINDOW; w++)
+                atomic_store(&s->window[w].sec, -1);
+            return i;
+        }
+    }
+    return -1;
+}
+
+void stats_set_pid(int slot, pid_t pid)
+{
+    if (slots && slot >= 0)
+        atomic_store(&slots[slot].pid, pid);
+}
+
+/* free the slot of a reaped worker */
+void stats_release_pid(pid_t pid)
+{
+    for (int i = 0; slots && i < STATS_SLOTS; i++)
+    {
+        if (atomic_load(&slots[i].pid) == pid)
+            atomic_store(&slots[i].pid, 0);
+    }
+}
+
+/* give a slot back once its backup is torn down inside a running process */
+void stats_release(int slot)
+{
+    if (slots && slot >= 0)
+        atomic_store(&slots[slot].pid, 0);
+}
+
+/* returns: counters of slot, NULL for -1 */
+worker_stats *stats_slot(int slot)
+{
+    return slots && slot >= 0 ? &slots[slot] : NULL;
+}
+
+/* called in the forked worker, later updates go to slot */
+void stats_attach(int slot)
+{
+    self = stats_slot(slot);
+}
+
+/* returns: where updates of the calling thread go, NULL if nowhere */
+worker_stats *stats_current(void)
+{
+    return current ? current : self;
+}
+
+/* send updates of the calling thread to s instead of the process slot */
+void stats_use(worker_stats *s)
+{
+    current = s;
+}
+
+void stats_set_phase(stats_phase phase)
+{
+    worker_stats *s = stats_current();
+
+    if (s)
+        atomic_store(&s->phase, phase);
+}
+
+void stats_add(stats_counter counter, unsigned long long value)
+{
+    worker_stats *s = stats_current();
+
+    if (s)
+        atomic_fetch_add(&s->counters[counter], value);
+}
+
+/* count one finished copy, also into the bucket of the current second */
+void stats_copied(off_t size)
+{
+    worker_stats *s = stats_current();
+
+    if (s == NULL)
+        return;
+
+    atomic_fetch_add(&s->counters[STAT_FILES], 1);
+    atomic_fetch_add(&s->counters[STAT_BYTES], (unsigned long long)size);
+
+    /* a copy racing with the reset of a reused bucket may be lost, the totals above stay exact */
+    long long sec = now_ms() / 1000;
+    stats_second *b = &s->window[sec % STATS_WINDOW];
+    long long old = atomic_load(&b->sec);
+    if (old != sec && atomic_compare_exchange_strong(&b->sec, &old, sec))
+    {
+        atomic_store(&b->files, 0);
+        atomic_store(&b->bytes, 0);
+    }
+    atomic_fetch_add(&b->files, 1);
+    atomic_fetch_add(&b->bytes, (unsigned long long)size);
+}
+
+/* returns: the clock stats_queue() expects its times on */
+long long stats_now_ms(void)
+{
+    return now_ms();
+}
+
+/* publish how many items wait in one queue and since when the oldest of them does */
+void stats_queue(stats_queue_stage stage, long queued, long long oldest_ms)
+{
+    worker_stats *s = stats_current();
+
+    if (s == NULL)
+        return;
+
+    atomic_store(&s->queued[stage], queued);
+    atomic_store(&s->oldest_ms[stage], queued > 0 ? oldest_ms : 0);
+}
+
+/* average over the last secs complete seconds */
+static void window_rate(worker_stats *s, long long now_sec, int secs, double *files, double *mib)
+{
+    unsigned long long f = 0, b = 0;
+
+    for (long long sec = now_sec - secs; sec < now_sec; sec++)
+    {
+        stats_second *w = &s->window[sec % STATS_WINDOW];
+        if (atomic_load(&w->sec) == sec)
+        {
+            f += atomic_load(&w->files);
+            b += atomic_load(&w->bytes);
+        }
+    }
+    *files = (double)f / secs;
+    *mib = (double)b / secs / (1 << 20);
+}
+
+void stats_print(FILE *out, int slot)
+{
+    static const char *phases[] = {"starting", "initial copy", "watching", "done"};
+
+    if (slots == NULL || slot < 0 || atomic_load(&slots[slot].pid) <= 0)
+    {
+        fprintf(out, "    no statistics\n");
+        return;
+    }
+
+    worker_stats *s = &slots[slot];
+    long long now = now_ms();
+    long queued[QUEUE_CNT];
+    long long lag = 0;
+    int phase = atomic_load(&s->phase);
+    double f10, m10, f60, m60;
+
+    /* a change is as late as the oldest item of any queue it passes through */
+    for (int q = 0; q < QUEUE_CNT; q++)
+    {
+        long long oldest = atomic_load(&s->oldest_ms[q]);
+        queued[q] = atomic_load(&s->queued[q]);
+        if (oldest > 0 && now - oldest > lag)
+            lag = now - oldest;
+    }
+
+    window_rate(s, now / 1000, 10, &f10, &m10);
+    window_rate(s, now / 1000, 60, &f60, &m60);
+
+    fprintf(out, "    pid %d, %s\n", (int)atomic_load(&s->pid), phase <= STATS_DONE ? phases[phase] : "unknown");
+    fprintf(out, "    copied:  %llu files, %llu bytes\n", atomic_load(&s->counters[STAT_FILES]),
+            atomic_load(&s->counters[STAT_BYTES]));
+    fprintf(out, "    events:  %llu received, %llu applied, %llu merged, %llu dropped\n",
+            atomic_load(&s->counters[STAT_RECEIVED]), atomic_load(&s->counters[STAT_APPLIED]),
+            atomic_load(&s->counters[STAT_MERGED]), atomic_load(&s->counters[STAT_DROPPED]));
+    fprintf(out, "    queue:   %ld changes, %ld due, %ld writes, lag %.3f s\n", queued[QUEUE_COALESCE],
+            queued[QUEUE_JOBS], queued[QUEUE_WRITERS], lag / 1000.0);
+    fprintf(out, "    rate:    10s %.1f files/s %.2f MiB/s, 60s %.1f files/s %.2f MiB/s\n", f10, m10, f60, m60);
+}
@@ -0,0 +1,92 @@
+#ifndef ST_H
+#define ST_H
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/* backups that can publish counters at the same time, the engine is meant for 1000 of them and
+ * fork-per-target backups take one each, pages of slots never claimed are not touched
+ */
+#define STATS_SLOTS 4096
+/* seconds of copy history kept for the throughput windows */
+#define STATS_WINDOW 64
+
+typedef enum StatsPhase
+{
+    STATS_STARTING = 0,
+    STATS_COPYING,
+    STATS_WATCHING,
+    STATS_DONE
+} stats_phase;
+
+/* where a change waits between its event and the targets */
+typedef enum StatsQueue
+{
+    QUEUE_COALESCE = 0, /* for its quiet window */
+    QUEUE_JOBS,         /* due, for the engine task that applies the changes of its backup */
+    QUEUE_WRITERS,      /* operations handed to the writer threads of the targets */
+    QUEUE_CNT
+} stats_queue_stage;
+
+typedef enum StatsCounter
+{
+    STAT_FILES = 0,
+    STAT_BYTES,
+    STAT_RECEIVED, /* events read from the kernel */
+    STAT_APPLIED,  /* net changes replayed on the targets */
+    STAT_MERGED,   /* events folded into a change that was still pending */
+    STAT_DROPPED,  /* events lost by the kernel queue or without a known directory */
+    STAT_CNT
+} stats_counter;
+
+/* copies finished during one second of the monotonic clock */
+typedef struct StatsSecond
+{
+    _Atomic long long sec;
+    _Atomic unsigned long long files;
+    _Atomic unsigned long long bytes;
+} stats_second;
+
+/* counters of one worker process, written by it and read by the shell */
+typedef struct WorkerStats
+{
+    _Atomic pid_t pid; /* 0 while the slot is free */
+    _Atomic int phase;
+    _Atomic unsigned long long counters[STAT_CNT];
+    _Atomic long queued[QUEUE_CNT];
+    _Atomic long long oldest_ms[QUEUE_CNT]; /* monotonic time the oldest of each queue got in, 0 if none */
+    stats_second window[STATS_WINDOW];
+} worker_stats;
+
+void stats_init(void);
+
+int stats_claim(void);
+
+void stats_set_pid(int, pid_t);
+
+void stats_release_pid(pid_t);
+
+void stats_release(int);
+
+worker_stats *stats_slot(int);
+
+void stats_attach(int);
+
+worker_stats *stats_current(void);
+
+void stats_use(worker_stats *);
+
+void stats_set_phase(stats_phase);
+
+void stats_add(stats_counter, unsigned long long);
+
+void stats_copied(off_t);
+
+long long stats_now_ms(void);
+
+void stats_queue(stats_queue_stage, long, long long);
+
+void stats_print(FILE *, int);
+
+#endif
@@ -6,185 +6,187 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "coalesce.h"
+#include "fanwatch.h"
 #include "fileproc.h"
+#include "journal.h"
+#include "registry.h"
+#include "stats.h"
+#include "synchro.h"
 #include "utils.h"
+#include "walk.h"
 #include "worker.h"
 
-#define EVENT_SIZE (sizeof(struct inotify_event))
-#define BUF_LEN (1024 * (EVENT_SIZE + 16)) * 4
+/* source paths found missing that apply_change keeps for a rename to explain */
+#define MISSED_MAX 256
 
-typedef struct WatchMap
+/* returns: 1 if path is dir or lies below it */
+int rel_within(const char *path, const char *dir, size_t dir_len)
 {
-    int wd;
-    char *path;
-    struct WatchMap *next;
-} WatchMap;
+    return strncmp(path, dir, dir_len) == 0 && (path[dir_len] == '/' || path[dir_len] == '\0');
+}
+
+/* forget the missed paths at or below rel_path */
+static void forget_missed(fanout *fo, const char *rel_path)
+{
+    size_t len = strlen(rel_path), kept = 0;
 
-static WatchMap *watch_head = NULL;
+    for (size_t i = 0; i < fo->missed_cnt; i++)
+    {
+        if (rel_within(fo->missed[i], rel_path, len))
+            free(fo->missed[i]);
+        else
+            fo->missed[kept++] = fo->missed[i];
+    }
+    fo->missed_cnt = kept;
+}
 
-void add_watch_mapping(int wd, const char *path)
+/* a copy found its source gone, which a rename queued behind it may explain, the oldest is dropped for room */
+static void note_missed(fanout *fo, const char *rel_path)
 {
-    WatchMap *node = malloc(sizeof(WatchMap));
-    if (!node)
+    if (fo->missed == NULL && (fo->missed = malloc(MISSED_MAX * sizeof(char *))) == NULL)
+        ERR("malloc");
+    if (fo->missed_cnt == MISSED_MAX)
     {
-        perror("malloc");
-        return;
+        free(fo->missed[0]);
+        memmove(fo->missed, fo->missed + 1, --fo->missed_cnt * sizeof(char *));
     }
-    node->wd = wd;
-    node->path = strdup(path);
-    node->next = watch_head;
-    watch_head = node;
+    if ((fo->missed[fo->missed_cnt++] = strdup(rel_path)) == NULL)
+        ERR("strdup");
 }
 
-const char *get_path_from_wd(int wd)
+/* copy what was missed below from_rel again from where the rename to full_src_path put it */
+static void retry_missed(fanout *fo, const char *from_rel, const char *full_src_path, const char *rel_path)
 {
-    WatchMap *current = watch_head;
-    while (current)
+    char src[PATH_MAX], rel[PATH_MAX];
+    size_t len = strlen(from_rel);
+    size_t cnt = fo->missed_cnt;
+    char **missed = fo->missed;
+
+    fo->missed = NULL;
+    fo->missed_cnt = 0;
+    for (size_t i = 0; i < cnt; i++)
     {
-        if (current->wd == wd)
-            return current->path;
-        current = current->next;
+        const char *rest = missed[i] + len;
+        if (!rel_within(missed[i], from_rel, len))
+            note_missed(fo, missed[i]);
+        else if (snprintf(src, sizeof(src), "%s%s", full_src_path, rest) < (int)sizeof(src) &&
+                 snprintf(rel, sizeof(rel), "%s%s", rel_path, rest) < (int)sizeof(rel) &&
+                 fanout_copy_file(fo, src, rel) != 0)
+            note_missed(fo, rel);
+        free(missed[i]);
     }
-    return NULL;
+    free(missed);
 }
 
-void add_watches_recursive(int fd, const char *path)
+/* where copy_tree puts the entries it walks */
+typedef struct TreeCopy
 {
-    int wd = inotify_add_watch(fd, path,
-                               IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF);
-    add_watch_mapping(wd, path);
+    fanout *fo;
+    const char *rel_path;
+} tree_copy;
 
-    DIR *dir = opendir(path);
-    if (!dir)
-        return;
+static int copy_tree_entry(const walk_entry *entry, void *arg)
+{
+    tree_copy *tc = arg;
+    char rel[PATH_MAX];
 
-    struct dirent *dp;
-    char path_buffer[PATH_MAX];
-    while ((dp = readdir(dir)) != NULL)
+    if (snprintf(rel, sizeof(rel), "%s%s", tc->rel_path, entry->path + entry->root_len) >= (int)sizeof(rel))
+        return WALK_SKIP;
+    fanout_copy_file(tc->fo, entry->path, rel);
+    return WALK_CONTINUE;
+}
+
+/* copy the source entry full_src_path with everything below it to rel_path on every target */
+static void copy_tree(fanout *fo, const char *full_src_path, const char *rel_path)
+{
+    tree_copy tc = {fo, rel_path};
+    struct stat st;
+
+    if (fanout_copy_file(fo, full_src_path, rel_path) == 0 && lstat(full_src_path, &st) == 0 && S_ISDIR(st.st_mode))
+        walk_tree(full_src_path, 0, copy_tree_entry, &tc);
+}
+
+/* bring every target of fo in line with one changed source path, from_rel is
+ * where a SYNC_RENAME moved it from and NULL for the other actions
+ */
+void apply_change(fanout *fo, sync_action action, const char *full_src_path, const char *rel_path,
+                  const char *from_rel)
+{
+    switch (action)
     {
-        if (strcmp(dp->d_name, ".") != 0 && strcmp(dp->d_name, "..") != 0)
-        {
-            if (dp->d_type == DT_DIR)
+        case SYNC_MKDIR:
+            fanout_mkdir(fo, rel_path);
+            break;
+        case SYNC_COPY:
+            if (fanout_copy_file(fo, full_src_path, rel_path) != 0)
+                note_missed(fo, rel_path);
+            break;
+        case SYNC_REMOVE:
+            forget_missed(fo, rel_path);
+            fanout_remove(fo, rel_path);
+            break;
+        case SYNC_RENAME:
+            /* targets that can't rename get the moved tree copied again */
+            if (fanout_rename(fo, full_src_path, from_rel, rel_path) == 0)
             {
-                snprintf(path_buffer, sizeof(path_buffer), "%s/%s", path, dp->d_name);
-                add_watches_recursive(fd, path_buffer);
+                retry_missed(fo, from_rel, full_src_path, rel_path);
+                break;
             }
-        }
+            forget_missed(fo, from_rel);
+            fanout_remove(fo, from_rel);
+            copy_tree(fo, full_src_path, rel_path);
+            break;
     }
-    closedir(dir);
 }
 
-/* copy all changes in source_dir to target_dir */
-void synchronize(const char *source_base_dir, const char *destination_base_dir)
+/* gone callback of the single subscriber in synchronize */
+static void source_gone(void *owner)
 {
-    int fd = inotify_init();
-    if (fd < 0)
-        ERR("inotify_init");
-
-    add_watches_recursive(fd, source_base_dir);
+    *(int *)owner = 1;
+}
 
-    char buffer[BUF_LEN];
-    int length, i = 0;
+/* copy all changes in source_dir to every target of fo */
+void synchronize(const char *source_base_dir, fanout *fo, const backup_opts *opts)
+{
+    /* fanotify needs no per-directory watches but also CAP_SYS_ADMIN */
+    coalescer *co = coalescer_create(fo, opts->debounce_ms);
 
-    /* synchronize dirs while src present */
-    int source_deleted = 0;
-    while (!source_deleted)
+    if (opts->fanotify)
     {
-        length = read(fd, buffer, BUF_LEN);  // TODO: make thread safe
-        if (length < 0)
-            continue;
-
-        i = 0;
-        while (i < length)
+        if (synchronize_fanotify(source_base_dir, co) == 0)
         {
-            struct inotify_event *event = (struct inotify_event *)&buffer[i];
-            if (event->len == 0)
-            {
-                const char *event_source = get_path_from_wd(event->wd);
+            coalescer_destroy(co);
+            return;
+        }
+        fprintf(stderr, "%s: fanotify unavailable, using inotify\n", source_base_dir);
+    }
 
-                /* check if source_dir present */
-                if (strcmp(event_source, source_base_dir) == 0 && (event->mask & IN_DELETE_SELF))
-                {
-                    source_deleted = 1;
-                    break;
-                }
-            }
+    watch_registry *reg = registry_create();
+    if (reg == NULL)
+        ERR("inotify_init");
 
-            /* file/dir modified */
-            if (event->len)
-            {
-                const char *event_source = get_path_from_wd(event->wd);
+    int source_deleted = 0;
+    if (registry_subscribe(reg, source_base_dir, co, &source_deleted) == NULL)
+    {
+        fprintf(stderr, "%s: cannot watch source\n", source_base_dir);
+        source_deleted = 1;
+    }
 
-                if (event_source)
-                {
-                    char full_src_path[PATH_MAX];
-                    char full_dst_path[PATH_MAX];
-
-                    /* modifed path construction */
-                    snprintf(full_src_path, sizeof(full_src_path), "%s/%s", event_source, event->name);
-
-                    /* relative path construction */
-                    const char *rel_path = event_source + strlen(source_base_dir);
-                    if (*rel_path == '/')
-                        rel_path++;
-
-                    if (strlen(rel_path) > 0)
-                    {
-                        /* subdir */
-                        snprintf(full_dst_path, sizeof(full_dst_path), "%s/%s/%s", destination_base_dir, rel_path,
-                                 event->name);
-                    }
-                    else
-                    {
-                        /* main src dir*/
-                        snprintf(full_dst_path, sizeof(full_dst_path), "%s/%s", destination_base_dir, event->name);
-                    }
-
-                    if (event->mask & IN_ISDIR)
-                    {
-                        /* modified path -> dir*/
-                        if (event->mask & (IN_CREATE | IN_MOVED_TO))
-                        {
-                            mkdir(full_dst_path, 0777); /* mkdirs ? */
-                            add_watches_recursive(fd, full_src_path);
-                        }
-                        else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
-                        {
-                            remove_directory_recursive(full_dst_path);
-                        }
-                    }
-                    else
-                    {
-                        /* modified path -> file*/
-                        if (event->mask & (IN_MOVED_TO | IN_CLOSE_WRITE))
-                        {
-                            char dst_cp[PATH_MAX];
-                            strcpy(dst_cp, full_dst_path);
-                            char *last_slash = strrchr(dst_cp, '/');
-                            if (last_slash)
-                            {
-                                *last_slash = '\0';
-                                create_directories(dst_cp);
-                            }
-
-                            copy_single_file(full_src_path, full_dst_path, source_base_dir, destination_base_dir);
-                        }
-                        else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
-                        {
-                            unlink(full_dst_path);
-                        }
-                    }
-                }
-            }
-            i += EVENT_SIZE + event->len;
-        }
+    /* synchronize dirs while src present and someone still wants the changes */
+    while (!source_deleted && fanout_active(fo))
+    {
+        if (!coalesce_wait(co, reg->fd))
+            continue;
+
+        registry_dispatch(reg, source_gone);
     }
 
-    close(fd);
+    coalescer_destroy(co);
+    registry_destroy(reg);
 }
 
 /* return 1 if backup is already in progress otherwise 0 */
@@ -199,10 +201,49 @@ int backup_present(char *src, char *dst, workerList *workers)
     return 0;
 }
 
+/* realpath for a path that may not exist yet: the missing tail is appended to its deepest existing parent
+ * returns: the absolute path for the caller to free, NULL if no parent resolves
+ */
+static char *resolve_path(const char *path)
+{
+    char *abs = realpath(path, NULL);
+    if (abs != NULL || errno != ENOENT)
+        return abs;
+
+    char *parent = strdup(path);
+    if (parent == NULL)
+        return NULL;
+    char *slash = strrchr(parent, '/');
+    while (slash != NULL && slash != parent && slash[1] == '\0')
+    {
+        /* trailing slashes name the same entry */
+        *slash = '\0';
+        slash = strrchr(parent, '/');
+    }
+
+    const char *name = parent;
+    char *abs_parent;
+    if (slash == NULL)
+    {
+        abs_parent = realpath(".", NULL);
+    }
+    else
+    {
+        name = slash + 1;
+        *slash = '\0';
+        abs_parent = slash == parent ? strdup("/") : resolve_path(parent);
+    }
+    if (abs_parent != NULL && asprintf(&abs, "%s/%s", strcmp(abs_parent, "/") == 0 ? "" : abs_parent, name) < 0)
+        abs = NULL;
+    free(abs_parent);
+    free(parent);
+    return abs;
+}
+
 int is_subdir(const char *child_path, const char *parent_path)
 {
-    char *abs_child = realpath(child_path, NULL);
-    char *abs_parent = realpath(parent_path, NULL);
+    char *abs_child = resolve_path(child_path);
+    char *abs_parent = resolve_path(parent_path);
 
     int result = 0;
 
@@ -235,16 +276,24 @@ int is_subdir(const char *child_path, const char *parent_path)
     return result;
 }
 
-/*  verify presence of srcdir and emptiness of dst
+/*  verify presence of srcdir and emptiness of dst (unless incremental)
  *   and make sure backup is not present
  *   returns: 0 on succes otherwise -1
  */
-int prep_dirs(char *src, char *dst, workerList *workers)
+int prep_dirs(char *src, char *dst, workerList *workers, const backup_opts *opts)
 {
     /* check src exists */
     struct stat src_stat;
-    if (stat(src, &src_stat) < 0 || !S_ISDIR(src_stat.st_mode) || backup_present(src, dst, workers) ||
-        is_subdir(dst, src))
+    if (stat(src, &src_stat) < 0 || !S_ISDIR(src_stat.st_mode) || backup_present(src, dst, workers))
+        return -1;
+
+    /* a target inside the source is backed up into itself, one holding the source gets pruned down to it */
+    if (is_subdir(dst, src) || is_subdir(src, dst))
+        return -1;
+
+    /* a store inside the source would be backed up into itself, inside a target it could be pruned */
+    if (opts->store &&
+        (is_subdir(opts->store, src) || is_subdir(opts->store, dst) || create_directories(opts->store) != 0))
         return -1;
 
     /* check dst doesnt exist */
@@ -268,6 +317,12 @@ int prep_dirs(char *src, char *dst, workerList *workers)
         return -1;
     }
 
+    /* existing contents get reconciled by the initial copy, or by a resume from the journal */
+    if (opts->incremental || (opts->journal && journal_matches(dst, src)))
+    {
+        return 0;
+    }
+
     DIR *dir = opendir(dst);
     struct dirent *dp;
     if (!dir)
@@ -288,83 +343,3 @@ int prep_dirs(char *src, char *dst, workerList *workers)
     closedir(dir);
     return 0;
 }
-
-/* restore files from backup_dir to restore_dir */
-void restore(const char *restore_dir, const char *backup_dir)
-{
-    /* handle file creation */
-    DIR *b_dir = opendir(backup_dir);
-
-    if (!b_dir)
-    {
-        return;
-    }
-
-    struct dirent *dp;
-    char backup_full[PATH_MAX];
-    char restore_full[PATH_MAX];
-
-    while ((dp = readdir(b_dir)) != NULL)
-    {
-        if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
-            continue;
-
-        snprintf(backup_full, PATH_MAX, "%s/%s", backup_dir, dp->d_name);
-        snprintf(restore_full, PATH_MAX, "%s/%s", restore_dir, dp->d_name);
-
-        struct stat b_st;
-        if (lstat(backup_full, &b_st) == -1)
-            continue;
-
-        if (S_ISDIR(b_st.st_mode))
-        {
-            create_directories(restore_full);
-
-            /* restore recursively */
-            restore(restore_full, backup_full);
-        }
-        else
-        {
-            struct stat r_st;
-            /* copy if backup is modified later */
-            if (lstat(restore_full, &r_st) == -1 || b_st.st_mtime > b_st.st_ctime)
-            {
-                copy_single_file(backup_full, restore_full, backup_dir, restore_dir);
-            }
-        }
-    }
-    closedir(b_dir);
-
-    /* handle file deletion */
-    DIR *r_dir = opendir(restore_dir);
-    if (!r_dir)
-        return;
-
-    while ((dp = readdir(r_dir)) != NULL)
-    {
-        if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
-            continue;
-
-        snprintf(backup_full, PATH_MAX, "%s/%s", backup_dir, dp->d_name);
-        snprintf(restore_full, PATH_MAX, "%s/%s", restore_dir, dp->d_name);
-
-        struct stat buff;
-        if (lstat(backup_full, &buff) == -1 && errno == ENOENT)
-        {
-            struct stat r_st;
-            if (lstat(restore_full, &r_st) == -1)
-                continue;
-
-            if (S_ISDIR(r_st.st_mode))
-            {
-                remove_directory_recursive(restore_full);
-            }
-            else
-            {
-                unlink(restore_full);
-            }
-        }
-    }
-
-    closedir(r_dir);
-}
@@ -5,17 +5,23 @@
 #include "utils.h"
 #include "worker.h"
 
-typedef struct WatchMap
+/* what a source change means for the targets */
+typedef enum SyncAction
 {
-    int wd;
-    char *path;
-    struct WatchMap *next;
-} WatchMap;
+    SYNC_MKDIR,
+    SYNC_COPY,
+    SYNC_REMOVE,
+    SYNC_RENAME /* the entry was moved inside the source, the old path comes along */
+} sync_action;
 
-void synchronize(const char *, const char *);
+struct Coalescer;
 
-void restore(const char *, const char *);
+int rel_within(const char *, const char *, size_t);
 
-int prep_dirs(char *, char *, workerList *);
+void apply_change(fanout *, sync_action, const char *, const char *, const char *);
+
+void synchronize(const char *, fanout *, const backup_opts *);
+
+int prep_dirs(char *, char *, workerList *, const backup_opts *);
 
 #endif
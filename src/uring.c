@@ -0,0 +1,380 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "uring.h"
+#include "utils.h"
+
+#define URING_ENTRIES 256
+/* open src, open dst, read, write, close, close */
+#define URING_OPS_PER_FILE 6
+
+static int sys_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned int submit, unsigned int complete, unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned int opcode, void *arg, unsigned int nr)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+/* every opcode the batch path uses must be known to the running kernel */
+static int probe_ops(int fd)
+{
+    static const int needed[] = {IORING_OP_OPENAT, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_CLOSE,
+                                 IORING_OP_STATX};
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    if (probe == NULL)
+        return -1;
+
+    int ok = sys_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); i++)
+    {
+        ok = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    free(probe);
+    return ok ? 0 : -1;
+}
+
+static int map_rings(uring *ring, struct io_uring_params *p)
+{
+    ring->sq_len = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+    ring->cq_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED)
+        return -1;
+
+    char *sq = ring->sq_ptr, *cq = ring->cq_ptr;
+    ring->sq_head = (unsigned int *)(sq + p->sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + p->sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + p->sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + p->sq_off.array);
+    ring->cq_head = (unsigned int *)(cq + p->cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + p->cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + p->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+    ring->sq_entries = p->sq_entries;
+    return 0;
+}
+
+/* registered buffers and a sparse fixed-file table sized for one batch */
+static int register_resources(uring *ring)
+{
+    struct iovec iov[URING_BATCH];
+    int slots[2 * URING_BATCH];
+
+    ring->bufs = aligned_alloc(4096, (size_t)URING_BATCH * URING_BUF);
+    if (ring->bufs == NULL)
+        return -1;
+
+    for (int i = 0; i < URING_BATCH; i++)
+    {
+        iov[i].iov_base = ring->bufs + (size_t)i * URING_BUF;
+        iov[i].iov_len = URING_BUF;
+    }
+    for (int i = 0; i < 2 * URING_BATCH; i++)
+        slots[i] = -1;
+
+    if (sys_register(ring->fd, IORING_REGISTER_BUFFERS, iov, URING_BATCH) < 0)
+        return -1;
+    return sys_register(ring->fd, IORING_REGISTER_FILES, slots, 2 * URING_BATCH) < 0 ? -1 : 0;
+}
+
+static struct io_uring_sqe *next_sqe(uring *ring, unsigned char opcode, unsigned long long user_data)
+{
+    unsigned int tail = *ring->sq_tail + ring->queued;
+    unsigned int idx = tail & *ring->sq_mask;
+
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = user_data;
+    ring->sq_array[idx] = idx;
+    ring->queued++;
+    return sqe;
+}
+
+/* call done(user_data, res) for every completion posted so far
+ * returns: number of completions reaped
+ */
+static unsigned int reap(uring *ring, void (*done)(uring_file *, unsigned long long, int), uring_file *files)
+{
+    unsigned int head = *ring->cq_head;
+    unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    unsigned int cnt = tail - head;
+
+    for (; head != tail; head++)
+    {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        done(files, cqe->user_data, cqe->res);
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return cnt;
+}
+
+/* hand every queued sqe to the kernel and wait for all their completions,
+ * done(user_data, res) is called once per completion
+ * returns: 0 on success, -1 if the ring itself failed, nothing the kernel took still
+ * references the caller's memory either way
+ */
+static int submit_and_reap(uring *ring, void (*done)(uring_file *, unsigned long long, int), uring_file *files)
+{
+    unsigned int expected = ring->queued;
+
+    if (ring->fd < 0)
+    {
+        ring->queued = 0;
+        return -1;
+    }
+
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->queued, __ATOMIC_RELEASE);
+    unsigned int to_submit = ring->queued;
+    ring->queued = 0;
+
+    int failed = 0;
+    while (expected > 0)
+    {
+        int submitted = sys_enter(ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS);
+        if (submitted < 0 && errno != EINTR)
+        {
+            /* without a poller only enter consumes sqes, the ones it didn't take are withdrawn */
+            if (to_submit > 0)
+            {
+                __atomic_store_n(ring->sq_tail, *ring->sq_head, __ATOMIC_RELEASE);
+                expected -= to_submit;
+                to_submit = 0;
+                failed = 1;
+                continue;
+            }
+
+            /* completions can't even be waited for, closing the ring cancels what is left */
+            close(ring->fd);
+            ring->fd = -1;
+            return -1;
+        }
+        if (submitted > 0)
+            to_submit -= submitted;
+
+        expected -= reap(ring, done, files);
+    }
+    return failed ? -1 : 0;
+}
+
+static void probe_done(uring_file *files, unsigned long long user_data, int res) { files->result = res; }
+
+/* the chains open straight into fixed slots, which takes 5.15, an older kernel ignores
+ * file_index and hands back a plain descriptor instead
+ * returns: 0 if an open lands in a slot, -1 otherwise
+ */
+static int probe_fixed_open(uring *ring)
+{
+    uring_file probe = {.result = -1};
+
+    struct io_uring_sqe *sqe = next_sqe(ring, IORING_OP_OPENAT, 0);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)"/";
+    sqe->open_flags = O_RDONLY | O_DIRECTORY;
+    sqe->file_index = 1;
+    if (submit_and_reap(ring, probe_done, &probe) < 0)
+        return -1;
+    if (probe.result > 0)
+        close(probe.result);
+    if (probe.result != 0)
+        return -1;
+
+    /* the first chain must find the slot empty */
+    sqe = next_sqe(ring, IORING_OP_CLOSE, 0);
+    sqe->file_index = 1;
+    return submit_and_reap(ring, probe_done, &probe) < 0 || probe.result != 0 ? -1 : 0;
+}
+
+/* returns: a ready ring, NULL when the kernel has no (usable) io_uring */
+uring *uring_create(void)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    uring *ring = calloc(1, sizeof(uring));
+    if (ring == NULL)
+        return NULL;
+
+    ring->fd = sys_setup(URING_ENTRIES, &p);
+    if (ring->fd < 0)
+    {
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_ptr = ring->cq_ptr = ring->sqes = MAP_FAILED;
+    if (probe_ops(ring->fd) < 0 || map_rings(ring, &p) < 0 || register_resources(ring) < 0 ||
+        probe_fixed_open(ring) < 0)
+    {
+        uring_destroy(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+void uring_destroy(uring *ring)
+{
+    if (ring->sq_ptr != MAP_FAILED)
+        munmap(ring->sq_ptr, ring->sq_len);
+    if (ring->cq_ptr != MAP_FAILED)
+        munmap(ring->cq_ptr, ring->cq_len);
+    if (ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_len);
+
+    /* closing the ring also drops its registered files and buffers */
+    if (ring->fd >= 0)
+        close(ring->fd);
+    free(ring->bufs);
+    free(ring);
+}
+
+static void stat_done(uring_file *files, unsigned long long user_data, int res)
+{
+    if (res < 0)
+        files[user_data].skip = files[user_data].clear = 0;
+}
+
+/* statx every target path in one submission and mark files whose target
+ * already has the same type, size and mtime as skip
+ * returns: 0 on success, -1 if the ring failed
+ */
+int uring_stat_batch(uring *ring, uring_file *files, int cnt)
+{
+    struct statx *stx = calloc(cnt, sizeof(struct statx));
+    if (stx == NULL)
+        return -1;
+
+    for (int i = 0; i < cnt; i++)
+    {
+        struct io_uring_sqe *sqe = next_sqe(ring, IORING_OP_STATX, i);
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long)files[i].dst;
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        sqe->len = STATX_TYPE | STATX_SIZE | STATX_MTIME;
+        sqe->off = (unsigned long)&stx[i];
+        files[i].skip = files[i].clear = 1;
+    }
+
+    int r = submit_and_reap(ring, stat_done, files);
+
+    for (int i = 0; i < cnt; i++)
+    {
+        struct stat *st = &files[i].st;
+        if (!files[i].skip)
+            continue;
+
+        /* skip and clear stay set only for an existing target of the same or another type */
+        files[i].clear = (stx[i].stx_mode & S_IFMT) != S_IFREG;
+        if (files[i].clear || (off_t)stx[i].stx_size != st->st_size || stx[i].stx_mtime.tv_sec != st->st_mtim.tv_sec ||
+            stx[i].stx_mtime.tv_nsec != st->st_mtim.tv_nsec)
+            files[i].skip = 0;
+    }
+
+    free(stx);
+    return r;
+}
+
+/* user_data carries the file index and the step of its chain */
+static void copy_done(uring_file *files, unsigned long long user_data, int res)
+{
+    uring_file *file = &files[user_data / URING_OPS_PER_FILE];
+    int step = user_data % URING_OPS_PER_FILE;
+
+    /* a descriptor outside the slots means the chain can't go on, it is not leaked either */
+    if ((step == 0 || step == 1) && res > 0)
+    {
+        close(res);
+        file->result = -1;
+    }
+
+    /* read and write must move the whole file, the closes may fail after a broken chain */
+    if (res < 0 && step < 4)
+        file->result = -1;
+    if ((step == 2 || step == 3) && res != file->st.st_size)
+        file->result = -1;
+}
+
+/* copy cnt small files (not marked skip) with one linked chain each:
+ * open src -> open dst -> read -> write -> close -> close, all through fixed
+ * slots and registered buffers so the whole batch costs a few syscalls
+ * returns: 0 on success, -1 if the ring failed, per-file outcome is in result
+ */
+int uring_copy_batch(uring *ring, uring_file *files, int cnt)
+{
+    for (int i = 0; i < cnt; i++)
+    {
+        unsigned long long base = (unsigned long long)i * URING_OPS_PER_FILE;
+        unsigned int src_slot = 2 * i, dst_slot = 2 * i + 1;
+        size_t len = files[i].st.st_size;
+        char *buf = ring->bufs + (size_t)i * URING_BUF;
+
+        files[i].result = 0;
+        if (files[i].skip)
+            continue;
+
+        struct io_uring_sqe *sqe = next_sqe(ring, IORING_OP_OPENAT, base);
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long)files[i].src;
+        sqe->open_flags = O_RDONLY;
+        sqe->file_index = src_slot + 1;
+        sqe->flags = IOSQE_IO_LINK;
+
+        sqe = next_sqe(ring, IORING_OP_OPENAT, base + 1);
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long)files[i].dst;
+        sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW;
+        sqe->len = 0777;
+        sqe->file_index = dst_slot + 1;
+        sqe->flags = IOSQE_IO_LINK;
+
+        sqe = next_sqe(ring, IORING_OP_READ_FIXED, base + 2);
+        sqe->fd = src_slot;
+        sqe->addr = (unsigned long)buf;
+        sqe->len = len;
+        sqe->buf_index = i;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+
+        sqe = next_sqe(ring, IORING_OP_WRITE_FIXED, base + 3);
+        sqe->fd = dst_slot;
+        sqe->addr = (unsigned long)buf;
+        sqe->len = len;
+        sqe->buf_index = i;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+
+        sqe = next_sqe(ring, IORING_OP_CLOSE, base + 4);
+        sqe->file_index = src_slot + 1;
+        sqe->flags = IOSQE_IO_LINK;
+
+        sqe = next_sqe(ring, IORING_OP_CLOSE, base + 5);
+        sqe->file_index = dst_slot + 1;
+    }
+
+    return submit_and_reap(ring, copy_done, files);
+}
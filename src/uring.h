@@ -0,0 +1,55 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* files copied by one batch, each owns one registered buffer and two fixed file slots */
+#define URING_BATCH 32
+/* largest file the batch path takes, bigger ones go through copy_data */
+#define URING_BUF (64 * 1024)
+
+typedef struct Uring
+{
+    int fd;
+    unsigned int sq_entries;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_len;
+    size_t cq_len;
+    size_t sqes_len;
+    char *bufs;
+    unsigned int queued;
+} uring;
+
+/* one small file of a batch, result is 0 when the ring copied it */
+typedef struct UringFile
+{
+    char *src;
+    char *dst;
+    struct stat st;
+    int skip;  /* target already up to date */
+    int clear; /* target holds another kind of entry that must go first */
+    int result;
+} uring_file;
+
+uring *uring_create(void);
+
+void uring_destroy(uring *);
+
+int uring_stat_batch(uring *, uring_file *, int);
+
+int uring_copy_batch(uring *, uring_file *, int);
+
+#endif
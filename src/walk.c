@@ -0,0 +1,207 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "walk.h"
+
+/* record layout of getdents64, not exported by every libc */
+typedef struct LinuxDirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} linux_dirent64;
+
+typedef struct Walker
+{
+    walk_visit fn;
+    void *arg;
+    int flags;
+    size_t root_len;
+    char path[PATH_MAX];
+} walker;
+
+/* open name inside at_fd for listing, a link is only followed when name is a
+ * plain path (at_fd is AT_FDCWD), never while descending
+ * returns: 0 on success, -1 if it is no directory or can't be opened
+ */
+int dir_open(dir_reader *reader, int at_fd, const char *name)
+{
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC | (at_fd == AT_FDCWD ? 0 : O_NOFOLLOW);
+
+    reader->buf = NULL;
+    reader->fd = TEMP_FAILURE_RETRY(openat(at_fd, name, flags));
+    if (reader->fd < 0)
+        return -1;
+
+    reader->buf = malloc(WALK_BUF);
+    if (reader->buf == NULL)
+        ERR("malloc");
+    reader->len = reader->pos = 0;
+    return 0;
+}
+
+/* next name of the directory, "." and ".." are left out
+ * returns: 1 with name and type set, 0 at the end, -1 on error
+ */
+int dir_next(dir_reader *reader, const char **name, unsigned char *type)
+{
+    for (;;)
+    {
+        if (reader->pos >= reader->len)
+        {
+            long n = syscall(SYS_getdents64, reader->fd, reader->buf, WALK_BUF);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return n < 0 ? -1 : 0;
+            reader->len = n;
+            reader->pos = 0;
+        }
+
+        linux_dirent64 *d = (linux_dirent64 *)(reader->buf + reader->pos);
+        reader->pos += d->d_reclen;
+
+        if (d->d_name[0] == '.' && (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0')))
+            continue;
+
+        *name = d->d_name;
+        *type = d->d_type;
+        return 1;
+    }
+}
+
+void dir_close(dir_reader *reader)
+{
+    if (reader->fd >= 0)
+        TEMP_FAILURE_RETRY(close(reader->fd));
+    free(reader->buf);
+    reader->fd = -1;
+    reader->buf = NULL;
+}
+
+/* fstatat through statx, flags are AT_* flags such as AT_SYMLINK_NOFOLLOW
+ * returns: 0 on success, -1 with errno set
+ */
+int walk_stat(int dir_fd, const char *name, struct stat *st, int flags)
+{
+    struct statx stx;
+
+    if (statx(dir_fd, name, flags, STATX_BASIC_STATS, &stx) != 0)
+    {
+        if (errno != ENOSYS)
+            return -1;
+        return fstatat(dir_fd, name, st, flags);
+    }
+
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    st->st_ino = stx.stx_ino;
+    st->st_mode = stx.stx_mode;
+    st->st_nlink = stx.stx_nlink;
+    st->st_uid = stx.stx_uid;
+    st->st_gid = stx.stx_gid;
+    st->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+    st->st_size = stx.stx_size;
+    st->st_blksize = stx.stx_blksize;
+    st->st_blocks = stx.stx_blocks;
+    st->st_atim.tv_sec = stx.stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+    return 0;
+}
+
+/* list the directory already opened in reader, path holds its name up to path_len */
+static int walk_dir(walker *w, dir_reader *reader, size_t path_len, int depth)
+{
+    const char *name;
+    unsigned char type;
+    int r;
+
+    while ((r = dir_next(reader, &name, &type)) > 0)
+    {
+        size_t name_len = strlen(name);
+        if (path_len + 1 + name_len >= sizeof(w->path))
+            continue;
+        w->path[path_len] = '/';
+        memcpy(w->path + path_len + 1, name, name_len + 1);
+
+        /* most filesystems fill d_type, only the rest cost a stat */
+        if (type == DT_UNKNOWN)
+        {
+            struct stat st;
+            if (walk_stat(reader->fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                continue;
+            type = IFTODT(st.st_mode);
+        }
+
+        walk_entry entry = {reader->fd, name, w->path, w->root_len, type, depth, 0};
+        int action = w->fn(&entry, w->arg);
+        if (action < 0)
+            return -1;
+        if (type != DT_DIR || action == WALK_SKIP)
+            continue;
+
+        dir_reader child;
+        if (dir_open(&child, reader->fd, name) == 0)
+        {
+            int result = walk_dir(w, &child, path_len + 1 + name_len, depth + 1);
+            dir_close(&child);
+            if (result < 0)
+                return -1;
+        }
+
+        if (w->flags & WALK_POST)
+        {
+            w->path[path_len + 1 + name_len] = '\0';
+            entry.post = 1;
+            if (w->fn(&entry, w->arg) < 0)
+                return -1;
+        }
+    }
+    return r;
+}
+
+/* call fn for every entry below root, a directory is reported before its
+ * contents, every directory is opened relative to its parent's descriptor
+ * returns: 0 on success, -1 if root can't be listed or fn stopped the walk
+ */
+int walk_tree(const char *root, int flags, walk_visit fn, void *arg)
+{
+    dir_reader reader;
+
+    walker *w = malloc(sizeof(walker));
+    if (w == NULL)
+        ERR("malloc");
+    w->fn = fn;
+    w->arg = arg;
+    w->flags = flags;
+    w->root_len = strlen(root);
+    if (w->root_len >= sizeof(w->path) || dir_open(&reader, AT_FDCWD, root) != 0)
+    {
+        free(w);
+        return -1;
+    }
+    memcpy(w->path, root, w->root_len + 1);
+
+    int result = walk_dir(w, &reader, w->root_len, 1);
+    dir_close(&reader);
+    free(w);
+    return result < 0 ? -1 : 0;
+}
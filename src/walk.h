@@ -0,0 +1,50 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+/* getdents64 buffer of one open directory, large enough for thousands of names per call */
+#define WALK_BUF (64 * 1024)
+
+/* also visit every directory a second time, after its contents */
+#define WALK_POST 1
+
+/* callback results, anything negative stops the walk */
+#define WALK_CONTINUE 0
+#define WALK_SKIP 1
+
+/* an open directory listed through getdents64 */
+typedef struct DirReader
+{
+    int fd;
+    char *buf;
+    size_t len;
+    size_t pos;
+} dir_reader;
+
+/* one entry met by walk_tree */
+typedef struct WalkEntry
+{
+    int dir_fd;         /* directory holding the entry, for the *at calls */
+    const char *name;   /* name inside dir_fd */
+    const char *path;   /* root joined with every name on the way */
+    size_t root_len;    /* path + root_len is the '/'-led part below root */
+    unsigned char type; /* DT_* type, resolved with a stat only when getdents can't tell */
+    int depth;          /* 1 for the children of root */
+    int post;           /* set on the second visit of a directory under WALK_POST */
+} walk_entry;
+
+typedef int (*walk_visit)(const walk_entry *, void *);
+
+int dir_open(dir_reader *, int, const char *);
+
+int dir_next(dir_reader *, const char **, unsigned char *);
+
+void dir_close(dir_reader *);
+
+int walk_stat(int, const char *, struct stat *, int);
+
+int walk_tree(const char *, int, walk_visit, void *);
+
+#endif
@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+
+#include "utils.h"
+#include "watch.h"
+
+#define WATCH_BUCKETS_INIT 256
+
+static size_t bucket_of(watch_table *table, int wd)
+{
+    return ((unsigned int)wd * 2654435761u) & (table->bucket_cnt - 1);
+}
+
+static void grow(watch_table *table)
+{
+    size_t new_cnt = table->bucket_cnt * 2;
+    watch_node **buckets = calloc(new_cnt, sizeof(watch_node *));
+    if (buckets == NULL)
+        ERR("calloc");
+
+    watch_node **old = table->buckets;
+    size_t old_cnt = table->bucket_cnt;
+    table->buckets = buckets;
+    table->bucket_cnt = new_cnt;
+
+    for (size_t i = 0; i < old_cnt; i++)
+    {
+        watch_node *node = old[i];
+        while (node)
+        {
+            watch_node *next = node->next;
+            size_t b = bucket_of(table, node->wd);
+            node->next = buckets[b];
+            buckets[b] = node;
+            node = next;
+        }
+    }
+    free(old);
+}
+
+watch_table *watch_table_create(void)
+{
+    watch_table *table = malloc(sizeof(watch_table));
+    if (table == NULL)
+        ERR("malloc");
+
+    table->bucket_cnt = WATCH_BUCKETS_INIT;
+    table->cnt = 0;
+    table->buckets = calloc(table->bucket_cnt, sizeof(watch_node *));
+    if (table->buckets == NULL)
+        ERR("calloc");
+    return table;
+}
+
+void watch_table_destroy(watch_table *table)
+{
+    for (size_t i = 0; i < table->bucket_cnt; i++)
+    {
+        watch_node *node = table->buckets[i];
+        while (node)
+        {
+            watch_node *next = node->next;
+            free(node->name);
+            free(node);
+            node = next;
+        }
+    }
+    free(table->buckets);
+    free(table);
+}
+
+watch_node *watch_find(watch_table *table, int wd)
+{
+    watch_node *node = table->buckets[bucket_of(table, wd)];
+    while (node && node->wd != wd)
+        node = node->next;
+    return node;
+}
+
+static void unlink_sibling(watch_node *node)
+{
+    if (node->prev_sibling)
+        node->prev_sibling->next_sibling = node->next_sibling;
+    else if (node->parent)
+        node->parent->children = node->next_sibling;
+    if (node->next_sibling)
+        node->next_sibling->prev_sibling = node->prev_sibling;
+
+    node->prev_sibling = node->next_sibling = NULL;
+}
+
+static void link_sibling(watch_node *node, watch_node *parent)
+{
+    node->parent = parent;
+    if (parent == NULL)
+        return;
+
+    node->next_sibling = parent->children;
+    if (parent->children)
+        parent->children->prev_sibling = node;
+    parent->children = node;
+}
+
+/* register wd as child name of parent, a wd the kernel handed out again
+ * (same directory added twice) is moved to its new place instead
+ */
+watch_node *watch_add(watch_table *table, int wd, watch_node *parent, const char *name)
+{
+    char *name_copy = strdup(name);
+    if (name_copy == NULL)
+        ERR("strdup");
+
+    watch_node *node = watch_find(table, wd);
+    if (node)
+    {
+        unlink_sibling(node);
+        free(node->name);
+        node->name = name_copy;
+        link_sibling(node, parent);
+        return node;
+    }
+
+    if (table->cnt >= table->bucket_cnt)
+        grow(table);
+
+    node = calloc(1, sizeof(watch_node));
+    if (node == NULL)
+        ERR("calloc");
+    node->wd = wd;
+    node->name = name_copy;
+    link_sibling(node, parent);
+
+    size_t b = bucket_of(table, wd);
+    node->next = table->buckets[b];
+    table->buckets[b] = node;
+    table->cnt++;
+    return node;
+}
+
+watch_node *watch_child(watch_node *parent, const char *name)
+{
+    for (watch_node *child = parent->children; child; child = child->next_sibling)
+    {
+        if (strcmp(child->name, name) == 0)
+            return child;
+    }
+    return NULL;
+}
+
+static void evict(watch_table *table, watch_node *node, int fd)
+{
+    while (node->children)
+    {
+        watch_node *child = node->children;
+        node->children = child->next_sibling;
+        evict(table, child, fd);
+    }
+
+    watch_node **link = &table->buckets[bucket_of(table, node->wd)];
+    while (*link != node)
+        link = &(*link)->next;
+    *link = node->next;
+    table->cnt--;
+
+    /* deleted directories lose their watch anyway, moved-out ones must be dropped */
+    if (fd >= 0)
+        inotify_rm_watch(fd, node->wd);
+
+    free(node->name);
+    free(node);
+}
+
+/* forget node and everything below it, pass the inotify fd to also drop the kernel watches */
+void watch_remove(watch_table *table, watch_node *node, int fd)
+{
+    unlink_sibling(node);
+    evict(table, node, fd);
+}
+
+/* write the path of node relative to the root ("" for the root itself)
+ * returns: 0 on success, -1 if it doesn't fit into size
+ */
+int watch_rel_path(watch_node *node, char *buf, size_t size)
+{
+    size_t pos = size - 1;
+    buf[pos] = '\0';
+
+    for (watch_node *n = node; n->parent; n = n->parent)
+    {
+        size_t len = strlen(n->name);
+        if (len + 1 > pos)
+            return -1;
+
+        pos -= len;
+        memcpy(buf + pos, n->name, len);
+        if (n->parent->parent)
+            buf[--pos] = '/';
+    }
+
+    memmove(buf, buf + pos, size - pos);
+    return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stddef.h>
+
+/* one watched directory, its path is rebuilt from the parent chain on demand */
+typedef struct WatchNode
+{
+    int wd;
+    char *name; /* last path component, the full source path for the root */
+    struct WatchNode *parent;
+    struct WatchNode *children;
+    struct WatchNode *prev_sibling;
+    struct WatchNode *next_sibling;
+    struct WatchNode *next; /* hash chain */
+} watch_node;
+
+typedef struct WatchTable
+{
+    watch_node **buckets;
+    size_t bucket_cnt;
+    size_t cnt;
+} watch_table;
+
+watch_table *watch_table_create(void);
+
+void watch_table_destroy(watch_table *);
+
+watch_node *watch_add(watch_table *, int, watch_node *, const char *);
+
+watch_node *watch_find(watch_table *, int);
+
+watch_node *watch_child(watch_node *, const char *);
+
+void watch_remove(watch_table *, watch_node *, int);
+
+int watch_rel_path(watch_node *, char *, size_t);
+
+#endif
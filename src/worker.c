@@ -7,13 +7,16 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "engine.h"
 #include "fileproc.h"
+#include "iopolicy.h"
+#include "stats.h"
 #include "synchro.h"
 #include "utils.h"
 #include "worker.h"
 
 /* add worker to workers provided as an argument */
-void add_worker(char *src, char *dst, pid_t pid, workerList *workers)
+void add_worker(char *src, char *dst, pid_t pid, int slot, int stats, int backup, workerList *workers)
 {
     /* resize if necessary */
     if (workers->size >= workers->capacity)
@@ -29,11 +32,14 @@ void add_worker(char *src, char *dst, pid_t pid, workerList *workers)
     workers->list[workers->size].source = strdup(src);
     workers->list[workers->size].destination = strdup(dst);
     workers->list[workers->size].pid = pid;
+    workers->list[workers->size].slot = slot;
+    workers->list[workers->size].stats = stats;
+    workers->list[workers->size].backup = backup;
 
     workers->size++;
 }
 
-/* delete a worker with a given pid
+/* delete all workers served by a given pid
  * returns: 0 - success, -1 failure
  */
 int delete_workers_by_pid(pid_t pid, workerList *workers)
@@ -41,40 +47,69 @@ int delete_workers_by_pid(pid_t pid, workerList *workers)
     if (workers == NULL || workers->size == 0)
         return -1;
 
-    int worker_idx = -1;
-    int i = 0, worker_cnt = workers->size;
-    while (i < worker_cnt)
+    int write_idx = 0;
+    int result = -1;
+    for (int i = 0; i < workers->size; i++)
     {
         if (workers->list[i].pid == pid)
         {
-            worker_idx = i;
+            result = 0;
 
             // Free dynamically allocated path strings before deletion
             free(workers->list[i].source);
             free(workers->list[i].destination);
+            continue;
+        }
 
-            break;
+        /* overwrite the worker*/
+        if (i != write_idx)
+        {
+            workers->list[write_idx] = workers->list[i];
         }
-        i++;
+        write_idx++;
     }
 
     /* worker with this pid not found (deletion by end)*/
-    if (worker_idx == -1)
-    {
-        return -1;
-    }
+    workers->size = write_idx;
+    return result;
+}
 
-    /* overwrite the worker*/
-    if (worker_idx != worker_cnt - 1)
+/* delete all workers of one backup inside the engine process
+ * returns: 0 - success, -1 failure
+ */
+int delete_workers_by_backup(int backup, workerList *workers)
+{
+    int write_idx = 0;
+    int result = -1;
+    for (int i = 0; i < workers->size; i++)
     {
-        if (memmove(workers->list + worker_idx, workers->list + worker_idx + 1,
-                    (worker_cnt - worker_idx - 1) * sizeof(worker)) == NULL)
+        if (workers->list[i].backup == backup)
+        {
+            result = 0;
+            free(workers->list[i].source);
+            free(workers->list[i].destination);
+            continue;
+        }
+
+        if (i != write_idx)
         {
-            ERR("memmove");
+            workers->list[write_idx] = workers->list[i];
         }
+        write_idx++;
     }
 
-    workers->size--;
+    workers->size = write_idx;
+    return result;
+}
+
+/* return 1 if a worker other than skip_idx (and not marked) belongs to the same backup */
+static int backup_shared(worker *w, int skip_idx, char *marked, workerList *workers)
+{
+    for (int i = 0; i < workers->size; i++)
+    {
+        if (i != skip_idx && !marked[i] && workers->list[i].pid == w->pid && workers->list[i].backup == w->backup)
+            return 1;
+    }
     return 0;
 }
 
@@ -88,12 +123,12 @@ int delete_workers_by_paths(char *src, char **dsts, workerList *workers)
         return -1;
     }
 
-    int write_idx = 0;
-    int result = 0;
+    char *marked = calloc(workers->size, sizeof(char));
+    if (marked == NULL)
+        ERR("calloc");
+
     for (int i = 0; i < workers->size; i++)
     {
-        int should_delete = 0;
-
         if (strcmp(workers->list[i].source, src) == 0)
         {
             /* check if one of destination matches */
@@ -102,18 +137,45 @@ int delete_workers_by_paths(char *src, char **dsts, workerList *workers)
             {
                 if (strcmp(workers->list[i].destination, dsts[j]) == 0)
                 {
-                    should_delete = 1;
+                    marked[i] = 1;
                     break;
                 }
                 j++;
             }
         }
+    }
+
+    /* fan-out process keeps running for its other targets */
+    for (int i = 0; i < workers->size; i++)
+    {
+        if (!marked[i])
+            continue;
 
-        if (should_delete)
+        worker *w = &workers->list[i];
+        int shared = backup_shared(w, i, marked, workers);
+
+        if (w->backup >= 0)
         {
-            result = 1;
+            engine_end(w->backup, shared ? w->slot : -1);
+        }
+        else if (shared)
+        {
+            union sigval value = {.sival_int = w->slot};
+            sigqueue(w->pid, SIGUSR1, value);
+        }
+        else
+        {
+            kill(w->pid, SIGTERM);
+        }
+    }
 
-            kill(workers->list[i].pid, SIGTERM);
+    int write_idx = 0;
+    int result = 0;
+    for (int i = 0; i < workers->size; i++)
+    {
+        if (marked[i])
+        {
+            result = 1;
             free(workers->list[i].source);
             free(workers->list[i].destination);
         }
@@ -128,6 +190,7 @@ int delete_workers_by_paths(char *src, char **dsts, workerList *workers)
         }
     }
     workers->size = write_idx;
+    free(marked);
 
     return result;
 }
@@ -168,10 +231,47 @@ void display_workerList(workerList *workers)
     }
 }
 
-/* start backup from src to dst path */
-void backup_work(char *src, char *dst)
+/* live counters of every backup, the targets of one fan-out backup share them */
+void display_worker_stats(workerList *workers)
+{
+    if (workers->size == 0)
+    {
+        printf("no backup in progress\n");
+    }
+
+    for (int i = 0; i < workers->size; i++)
+    {
+        printf("backup no.%d: %s -> %s\n", i, workers->list[i].source, workers->list[i].destination);
+        if (i + 1 < workers->size && workers->list[i + 1].pid == workers->list[i].pid &&
+            workers->list[i + 1].backup == workers->list[i].backup)
+            continue;
+        stats_print(stdout, workers->list[i].stats);
+    }
+}
+
+/* start backup from src to cnt dst paths, source is read once for all of them */
+void backup_work(char *src, char **dsts, int cnt, const backup_opts *opts)
 {
-    // setup_target_dir(dst);
-    start_copy(src, dst);
-    synchronize(src, dst);
+    fanout *fo = fanout_create(src, dsts, cnt);
+    fo->delta_min = (off_t)opts->delta_mib << 20;
+    fo->compress = opts->compress;
+    io_configure(opts->direct);
+    if (opts->store && fanout_use_store(fo, opts->store) != 0)
+        ERR("dedup_open");
+    if (opts->pack && fanout_use_packs(fo) != 0)
+        ERR("pack_open");
+    if (opts->journal && fanout_use_journal(fo) != 0)
+        ERR("journal_open");
+    fanout_install_detach(fo);
+
+    stats_set_phase(STATS_COPYING);
+    start_copy(src, fo, opts);
+    stats_set_phase(STATS_WATCHING);
+    synchronize(src, fo, opts);
+    stats_set_phase(STATS_DONE);
+
+    dedup_store *store = fo->store;
+    fanout_destroy(fo);
+    if (store)
+        dedup_close(store);
 }
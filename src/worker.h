@@ -4,12 +4,16 @@
 #include <stddef.h>
 #include <sys/types.h>
 #include "fileproc.h"
+#include "opts.h"
 #include "utils.h"
 typedef struct Worker
 {
     char *source;
     char *destination;
     pid_t pid;
+    int slot;  /* index of destination inside its worker process */
+    int stats;  /* shared statistics slot of the worker process, -1 if none */
+    int backup; /* id of the backup inside the engine process, -1 for a process of its own */
 } worker;
 
 typedef struct WorkerList
@@ -19,7 +23,7 @@ typedef struct WorkerList
     worker *list;
 } workerList;
 
-void add_worker(char *, char *, pid_t, workerList *);
+void add_worker(char *, char *, pid_t, int, int, int, workerList *);
 
 void delete_all_workers(workerList *);
 
@@ -27,10 +31,14 @@ int delete_workers_by_pid(pid_t, workerList *);
 
 int delete_workers_by_paths(char *, char **, workerList *);
 
+int delete_workers_by_backup(int, workerList *);
+
 void init_workerList(workerList **);
 
 void display_workerList(workerList *);
 
-void backup_work(char *, char *);
+void display_worker_stats(workerList *);
+
+void backup_work(char *, char **, int, const backup_opts *);
 
 #endif